@@ -0,0 +1,110 @@
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "bit_stream.h"
+
+#define BIT_BUFFER_SIZE 65536
+
+int bit_reader_init(struct bit_reader *reader, struct stream *stream, int flags) {
+	memset(reader, 0, sizeof(*reader));
+	reader->stream = stream;
+	reader->lsb_first = (flags & BIT_LSB_FIRST) != 0;
+	if(flags & BIT_MAP) {
+		size_t len = 0;
+		long pos = stream_tell(stream);
+		const uint8_t *mem = pos >= 0 ? stream_get_memory_access(stream, &len) : 0;
+		if(mem && (size_t)pos <= len) {
+			reader->data = reader->next = mem + pos;
+			reader->end = mem + len;
+			reader->eof = 1;
+			reader->mapped = 1;
+			return 0;
+		}
+		if(mem) stream_revoke_memory_access(stream);
+	}
+	reader->buf_size = BIT_BUFFER_SIZE;
+	reader->buf = malloc(reader->buf_size);
+	if(!reader->buf) return ENOMEM;
+	reader->data = reader->next = reader->end = reader->buf;
+	return 0;
+}
+
+void bit_reader_refill_slow(struct bit_reader *reader) {
+	if(reader->buf && !reader->eof) {
+		size_t left = reader->end - reader->next;
+		reader->base += reader->next - reader->data;
+		memmove(reader->buf, reader->next, left);
+		reader->data = reader->next = reader->buf;
+		reader->end = reader->buf + left;
+		// short reads, such as from pipes, are repeated until a whole load is available
+		while(reader->end - reader->next < 8 && !reader->eof) {
+			uint8_t *end = reader->buf + (reader->end - reader->buf);
+			ssize_t n = stream_read(reader->stream, end, reader->buf + reader->buf_size - end);
+			if(n > 0) {
+				reader->end += n;
+				continue;
+			}
+			reader->eof = 1;
+			if(n < 0) reader->_errno = reader->stream->_errno ? reader->stream->_errno : EIO;
+		}
+		if(reader->end - reader->next >= 8) {
+			bit_reader_refill(reader);
+			return;
+		}
+	}
+	// the last bytes of the stream, one at a time
+	while(reader->count <= 56 && reader->next < reader->end) {
+		uint64_t byte = *reader->next++;
+		reader->bits |= reader->lsb_first ? byte << reader->count : byte << (56 - reader->count);
+		reader->count += 8;
+	}
+}
+
+void bit_reader_align(struct bit_reader *reader) {
+	// the bit buffer holds whole bytes less what was consumed of them
+	bit_reader_skip(reader, reader->count & 7);
+}
+
+uint64_t bit_reader_tell(const struct bit_reader *reader) {
+	return (reader->base + (uint64_t)(reader->next - reader->data)) * 8 - reader->count;
+}
+
+void bit_reader_destroy(struct bit_reader *reader) {
+	free(reader->buf);
+	reader->buf = 0;
+	if(reader->mapped) stream_revoke_memory_access(reader->stream);
+	reader->mapped = 0;
+}
+
+int bit_writer_init(struct bit_writer *writer, struct stream *stream, int flags) {
+	memset(writer, 0, sizeof(*writer));
+	writer->stream = stream;
+	writer->lsb_first = (flags & BIT_LSB_FIRST) != 0;
+	writer->size = BIT_BUFFER_SIZE + 8;
+	writer->buf = malloc(writer->size);
+	return writer->buf ? 0 : ENOMEM;
+}
+
+void bit_writer_drain(struct bit_writer *writer) {
+	if(writer->len && !writer->_errno) {
+		ssize_t n = stream_write(writer->stream, writer->buf, writer->len);
+		if(n != (ssize_t)writer->len) writer->_errno = writer->stream->_errno ? writer->stream->_errno : EIO;
+	}
+	writer->len = 0;
+}
+
+void bit_writer_align(struct bit_writer *writer) {
+	if(writer->count) bit_writer_write(writer, 0, 8 - writer->count);
+}
+
+int bit_writer_flush(struct bit_writer *writer) {
+	bit_writer_align(writer);
+	bit_writer_drain(writer);
+	return writer->_errno;
+}
+
+void bit_writer_destroy(struct bit_writer *writer) {
+	free(writer->buf);
+	writer->buf = 0;
+}
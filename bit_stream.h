@@ -0,0 +1,227 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "stream_base.h"
+
+// bit_reader_init() and bit_writer_init() flags
+#define BIT_LSB_FIRST 0x01 // least significant bit of each byte first, as in deflate, otherwise most significant first
+#define BIT_MAP       0x02 // read from stream_get_memory_access() when the stream allows it, otherwise through a buffer
+
+// most bits read or written per call
+#define BIT_MAX_BITS 57
+
+/**
+ * @struct bit_reader
+ * @brief Reads bit fields from a stream through a 64-bit bit buffer.
+ *
+ * The bit buffer is refilled by whole 8-byte loads without branching on
+ * how many bits it still holds, which leaves at least 57 bits to peek at.
+ * Bytes come from the mapped content of the stream or from a buffer of
+ * reads. Bits past the end of the stream read as 0.
+ */
+struct bit_reader {
+	uint64_t bits;             /**< Next bit in bit 0 with BIT_LSB_FIRST, in bit 63 otherwise */
+	unsigned count;            /**< Valid bits in bits */
+	int lsb_first;
+	const uint8_t *next, *end; /**< Bytes not yet loaded into bits */
+	const uint8_t *data;       /**< Start of the mapped content or of buf */
+	struct stream *stream;
+	uint8_t *buf;              /**< Read buffer, NULL when reading mapped content */
+	int mapped;                /**< data was mapped with stream_get_memory_access(), revoked by bit_reader_destroy() */
+	size_t buf_size;
+	uint64_t base;             /**< Bytes consumed before the start of the data next points into */
+	int eof;                   /**< The stream has no more bytes */
+	int past_end;              /**< More bits were consumed than the stream holds */
+	int _errno;                /**< Error of reading the stream */
+};
+
+/**
+ * @brief Start reading bits at the current position of a stream.
+ *
+ * The reader reads ahead of the bits it returned, so the position of the
+ * stream is unspecified until the reader is destroyed.
+ * @param reader Pointer to the bit reader object.
+ * @param stream Stream to read from.
+ * @param flags BIT_LSB_FIRST, BIT_MAP.
+ * @return Status code.
+ */
+int bit_reader_init(struct bit_reader *reader, struct stream *stream, int flags);
+
+/**
+ * @brief Load more bytes into the bit buffer, near the end of the buffered or mapped data.
+ * @param reader Pointer to the bit reader object.
+ */
+void bit_reader_refill_slow(struct bit_reader *reader);
+
+static inline uint64_t bit_load_le64(const uint8_t *p) {
+	return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24
+		| (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 | (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+static inline uint64_t bit_load_be64(const uint8_t *p) {
+	return (uint64_t)p[0] << 56 | (uint64_t)p[1] << 48 | (uint64_t)p[2] << 40 | (uint64_t)p[3] << 32
+		| (uint64_t)p[4] << 24 | (uint64_t)p[5] << 16 | (uint64_t)p[6] << 8 | (uint64_t)p[7];
+}
+
+/**
+ * @brief Fill the bit buffer to at least 57 bits, unless the stream ends first.
+ *
+ * Bits of a byte that only partly fits are loaded again by the next
+ * refill, into the same position, so they are OR'ed in twice.
+ * @param reader Pointer to the bit reader object.
+ */
+static inline void bit_reader_refill(struct bit_reader *reader) {
+	if(reader->end - reader->next < 8) {
+		bit_reader_refill_slow(reader);
+		return;
+	}
+	if(reader->lsb_first) reader->bits |= bit_load_le64(reader->next) << reader->count;
+	else reader->bits |= bit_load_be64(reader->next) >> reader->count;
+	unsigned bytes = (64 - reader->count) >> 3;
+	reader->next += bytes;
+	reader->count += bytes << 3;
+}
+
+/**
+ * @brief Get the next bits without consuming them.
+ * @param reader Pointer to the bit reader object.
+ * @param n Number of bits, 1 to BIT_MAX_BITS.
+ * @return The bits, the first one as the most significant with MSB first order, as the least significant with BIT_LSB_FIRST.
+ */
+static inline uint64_t bit_reader_peek(struct bit_reader *reader, unsigned n) {
+	if(reader->count < n) bit_reader_refill(reader);
+	return reader->lsb_first ? reader->bits & (((uint64_t)1 << n) - 1) : reader->bits >> (64 - n);
+}
+
+/**
+ * @brief Consume bits.
+ * @param reader Pointer to the bit reader object.
+ * @param n Number of bits, 0 to BIT_MAX_BITS.
+ */
+static inline void bit_reader_skip(struct bit_reader *reader, unsigned n) {
+	if(reader->count < n) {
+		bit_reader_refill(reader);
+		if(reader->count < n) {
+			reader->past_end = 1;
+			n = reader->count;
+		}
+	}
+	reader->bits = reader->lsb_first ? reader->bits >> n : reader->bits << n;
+	reader->count -= n;
+}
+
+/**
+ * @brief Read and consume bits.
+ * @param reader Pointer to the bit reader object.
+ * @param n Number of bits, 1 to BIT_MAX_BITS.
+ * @return The bits, ordered as by bit_reader_peek().
+ */
+static inline uint64_t bit_reader_read(struct bit_reader *reader, unsigned n) {
+	uint64_t r = bit_reader_peek(reader, n);
+	bit_reader_skip(reader, n);
+	return r;
+}
+
+/**
+ * @brief Skip to the next byte boundary.
+ * @param reader Pointer to the bit reader object.
+ */
+void bit_reader_align(struct bit_reader *reader);
+
+/**
+ * @brief Get the number of bits consumed since the reader was initialized.
+ * @param reader Pointer to the bit reader object.
+ */
+uint64_t bit_reader_tell(const struct bit_reader *reader);
+
+/**
+ * @brief Release the reader, the stream is left open.
+ * @param reader Pointer to the bit reader object.
+ */
+void bit_reader_destroy(struct bit_reader *reader);
+
+/**
+ * @struct bit_writer
+ * @brief Writes bit fields to a stream through a 64-bit bit buffer.
+ *
+ * Whole bytes of the bit buffer are stored to a byte buffer with one
+ * 8-byte store per call, and the byte buffer is written to the stream
+ * when it fills up.
+ */
+struct bit_writer {
+	uint64_t bits;             /**< Pending bits, laid out as in bit_reader */
+	unsigned count;            /**< Pending bits, less than 8 between calls */
+	int lsb_first;
+	uint8_t *buf;
+	size_t len, size;          /**< Bytes in buf, its size including 8 bytes of slack */
+	struct stream *stream;
+	int _errno;                /**< Error of writing the stream */
+};
+
+/**
+ * @brief Start writing bits at the current position of a stream.
+ * @param writer Pointer to the bit writer object.
+ * @param stream Stream to write to.
+ * @param flags BIT_LSB_FIRST.
+ * @return Status code.
+ */
+int bit_writer_init(struct bit_writer *writer, struct stream *stream, int flags);
+
+/**
+ * @brief Write the byte buffer to the stream.
+ * @param writer Pointer to the bit writer object.
+ */
+void bit_writer_drain(struct bit_writer *writer);
+
+static inline void bit_store_le64(uint8_t *p, uint64_t v) {
+	for(int i = 0; i < 8; i++)
+		p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static inline void bit_store_be64(uint8_t *p, uint64_t v) {
+	for(int i = 0; i < 8; i++)
+		p[i] = (uint8_t)(v >> (56 - 8 * i));
+}
+
+/**
+ * @brief Write bits.
+ * @param writer Pointer to the bit writer object.
+ * @param value The bits, ordered as returned by bit_reader_peek(), higher bits are ignored.
+ * @param n Number of bits, 1 to BIT_MAX_BITS.
+ */
+static inline void bit_writer_write(struct bit_writer *writer, uint64_t value, unsigned n) {
+	value &= ((uint64_t)1 << n) - 1;
+	if(writer->lsb_first) writer->bits |= value << writer->count;
+	else writer->bits |= value << (64 - writer->count - n);
+	writer->count += n;
+	if(writer->size - writer->len < 8) bit_writer_drain(writer);
+	if(writer->lsb_first) bit_store_le64(writer->buf + writer->len, writer->bits);
+	else bit_store_be64(writer->buf + writer->len, writer->bits);
+	// up to 8 bytes are done, shifted out in two halves since a shift by 64 is undefined
+	unsigned bytes = writer->count >> 3;
+	writer->len += bytes;
+	if(writer->lsb_first) writer->bits = writer->bits >> (bytes << 2) >> (bytes << 2);
+	else writer->bits = writer->bits << (bytes << 2) << (bytes << 2);
+	writer->count &= 7;
+}
+
+/**
+ * @brief Pad with 0 bits to the next byte boundary.
+ * @param writer Pointer to the bit writer object.
+ */
+void bit_writer_align(struct bit_writer *writer);
+
+/**
+ * @brief Pad to a byte boundary and write everything to the stream.
+ * @param writer Pointer to the bit writer object.
+ * @return Status code.
+ */
+int bit_writer_flush(struct bit_writer *writer);
+
+/**
+ * @brief Release the writer without flushing it, the stream is left open.
+ * @param writer Pointer to the bit writer object.
+ */
+void bit_writer_destroy(struct bit_writer *writer);
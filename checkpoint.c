@@ -0,0 +1,80 @@
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "checkpoint.h"
+#include "file_stream.h"
+
+#define CHECKPOINT_MAGIC "SLCHKPT"
+#define CHECKPOINT_VERSION 1
+
+struct checkpoint_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	int64_t entry;
+	uint64_t root_len;
+	uint64_t path_len;
+};
+
+static int checkpoint_read_string(struct stream *s, uint64_t len, char **str) {
+	*str = malloc(len + 1);
+	if(!*str) return ENOMEM;
+	if(stream_read(s, *str, len) != (ssize_t)len) return EINVAL;
+	(*str)[len] = 0;
+	return 0;
+}
+
+int checkpoint_load(struct checkpoint *checkpoint, const char *filename) {
+	memset(checkpoint, 0, sizeof(*checkpoint));
+	struct file_stream s;
+	int r = file_stream_init(&s, filename, "rb", 0);
+	if(r) return r;
+	struct checkpoint_header h;
+	r = EINVAL;
+	if(stream_read(&s.stream, &h, sizeof(h)) == sizeof(h) && !memcmp(h.magic, CHECKPOINT_MAGIC, sizeof(h.magic))
+		&& h.version == CHECKPOINT_VERSION && h.root_len < 65536 && h.path_len < 65536) {
+		r = checkpoint_read_string(&s.stream, h.root_len, &checkpoint->root);
+		if(!r) r = checkpoint_read_string(&s.stream, h.path_len, &checkpoint->path);
+		checkpoint->entry = h.entry;
+	}
+	stream_close(&s.stream);
+	if(r) checkpoint_free(checkpoint);
+	return r;
+}
+
+int checkpoint_save(const struct checkpoint *checkpoint, const char *filename) {
+	size_t tmp_len = strlen(filename) + 5;
+	char *tmp = malloc(tmp_len);
+	if(!tmp) return ENOMEM;
+	snprintf(tmp, tmp_len, "%s.tmp", filename);
+
+	struct checkpoint_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, CHECKPOINT_MAGIC, sizeof(h.magic));
+	h.version = CHECKPOINT_VERSION;
+	h.entry = checkpoint->entry;
+	h.root_len = strlen(checkpoint->root);
+	h.path_len = strlen(checkpoint->path);
+
+	struct file_stream s;
+	int r = file_stream_init(&s, tmp, "wb", 0);
+	if(r) goto out;
+	if(stream_write(&s.stream, &h, sizeof(h)) != sizeof(h)
+		|| stream_write(&s.stream, checkpoint->root, h.root_len) != (ssize_t)h.root_len
+		|| stream_write(&s.stream, checkpoint->path, h.path_len) != (ssize_t)h.path_len)
+		r = EIO;
+	if(stream_close(&s.stream) && !r) r = EIO;
+	if(!r && rename(tmp, filename)) r = errno;
+	if(r) remove(tmp);
+out:
+	free(tmp);
+	return r;
+}
+
+void checkpoint_free(struct checkpoint *checkpoint) {
+	free(checkpoint->root);
+	free(checkpoint->path);
+	memset(checkpoint, 0, sizeof(*checkpoint));
+}
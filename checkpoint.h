@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * @struct checkpoint
+ * @brief Position of an each_file walk that visits directories in name order.
+ *
+ * Because every directory is walked in name order, the last completed file
+ * determines which files were completed before it: the components of its
+ * path are the cursors of the directory stack. The file is a header
+ * followed by the root and the path, in host byte order.
+ */
+struct checkpoint {
+	char *root;      /**< Root of the walk */
+	char *path;      /**< Last completed file, relative to root */
+	int64_t entry;   /**< Last completed entry of the archive at path, -1 if the whole file was completed */
+};
+
+/**
+ * @brief Load a checkpoint.
+ * @param checkpoint Pointer to the checkpoint object.
+ * @param filename Checkpoint file name.
+ * @return Status code, ENOENT if there is no checkpoint.
+ */
+int checkpoint_load(struct checkpoint *checkpoint, const char *filename);
+
+/**
+ * @brief Write a checkpoint, replacing the file atomically.
+ * @param checkpoint Pointer to the checkpoint object.
+ * @param filename Checkpoint file name.
+ * @return Status code.
+ */
+int checkpoint_save(const struct checkpoint *checkpoint, const char *filename);
+
+/**
+ * @brief Release a loaded checkpoint.
+ * @param checkpoint Pointer to the checkpoint object.
+ */
+void checkpoint_free(struct checkpoint *checkpoint);
@@ -0,0 +1,222 @@
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "dir_cache.h"
+#include "util.h"
+
+#define DIR_CACHE_MAGIC "SLDIRC1"
+#define DIR_CACHE_VERSION 2
+
+struct dir_cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	uint64_t num_dirs;
+	uint64_t num_entries;
+	uint64_t heap_size;
+};
+
+int dir_cache_open(struct dir_cache *cache, const char *filename) {
+	memset(cache, 0, sizeof(*cache));
+	cache->filename = strdup(filename);
+	if(!cache->filename) return ENOMEM;
+
+	int r = file_stream_init(&cache->file, filename, "rb", 0);
+	if(r == ENOENT) return 0;
+	if(r) goto fail;
+	cache->file_open = 1;
+
+	size_t len = 0;
+	const uint8_t *data = stream_get_memory_access(&cache->file.stream, &len);
+	if(!data) {
+		// an empty file cannot be mapped, treat it as an empty cache
+		r = len ? cache->file.stream._errno : 0;
+		stream_close(&cache->file.stream);
+		cache->file_open = 0;
+		if(r) goto fail;
+		return 0;
+	}
+
+	const struct dir_cache_header *h = (const struct dir_cache_header *)data;
+	r = EINVAL;
+	if(len < sizeof(*h) || memcmp(h->magic, DIR_CACHE_MAGIC, sizeof(h->magic)) || h->version != DIR_CACHE_VERSION)
+		goto fail_mapped;
+	if(h->num_dirs > (len - sizeof(*h)) / sizeof(struct dir_cache_dir))
+		goto fail_mapped;
+	uint64_t entries_start = sizeof(*h) + h->num_dirs * sizeof(struct dir_cache_dir);
+	if(h->num_entries > (len - entries_start) / sizeof(struct dir_cache_entry))
+		goto fail_mapped;
+	uint64_t heap_start = entries_start + h->num_entries * sizeof(struct dir_cache_entry);
+	if(h->heap_size != len - heap_start || (h->heap_size && data[len - 1]))
+		goto fail_mapped;
+	cache->old_dirs = (const struct dir_cache_dir *)(data + sizeof(*h));
+	cache->num_old_dirs = h->num_dirs;
+	cache->old_entries = (const struct dir_cache_entry *)(data + entries_start);
+	cache->num_old_entries = h->num_entries;
+	cache->old_heap = (const char *)data + heap_start;
+	for(uint64_t i = 0; i < cache->num_old_dirs; i++) {
+		const struct dir_cache_dir *d = &cache->old_dirs[i];
+		if(d->path >= h->heap_size || d->first > h->num_entries || d->count > h->num_entries - d->first)
+			goto fail_mapped;
+	}
+	for(uint64_t i = 0; i < cache->num_old_entries; i++) {
+		if(cache->old_entries[i].name >= h->heap_size)
+			goto fail_mapped;
+	}
+	return 0;
+
+fail_mapped:
+	stream_revoke_memory_access(&cache->file.stream);
+	stream_close(&cache->file.stream);
+	cache->file_open = 0;
+	cache->old_dirs = 0;
+	cache->num_old_dirs = 0;
+fail:
+	free(cache->filename);
+	cache->filename = 0;
+	return r;
+}
+
+const struct dir_cache_entry *dir_cache_lookup(struct dir_cache *cache, const char *path, const struct stat *st, size_t *num_entries) {
+	uint64_t lo = 0, hi = cache->num_old_dirs;
+	while(lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		const struct dir_cache_dir *d = &cache->old_dirs[mid];
+		int c = strcmp(path, cache->old_heap + d->path);
+		if(!c) {
+			if(d->mtime_ns != STAT_MTIME_NS(st) || d->ctime_ns != STAT_CTIME_NS(st))
+				return 0;
+			if(num_entries) *num_entries = d->count;
+			return cache->old_entries + d->first;
+		}
+		if(c < 0) hi = mid;
+		else lo = mid + 1;
+	}
+	return 0;
+}
+
+const char *dir_cache_entry_name(struct dir_cache *cache, const struct dir_cache_entry *entry) {
+	return cache->old_heap + entry->name;
+}
+
+static int dir_cache_heap_append(struct dir_cache *cache, const char *str, uint64_t *offset) {
+	size_t len = strlen(str) + 1;
+	if(cache->heap_len + len > cache->heap_alloc) {
+		size_t alloc = cache->heap_alloc ? cache->heap_alloc : 4096;
+		while(alloc < cache->heap_len + len) alloc *= 2;
+		char *heap = realloc(cache->heap, alloc);
+		if(!heap) return ENOMEM;
+		cache->heap = heap;
+		cache->heap_alloc = alloc;
+	}
+	*offset = cache->heap_len;
+	memcpy(cache->heap + cache->heap_len, str, len);
+	cache->heap_len += len;
+	return 0;
+}
+
+int dir_cache_put(struct dir_cache *cache, const char *path, const struct stat *st, const struct dir_cache_entry *entries, size_t num_entries, const char *names) {
+	if(cache->num_dirs >= cache->dirs_alloc) {
+		size_t alloc = cache->dirs_alloc ? cache->dirs_alloc * 2 : 64;
+		struct dir_cache_dir *dirs = realloc(cache->dirs, alloc * sizeof(*dirs));
+		if(!dirs) return ENOMEM;
+		cache->dirs = dirs;
+		cache->dirs_alloc = alloc;
+	}
+	if(cache->num_entries + num_entries > cache->entries_alloc) {
+		size_t alloc = cache->entries_alloc ? cache->entries_alloc : 256;
+		while(alloc < cache->num_entries + num_entries) alloc *= 2;
+		struct dir_cache_entry *e = realloc(cache->entries, alloc * sizeof(*e));
+		if(!e) return ENOMEM;
+		cache->entries = e;
+		cache->entries_alloc = alloc;
+	}
+
+	struct dir_cache_dir d;
+	memset(&d, 0, sizeof(d));
+	if(dir_cache_heap_append(cache, path, &d.path)) return ENOMEM;
+	d.mtime_ns = STAT_MTIME_NS(st);
+	d.ctime_ns = STAT_CTIME_NS(st);
+	d.first = cache->num_entries;
+	d.count = num_entries;
+	for(size_t i = 0; i < num_entries; i++) {
+		struct dir_cache_entry e = entries[i];
+		if(dir_cache_heap_append(cache, names + entries[i].name, &e.name)) return ENOMEM;
+		cache->entries[cache->num_entries + i] = e;
+	}
+	cache->num_entries += num_entries;
+	cache->dirs[cache->num_dirs++] = d;
+	return 0;
+}
+
+struct dir_cache_sort {
+	const char *path;
+	size_t index;
+};
+
+static int dir_cache_sort_cmp(const void *a, const void *b) {
+	const struct dir_cache_sort *sa = a, *sb = b;
+	return strcmp(sa->path, sb->path);
+}
+
+int dir_cache_save(struct dir_cache *cache) {
+	struct dir_cache_sort *order = malloc((cache->num_dirs ? cache->num_dirs : 1) * sizeof(*order));
+	if(!order) return ENOMEM;
+	for(size_t i = 0; i < cache->num_dirs; i++) {
+		order[i].path = cache->heap + cache->dirs[i].path;
+		order[i].index = i;
+	}
+	qsort(order, cache->num_dirs, sizeof(*order), dir_cache_sort_cmp);
+
+	size_t tmp_len = strlen(cache->filename) + 5;
+	char *tmp = malloc(tmp_len);
+	if(!tmp) {
+		free(order);
+		return ENOMEM;
+	}
+	snprintf(tmp, tmp_len, "%s.tmp", cache->filename);
+
+	struct dir_cache_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, DIR_CACHE_MAGIC, sizeof(h.magic));
+	h.version = DIR_CACHE_VERSION;
+	h.num_dirs = cache->num_dirs;
+	h.num_entries = cache->num_entries;
+	h.heap_size = cache->heap_len;
+
+	struct file_stream s;
+	int r = file_stream_init(&s, tmp, "wb", 0);
+	if(r) goto out;
+	if(stream_write(&s.stream, &h, sizeof(h)) != sizeof(h))
+		r = EIO;
+	for(size_t i = 0; !r && i < cache->num_dirs; i++) {
+		if(stream_write(&s.stream, &cache->dirs[order[i].index], sizeof(struct dir_cache_dir)) != sizeof(struct dir_cache_dir))
+			r = EIO;
+	}
+	size_t entries_size = cache->num_entries * sizeof(struct dir_cache_entry);
+	if(!r && stream_write(&s.stream, cache->entries, entries_size) != (ssize_t)entries_size)
+		r = EIO;
+	if(!r && stream_write(&s.stream, cache->heap, cache->heap_len) != (ssize_t)cache->heap_len)
+		r = EIO;
+	if(stream_close(&s.stream) && !r) r = EIO;
+	if(!r && rename(tmp, cache->filename)) r = errno;
+	if(r) remove(tmp);
+out:
+	free(tmp);
+	free(order);
+	return r;
+}
+
+void dir_cache_close(struct dir_cache *cache) {
+	if(cache->file_open) {
+		stream_revoke_memory_access(&cache->file.stream);
+		stream_close(&cache->file.stream);
+	}
+	free(cache->dirs);
+	free(cache->entries);
+	free(cache->heap);
+	free(cache->filename);
+	memset(cache, 0, sizeof(*cache));
+}
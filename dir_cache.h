@@ -0,0 +1,123 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+#include "stream_base.h"
+#include "file_stream.h"
+
+// dir_cache_entry types
+#define DIR_CACHE_UNKNOWN 0 /**< Could not be stat'ed, stat again when used */
+#define DIR_CACHE_FILE    1
+#define DIR_CACHE_DIR     2
+
+/**
+ * @struct dir_cache_entry
+ * @brief One cached directory entry. Symbolic links are cached as the type of their target.
+ */
+struct dir_cache_entry {
+	uint64_t name;     /**< Heap offset of the NUL terminated entry name */
+	uint64_t ino;
+	uint32_t type;     /**< DIR_CACHE_* */
+	uint32_t reserved;
+};
+
+/**
+ * @struct dir_cache_dir
+ * @brief One cached directory listing.
+ */
+struct dir_cache_dir {
+	uint64_t path;     /**< Heap offset of the NUL terminated directory path */
+	int64_t mtime_ns;
+	int64_t ctime_ns;
+	uint64_t first;    /**< Index of the first dir_cache_entry */
+	uint64_t count;
+};
+
+/**
+ * @struct dir_cache
+ * @brief Persistent cache of directory listings, keyed by the mtime and ctime of each directory.
+ *
+ * A directory whose mtime and ctime did not change since it was listed is
+ * expanded from the cache instead of being read. Only the name, inode and
+ * type of entries are cached: modifying a file does not change the mtime
+ * of its directory, so its size and times could not be trusted and the
+ * walker stats files when it needs their metadata.
+ *
+ * The file is a header, an array of dir_cache_dir sorted by path, an array
+ * of dir_cache_entry and a heap of names, in host byte order. The previous
+ * cache is memory mapped, the listings of the current run are collected in
+ * memory and written by dir_cache_save().
+ */
+struct dir_cache {
+	char *filename;
+
+	// previous run
+	struct file_stream file;
+	int file_open;
+	const struct dir_cache_dir *old_dirs;
+	uint64_t num_old_dirs;
+	const struct dir_cache_entry *old_entries;
+	uint64_t num_old_entries;
+	const char *old_heap;
+
+	// current run
+	struct dir_cache_dir *dirs;
+	size_t num_dirs, dirs_alloc;
+	struct dir_cache_entry *entries;
+	size_t num_entries, entries_alloc;
+	char *heap;
+	size_t heap_len, heap_alloc;
+};
+
+/**
+ * @brief Open a directory cache, loading the previous run from filename if it exists.
+ * @param cache Pointer to the directory cache object.
+ * @param filename Cache file name.
+ * @return Status code.
+ */
+int dir_cache_open(struct dir_cache *cache, const char *filename);
+
+/**
+ * @brief Look up the listing of a directory.
+ * @param cache Pointer to the directory cache object.
+ * @param path Directory path.
+ * @param st Result of stat() on the directory.
+ * @param num_entries Set to the number of entries.
+ * @return The cached entries, or NULL if the directory is not cached or changed since.
+ */
+const struct dir_cache_entry *dir_cache_lookup(struct dir_cache *cache, const char *path, const struct stat *st, size_t *num_entries);
+
+/**
+ * @brief Get the name of an entry returned by dir_cache_lookup().
+ * @param cache Pointer to the directory cache object.
+ * @param entry Cached entry.
+ * @return Entry name.
+ */
+const char *dir_cache_entry_name(struct dir_cache *cache, const struct dir_cache_entry *entry);
+
+/**
+ * @brief Store the listing of a directory for the next run.
+ * @param cache Pointer to the directory cache object.
+ * @param path Directory path.
+ * @param st Result of stat() on the directory.
+ * @param entries Entries of the directory.
+ * @param num_entries Number of entries.
+ * @param names Base of the name offsets in entries.
+ * @return Status code.
+ */
+int dir_cache_put(struct dir_cache *cache, const char *path, const struct stat *st, const struct dir_cache_entry *entries, size_t num_entries, const char *names);
+
+/**
+ * @brief Write the listings stored in this run to the cache file, replacing it atomically.
+ * @param cache Pointer to the directory cache object.
+ * @return Status code.
+ */
+int dir_cache_save(struct dir_cache *cache);
+
+/**
+ * @brief Release the directory cache without saving.
+ * @param cache Pointer to the directory cache object.
+ */
+void dir_cache_close(struct dir_cache *cache);
@@ -3,36 +3,942 @@
 #include <stdlib.h>
 #include <libgen.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #ifdef __APPLE__
 #include <sys/syslimits.h>
 #endif
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
 #ifdef WIN32
 #include <windows.h>
-#include <fcntl.h>
 #include <io.h>
 #endif
 
 #include "each_file.h"
+#include "prefetch.h"
+#include "inode_set.h"
+#include "each_file_stats.h"
+#include "schedule.h"
+#include "process_pool.h"
+#include "throttle.h"
+#include "path_info.h"
+#include "util.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+#ifndef O_NONBLOCK
+#define O_NONBLOCK 0
+#endif
+
+// number of entries read per batch when not sorting
+#define WALK_DEFAULT_WINDOW 128
+// number of files opened at once to read their headers
+#define WALK_SNIFF_BATCH 64
+// default read ahead per prefetched file
+#define WALK_PREFETCH_BYTES (1 << 20)
+// default number of completed files between checkpoints
+#define WALK_CHECKPOINT_INTERVAL 1000
+// default number of files and zip entries per batch
+#define WALK_BATCH_SIZE 256
+
+// position of a path relative to the checkpoint being resumed from
+#define WALK_RESUME_BEFORE   0
+#define WALK_RESUME_ANCESTOR 1
+#define WALK_RESUME_AT       2
+#define WALK_RESUME_AFTER    3
+
+// walk_file() result for a file that no filter matched
+#define WALK_NO_MATCH (-100)
+// result of an iterator walk that stopped at a file or zip entry to return it, see each_file_iter_next()
+#define WALK_YIELD (-101)
+
+#ifdef __linux__
+// from linux/ioprio.h, which older kernel headers do not have
+#define WALK_IOPRIO_WHO_PROCESS 1
+#define WALK_IOPRIO_CLASS_BE    2
+#define WALK_IOPRIO_CLASS_IDLE  3
+#define WALK_IOPRIO_VALUE(class, level) (((class) << 13) | (level))
+#endif
+
+#ifdef __linux__
+// read directories with getdents64 into a buffer of this size instead of readdir
+#define WALK_GETDENTS
+#define WALK_DENTS_SIZE (256 * 1024)
+
+struct walk_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+#endif
+
+// entry types, same values as DIR_CACHE_*
+#define WALK_UNKNOWN DIR_CACHE_UNKNOWN
+#define WALK_FILE    DIR_CACHE_FILE
+#define WALK_DIR     DIR_CACHE_DIR
+
+struct walk_entry {
+	size_t name;     // offset into walk_frame.names
+	ino_t ino;
+	uint64_t key;    // sort key: inode number or physical offset
+	int type;        // WALK_*
+	ssize_t header_len; // bytes in walk_frame.headers, -1 if not read
+	const char *sort_name; // set while sorting by name
+	double weight;   // sampling weight relative to the directory, 0 if the sample leaves the entry out
+};
+
+struct walk_frame {
+#ifdef WALK_GETDENTS
+	int fd;          // -1 if the directory is not open
+#else
+	DIR *d;          // NULL if the directory is not open
+#endif
+	size_t path_len; // length of walk.path for this directory
+	struct walk_entry *entries;
+	size_t num_entries, entries_alloc, cur;
+	char *names;
+	size_t names_len, names_alloc;
+	uint8_t *headers; // walk.header_len bytes per entry
+	size_t headers_alloc;
+	int eof;
+	uint64_t ns;     // time spent reading the directory and stat'ing its entries
+	double weight;   // inverse of the probability that the sample includes the directory
+};
+
+// file or zip entry passed to its callback, or returned by each_file_iter_next() until the walk continues
+struct walk_item {
+	struct path_info p;
+	char *dirname_str, *basename_str, *ext_str; // strings of p
+	struct lazy_stream s;
+	int has_stream;  // EF_OPEN_STREAM
+	struct file_type_filter *filter;
+	const char *path; // reported in stats
+	int64_t entry;   // index of the zip entry, -1 for a file
+	int compressed;  // a zip entry stored compressed
+	uint64_t start;
+};
+
+#ifdef HAVE_LIBZIP
+// archive whose entries are being matched
+struct walk_zip {
+	zip_t *z;        // NULL if no archive is open
+	const char *path;
+	double weight;
+	int num_entries, next;
+	struct path_info p; // zip_file_* of the entries
+	char *dirname_str, *basename_str; // strings of p
+	char *entry_path; // archive path relative to the root followed by the entry name
+	size_t entry_path_alloc;
+};
+#endif
+
+struct walk {
+	struct file_type_filter *filters;
+	int flags;
+	const struct each_file_options *opts;
+	struct each_file_stats *stats; // NULL if not collected
+
+	// magic table compiled from the options
+	const struct file_magic **magics;
+	size_t num_magics, header_len;
+
+	char *path;
+	size_t path_len, path_alloc;
+	const char *root;
+	size_t root_len; // length of the root directory in path, shards and checkpoints use what follows it
+	int depth_base;  // depth of the walked path below the root, see each_file_below()
+#ifdef WALK_GETDENTS
+	char *dents;     // getdents64 buffer shared by all frames
+#endif
+
+	struct walk_frame *frames;
+	int depth, frames_alloc;
+
+	// files and archives waiting for their callbacks, NULL when not prefetching
+	struct prefetch *prefetch;
+	// files and zip entries waiting for a worker thread, NULL when callbacks run on the walking thread
+	struct schedule *schedule;
+#ifndef WIN32
+	// or worker processes
+	struct process_pool *pool;
+#endif
+	pthread_mutex_t workers_lock;
+	int workers_err;     // a worker could not be set up
+	struct throttle *throttle; // opts->max_*_per_sec, NULL without limits
+	struct throttle limits;    // what throttle points to
+#ifdef __linux__
+	int old_ioprio;      // restored at the end of the walk, -1 if unchanged
+#endif
+	void **reduce_pending; // accumulators of exited workers, not yet merged
+	size_t num_reduce_pending;
+
+	// files and zip entries collected for opts->batch_cb, paths are heap offsets until the batch is passed on
+	struct walk_batch_item {
+		uint64_t path, entry;
+		int64_t index;
+		struct file_type_filter *filter;
+		struct stat st;
+		double weight;
+	} *batch;
+	size_t batch_count, batch_size;
+	char *batch_heap;
+	size_t batch_heap_len, batch_heap_alloc;
+	struct each_file_entry *batch_entries;
+	struct lazy_stream *batch_streams;
+#ifdef HAVE_LIBZIP
+	zip_t *zip;      // archive being read, its entries in the batch are opened from it
+#endif
+
+	int skipped;     // set when walk_skip_dir() ended a directory on the stack
+	double weight;   // sampling weight of the file or archive being matched
+	int outside_shard; // the walked path is in a directory of another shard, nothing is walked
+
+	// set when each_file_iter_next() drives the walk, which then returns item instead of calling callbacks
+	int iter;
+	struct walk_item item; // file or zip entry returned by the iterator, or zip entry passed to its callback
+	int record;      // manifest record of the file or archive of item, -1 for none
+#ifdef HAVE_LIBZIP
+	struct walk_zip archive;
+#endif
+
+	// EF_SKIP_HARDLINKS, EF_ONE_FILESYSTEM and EF_SKIP_VISITED_DIRS
+	struct inode_set files, dirs;
+	dev_t root_dev;
+
+	// checkpoint being resumed from, NULL once the walk passed it
+	const struct checkpoint *resume;
+	int64_t resume_entry; // zip entries up to this one are skipped in the next archive
+	// last completed file relative to the root, written to opts->checkpoint
+	char *done;
+	size_t done_alloc, done_count;
+	int64_t done_entry;
+};
+
+static int walk_set_path(struct walk *w, size_t base_len, const char *name) {
+	size_t name_len = strlen(name);
+	size_t len = base_len + (base_len ? 1 : 0) + name_len;
+	if(len + 1 > w->path_alloc) {
+		size_t alloc = (len + 1 + 255) & ~(size_t)255;
+		char *path = realloc(w->path, alloc);
+		if(!path) return ENOMEM;
+		w->path = path;
+		w->path_alloc = alloc;
+	}
+	char *p = w->path + base_len;
+	if(base_len) *p++ = '/';
+	memcpy(p, name, name_len + 1);
+	w->path_len = len;
+	return 0;
+}
+
+#ifdef __linux__
+static uint64_t walk_physical_offset(const char *path) {
+	int fd = open(path, O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+	if(fd < 0) return 0;
+	uint64_t buf[(sizeof(struct fiemap) + sizeof(struct fiemap_extent) + 7) / 8];
+	memset(buf, 0, sizeof(buf));
+	struct fiemap *fm = (struct fiemap *)buf;
+	fm->fm_length = FIEMAP_MAX_OFFSET;
+	fm->fm_extent_count = 1;
+	uint64_t r = 0;
+	if(!ioctl(fd, FS_IOC_FIEMAP, fm) && fm->fm_mapped_extents)
+		r = fm->fm_extents[0].fe_physical;
+	close(fd);
+	return r;
+}
+#endif
+
+static int walk_entry_cmp(const void *a, const void *b) {
+	const struct walk_entry *ea = a, *eb = b;
+	if(ea->key != eb->key) return ea->key < eb->key ? -1 : 1;
+	if(ea->ino != eb->ino) return ea->ino < eb->ino ? -1 : 1;
+	return 0;
+}
+
+static int walk_add_entry(struct walk_frame *f, const char *name, ino_t ino, int type) {
+	if(f->num_entries >= f->entries_alloc) {
+		size_t alloc = f->entries_alloc ? f->entries_alloc * 2 : 32;
+		struct walk_entry *entries = realloc(f->entries, alloc * sizeof(*entries));
+		if(!entries) return ENOMEM;
+		f->entries = entries;
+		f->entries_alloc = alloc;
+	}
+	size_t name_len = strlen(name) + 1;
+	if(f->names_len + name_len > f->names_alloc) {
+		size_t alloc = (f->names_len + name_len) * 2;
+		char *names = realloc(f->names, alloc);
+		if(!names) return ENOMEM;
+		f->names = names;
+		f->names_alloc = alloc;
+	}
+	struct walk_entry *e = &f->entries[f->num_entries++];
+	e->name = f->names_len;
+	e->ino = ino;
+	e->key = ino;
+	e->type = type;
+	e->header_len = -1;
+	e->weight = 1;
+	memcpy(f->names + f->names_len, name, name_len);
+	f->names_len += name_len;
+	return 0;
+}
+
+static int walk_opendir(struct walk_frame *f, const char *path) {
+#ifdef WALK_GETDENTS
+	f->fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	return f->fd < 0 ? errno : 0;
+#else
+	f->d = opendir(path);
+	return f->d ? 0 : errno;
+#endif
+}
+
+static int walk_closedir(struct walk_frame *f) {
+#ifdef WALK_GETDENTS
+	int r = f->fd >= 0 && close(f->fd) ? errno : 0;
+	f->fd = -1;
+#else
+	int r = f->d && closedir(f->d) ? errno : 0;
+	f->d = 0;
+#endif
+	return r;
+}
+
+static int walk_type(unsigned char d_type) {
+#ifdef DT_DIR
+	if(d_type == DT_DIR) return WALK_DIR;
+	if(d_type != DT_UNKNOWN && d_type != DT_LNK) return WALK_FILE;
+#endif
+	(void)d_type;
+	return WALK_UNKNOWN;
+}
 
-static int each_file_dir(const char *path, struct file_type_filter *filters, int flags) {
-	DIR *d = opendir(path);
-	if(!d) return errno;
+#ifdef WALK_GETDENTS
+// whole getdents64 batches are consumed, so a window can be exceeded by the rest of a batch
+static int walk_read(struct walk *w, struct walk_frame *f, size_t window) {
+	f->num_entries = f->cur = f->names_len = 0;
+	if(!w->dents) {
+		w->dents = malloc(WALK_DENTS_SIZE);
+		if(!w->dents) return ENOMEM;
+	}
+	while(!window || f->num_entries < window) {
+		long n = syscall(SYS_getdents64, f->fd, w->dents, WALK_DENTS_SIZE);
+		if(n < 0) return errno;
+		if(n == 0) {
+			f->eof = 1;
+			break;
+		}
+		for(long pos = 0; pos < n; ) {
+			struct walk_dirent64 *de = (struct walk_dirent64 *)(w->dents + pos);
+			pos += de->d_reclen;
+			if(de->d_name[0] == '.' && de->d_name[1] == 0) continue;
+			if(de->d_name[0] == '.' && de->d_name[1] == '.' && de->d_name[2] == 0) continue;
+			int r = walk_add_entry(f, de->d_name, de->d_ino, walk_type(de->d_type));
+			if(r) return r;
+		}
+	}
+	return 0;
+}
+#else
+static int walk_read(struct walk *w, struct walk_frame *f, size_t window) {
+	(void)w;
+	f->num_entries = f->cur = f->names_len = 0;
 	struct dirent *de;
-	while((de = readdir(d))) {
+	while((!window || f->num_entries < window) && (de = readdir(f->d))) {
 		if(de->d_name[0] == '.' && de->d_name[1] == 0) continue;
 		if(de->d_name[0] == '.' && de->d_name[1] == '.' && de->d_name[2] == 0) continue;
-		char rpath[PATH_MAX + 1 + sizeof(de->d_name) + 1]; // FIXME: maybe allocate new string instead?
-		if(path[0])
-			snprintf(rpath, sizeof(rpath) / sizeof(rpath[0]), "%s/%s", path, de->d_name);
-		else
-			snprintf(rpath, sizeof(rpath) / sizeof(rpath[0]), "%s", de->d_name);
-		each_file(rpath, filters, flags);
+#ifdef DT_DIR
+		int r = walk_add_entry(f, de->d_name, de->d_ino, walk_type(de->d_type));
+#else
+		int r = walk_add_entry(f, de->d_name, de->d_ino, WALK_UNKNOWN);
+#endif
+		if(r) return r;
+	}
+	if(!window || f->num_entries < window) f->eof = 1;
+	return 0;
+}
+#endif
+
+static int walk_stat_path(struct walk_frame *f, const char *path, const char *name, struct stat *st) {
+#ifdef WALK_GETDENTS
+	if(f && f->fd >= 0) return fstatat(f->fd, name, st, 0);
+#endif
+	(void)f;
+	(void)name;
+	return stat(path, st);
+}
+
+// stat relative to the open directory when there is one, which saves resolving the whole path
+static int walk_stat(struct walk *w, struct walk_frame *f, const char *name, struct stat *st) {
+	if(!w->stats) return walk_stat_path(f, w->path, name, st);
+	uint64_t start = monotonic_ns();
+	int r = walk_stat_path(f, w->path, name, st);
+	uint64_t ns = monotonic_ns() - start;
+	each_file_stats_add(w->stats, EF_PHASE_STAT, ns);
+	if(f) f->ns += ns;
+	return r;
+}
+
+static int walk_name_cmp(const void *a, const void *b) {
+	const struct walk_entry *ea = a, *eb = b;
+	return strcmp(ea->sort_name, eb->sort_name);
+}
+
+static void walk_sort(struct walk *w, struct walk_frame *f) {
+	// checkpoints need an order that does not change between runs
+	if(w->opts && w->opts->checkpoint) {
+		for(size_t i = 0; i < f->num_entries; i++)
+			f->entries[i].sort_name = f->names + f->entries[i].name;
+		qsort(f->entries, f->num_entries, sizeof(*f->entries), walk_name_cmp);
+		return;
+	}
+	if(!(w->flags & (EF_SORT_INODE | EF_SORT_EXTENT))) return;
+#ifdef __linux__
+	if(w->flags & EF_SORT_EXTENT) {
+		for(size_t i = 0; i < f->num_entries; i++) {
+			if(walk_set_path(w, f->path_len, f->names + f->entries[i].name)) break;
+			f->entries[i].key = walk_physical_offset(w->path);
+		}
+	}
+#endif
+	qsort(f->entries, f->num_entries, sizeof(*f->entries), walk_entry_cmp);
+}
+
+static int walk_is_archive(struct walk *w, const char *ext);
+static struct file_type_filter *walk_match_ext(struct walk *w, const char *ext);
+static const char *walk_relative(struct walk *w, const char *path);
+static int walk_sharded(struct walk *w);
+static int walk_in_shard(struct walk *w, const char *path, const char *entry);
+
+// splitmix64 finalizer, spreads the bits of a hash or counter
+static uint64_t walk_mix(uint64_t x) {
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+// whether the sample is chosen from whole directory listings
+static int walk_sample_listing(struct walk *w) {
+	const struct each_file_sample *s = w->opts ? w->opts->sample : 0;
+	return s && (s->dir_reservoir || (s->subdir_rate > 0 && s->subdir_rate < 1));
+}
+
+// move a uniform random choice of k of the n indexes to the front
+static void walk_choose(size_t *idx, size_t n, size_t k, uint64_t *state) {
+	for(size_t i = 0; i < k; i++) {
+		*state += 0x9e3779b97f4a7c15ULL;
+		size_t j = i + walk_mix(*state) % (n - i);
+		size_t t = idx[i];
+		idx[i] = idx[j];
+		idx[j] = t;
+	}
+}
+
+// keep subdir_rate of the n subdirectories and dir_reservoir of the m candidate files of a whole listing, the
+// others get weight 0 and the kept ones n or m over the number kept
+// candidates are the files a filter could match, by extension or, with magic, by content
+static int walk_sample(struct walk *w, struct walk_frame *f) {
+	if(!walk_sample_listing(w) || !f->num_entries) return 0;
+	const struct each_file_sample *s = w->opts->sample;
+	size_t *idx = malloc(f->num_entries * sizeof(*idx));
+	if(!idx) return ENOMEM;
+	// subdirectories from the front, candidate files from the back
+	size_t n = 0, m = 0;
+	for(size_t i = 0; i < f->num_entries; i++) {
+		struct walk_entry *e = &f->entries[i];
+		const char *name = f->names + e->name;
+		if(e->type == WALK_UNKNOWN) {
+			struct stat st;
+			if(walk_set_path(w, f->path_len, name)) {
+				free(idx);
+				return ENOMEM;
+			}
+			if(walk_stat(w, f, name, &st) < 0) continue;
+			e->type = S_ISDIR(st.st_mode) ? WALK_DIR : WALK_FILE;
+		}
+		const char *ext = strrchr(name, '.');
+		if(e->type == WALK_DIR) idx[n++] = i;
+		else if(w->num_magics || walk_is_archive(w, ext) || walk_match_ext(w, ext)) idx[f->num_entries - ++m] = i;
+	}
+	// seeded by the directory, so that its choice does not depend on the order of the walk
+	uint64_t state = s->seed ^ fnv1a64(FNV1A64_INIT, w->path + w->root_len, f->path_len - w->root_len);
+	if(n && s->subdir_rate > 0 && s->subdir_rate < 1) {
+		size_t k = (size_t)(s->subdir_rate * n);
+		if(k < s->subdir_rate * n) k++;
+		walk_choose(idx, n, k, &state);
+		for(size_t i = 0; i < n; i++)
+			f->entries[idx[i]].weight = i < k ? (double)n / k : 0;
+	}
+	if(s->dir_reservoir && m > s->dir_reservoir) {
+		size_t *files = idx + f->num_entries - m;
+		walk_choose(files, m, s->dir_reservoir, &state);
+		for(size_t i = 0; i < m; i++)
+			f->entries[files[i]].weight = i < s->dir_reservoir ? (double)m / s->dir_reservoir : 0;
+	}
+	free(idx);
+	return 0;
+}
+
+// keep a file or zip entry with probability file_rate by a hash of its path, dividing weight by it
+static int walk_sample_file(struct walk *w, const char *path, const char *entry, double *weight) {
+	const struct each_file_sample *s = w->opts ? w->opts->sample : 0;
+	if(!s || s->file_rate <= 0 || s->file_rate >= 1) return 1;
+	const char *rel = walk_relative(w, path);
+	uint64_t h = fnv1a64(FNV1A64_INIT, rel, strlen(rel));
+	if(entry) {
+		h = fnv1a64(h, "/", 1);
+		h = fnv1a64(h, entry, strlen(entry));
+	}
+	// the top 53 bits as a double in [0, 1)
+	if((walk_mix(h ^ s->seed) >> 11) * (1.0 / 9007199254740992.0) >= s->file_rate) return 0;
+	*weight /= s->file_rate;
+	return 1;
+}
+
+// whether walk_file() gets to look at the content of the file at the path, past its shard, the path
+// predicate and the sample
+static int walk_sniff_kept(struct walk *w, int depth) {
+	if(walk_sharded(w) && (!w->opts->shard_depth || depth <= w->opts->shard_depth) && !walk_in_shard(w, w->path, 0))
+		return 0;
+	if(w->opts && w->opts->predicate && !predicate_match_path(w->opts->predicate, walk_relative(w, w->path)))
+		return 0;
+	double weight = 1;
+	return walk_sample_file(w, w->path, 0, &weight);
+}
+
+// read the headers of entries that only their content can match, a batch
+// of files at a time so that their reads are in flight together
+static int walk_sniff(struct walk *w, struct walk_frame *f) {
+	if(!w->num_magics) return 0;
+	// the frame may not be pushed yet
+	int depth = (int)(f - w->frames) + 1 + w->depth_base;
+	size_t size = f->num_entries * w->header_len;
+	if(size > f->headers_alloc) {
+		uint8_t *headers = realloc(f->headers, size);
+		if(!headers) return ENOMEM;
+		f->headers = headers;
+		f->headers_alloc = size;
+	}
+	int fds[WALK_SNIFF_BATCH];
+	size_t batch[WALK_SNIFF_BATCH];
+	size_t i = 0;
+	while(i < f->num_entries) {
+		int n = 0;
+		for(; i < f->num_entries && n < WALK_SNIFF_BATCH; i++) {
+			struct walk_entry *e = &f->entries[i];
+			if(e->type == WALK_DIR || !e->weight) continue;
+			const char *name = f->names + e->name;
+			const char *ext = strrchr(name, '.');
+			if(walk_is_archive(w, ext) || walk_match_ext(w, ext)) continue;
+			if(walk_set_path(w, f->path_len, name)) return ENOMEM;
+			if(!walk_sniff_kept(w, depth)) continue;
+			int fd = open(w->path, O_RDONLY | O_BINARY | O_NONBLOCK);
+			if(fd < 0) continue;
+#ifdef POSIX_FADV_WILLNEED
+			posix_fadvise(fd, 0, w->header_len, POSIX_FADV_WILLNEED);
+#endif
+			fds[n] = fd;
+			batch[n++] = i;
+		}
+		for(int k = 0; k < n; k++) {
+			uint8_t *header = f->headers + batch[k] * w->header_len;
+			size_t got = 0;
+			while(got < w->header_len) {
+				ssize_t r = read(fds[k], header + got, w->header_len - got);
+				if(r <= 0) break;
+				got += r;
+			}
+			f->entries[batch[k]].header_len = got;
+			close(fds[k]);
+		}
+	}
+	return 0;
+}
+
+// order, sample and sniff the entries just read, timed apart from enumeration
+static int walk_prepare(struct walk *w, struct walk_frame *f) {
+	uint64_t start = 0, stat_ns = 0;
+	if(w->stats) {
+		start = monotonic_ns();
+		stat_ns = w->stats->phase_ns[EF_PHASE_STAT];
+	}
+	walk_sort(w, f);
+	int r = walk_sample(w, f);
+	if(!r) r = walk_sniff(w, f);
+	if(w->stats) {
+		uint64_t ns = monotonic_ns() - start;
+		f->ns += ns;
+		each_file_stats_add(w->stats, EF_PHASE_PREPARE, ns - (w->stats->phase_ns[EF_PHASE_STAT] - stat_ns));
+	}
+	return r;
+}
+
+static int walk_fill(struct walk *w, struct walk_frame *f) {
+	size_t window = WALK_DEFAULT_WINDOW;
+	if(w->opts && (w->opts->checkpoint || walk_sample_listing(w)))
+		window = 0;
+	else if(w->flags & (EF_SORT_INODE | EF_SORT_EXTENT))
+		window = w->opts ? w->opts->sort_window : 0;
+	uint64_t start = w->stats ? monotonic_ns() : 0;
+	int r = walk_read(w, f, window);
+	if(w->stats) {
+		uint64_t ns = monotonic_ns() - start;
+		each_file_stats_add(w->stats, EF_PHASE_ENUMERATE, ns);
+		f->ns += ns;
+	}
+	return r ? r : walk_prepare(w, f);
+}
+
+// expand a directory from the listing cache, or read all of it and store it in the cache
+static int walk_fill_cached(struct walk *w, struct walk_frame *f, const struct stat *st) {
+	struct dir_cache *cache = w->opts->dir_cache;
+	size_t num_cached;
+	const struct dir_cache_entry *cached = dir_cache_lookup(cache, w->path, st, &num_cached);
+	if(cached) {
+		for(size_t i = 0; i < num_cached; i++) {
+			int r = walk_add_entry(f, dir_cache_entry_name(cache, &cached[i]), cached[i].ino, cached[i].type);
+			if(r) return r;
+		}
+		f->eof = 1;
+		return dir_cache_put(cache, w->path, st, cached, num_cached, cache->old_heap);
+	}
+
+	int r = walk_opendir(f, w->path);
+	if(r) return r;
+	r = walk_read(w, f, 0);
+	if(r) {
+		walk_closedir(f);
+		return r;
+	}
+
+	struct dir_cache_entry *listing = calloc(f->num_entries ? f->num_entries : 1, sizeof(*listing));
+	if(!listing) {
+		walk_closedir(f);
+		return ENOMEM;
+	}
+	for(size_t i = 0; i < f->num_entries; i++) {
+		struct walk_entry *e = &f->entries[i];
+		listing[i].name = e->name;
+		listing[i].ino = e->ino;
+		struct stat est;
+		if(walk_set_path(w, f->path_len, f->names + e->name) || walk_stat(w, f, f->names + e->name, &est) < 0) {
+			e->type = listing[i].type = WALK_UNKNOWN;
+			continue;
+		}
+		e->type = listing[i].type = S_ISDIR(est.st_mode) ? WALK_DIR : WALK_FILE;
+	}
+	walk_closedir(f);
+	w->path[f->path_len] = 0;
+	w->path_len = f->path_len;
+	r = dir_cache_put(cache, w->path, st, listing, f->num_entries, f->names);
+	free(listing);
+	return r;
+}
+
+static int walk_push_dir(struct walk *w, const struct stat *st) {
+	if(w->depth >= w->frames_alloc) {
+		int alloc = w->frames_alloc ? w->frames_alloc * 2 : 16;
+		struct walk_frame *frames = realloc(w->frames, alloc * sizeof(*frames));
+		if(!frames) return ENOMEM;
+		w->frames = frames;
+		w->frames_alloc = alloc;
+	}
+	double weight = 1;
+	if(w->depth) {
+		struct walk_frame *parent = &w->frames[w->depth - 1];
+		weight = parent->weight * parent->entries[parent->cur - 1].weight;
+	}
+	struct walk_frame *f = &w->frames[w->depth];
+	memset(f, 0, sizeof(*f));
+	f->weight = weight;
+#ifdef WALK_GETDENTS
+	f->fd = -1;
+#endif
+	f->path_len = w->path_len;
+	// stats of entries done while filling from the cache are not enumeration time
+	uint64_t start = 0, stat_ns = 0;
+	if(w->stats) {
+		start = monotonic_ns();
+		stat_ns = w->stats->phase_ns[EF_PHASE_STAT];
+		w->stats->dirs++;
+	}
+	int r, cached = w->opts && w->opts->dir_cache && st;
+	if(cached)
+		r = walk_fill_cached(w, f, st);
+	else
+		r = walk_opendir(f, w->path);
+	if(w->stats) {
+		uint64_t ns = monotonic_ns() - start;
+		f->ns += ns;
+		each_file_stats_add(w->stats, EF_PHASE_ENUMERATE, ns - (w->stats->phase_ns[EF_PHASE_STAT] - stat_ns));
+	}
+	if(cached) {
+		if(!r) r = walk_prepare(w, f);
+		if(r) {
+			free(f->entries);
+			free(f->names);
+			free(f->headers);
+		}
+	}
+	if(r) return r;
+	w->depth++;
+	return 0;
+}
+
+static int walk_pop_dir(struct walk *w) {
+	struct walk_frame *f = &w->frames[--w->depth];
+	if(w->stats) {
+		// the first path_len bytes of the path are the directory
+		char c = w->path[f->path_len];
+		w->path[f->path_len] = 0;
+		each_file_stats_slow(w->stats, 1, w->path, f->ns);
+		w->path[f->path_len] = c;
+	}
+	free(f->entries);
+	free(f->names);
+	free(f->headers);
+	return walk_closedir(f);
+}
+
+static void walk_free(struct walk *w) {
+	while(w->depth > 0)
+		walk_pop_dir(w);
+	free(w->frames);
+	free(w->path);
+	free(w->magics);
+	free(w->done);
+	inode_set_free(&w->files);
+	inode_set_free(&w->dirs);
+	free(w->batch);
+	free(w->batch_heap);
+	free(w->batch_entries);
+	free(w->batch_streams);
+	free(w->reduce_pending);
+#ifdef WALK_GETDENTS
+	free(w->dents);
+#endif
+}
+
+static int walk_file(struct walk *w, const char *ext, const struct stat *st, const uint8_t *header, ssize_t header_len);
+
+static int walk_sharded(struct walk *w) {
+	return w->opts && w->opts->shard_count > 1;
+}
+
+// accumulator of callbacks that run on the walking thread
+static void *walk_acc(struct walk *w) {
+	return w->opts && w->opts->reduce ? w->opts->reduce->result : 0;
+}
+
+static const char *walk_relative(struct walk *w, const char *path) {
+	const char *rel = path + w->root_len;
+	while(*rel == '/') rel++;
+	return rel;
+}
+
+// whether a path, or an entry of the archive at path, belongs to this shard
+static int walk_in_shard(struct walk *w, const char *path, const char *entry) {
+	const char *rel = walk_relative(w, path);
+	uint64_t h = fnv1a64(FNV1A64_INIT, rel, strlen(rel));
+	if(entry) {
+		h = fnv1a64(h, "/", 1);
+		h = fnv1a64(h, entry, strlen(entry));
+	}
+	return h % w->opts->shard_count == w->opts->shard_index;
+}
+
+// whether the directory at shard_depth that the walked path is in, or is, belongs to this shard
+static int walk_base_in_shard(struct walk *w) {
+	const char *rel = walk_relative(w, w->path);
+	size_t len = 0;
+	for(int d = 0; d < w->opts->shard_depth && rel[len]; d++) {
+		if(d) len++;
+		while(rel[len] && rel[len] != '/') len++;
+	}
+	return fnv1a64(FNV1A64_INIT, rel, len) % w->opts->shard_count == w->opts->shard_index;
+}
+
+static int walk_checkpoint(struct walk *w) {
+	if(!w->done) return 0;
+	struct checkpoint c;
+	c.root = (char *)w->root;
+	c.path = w->done;
+	c.entry = w->done_entry;
+	return checkpoint_save(&c, w->opts->checkpoint);
+}
+
+// record a file, or an entry of the archive at path, whose callback returned
+static int walk_completed(struct walk *w, const char *path, int64_t entry) {
+	if(!w->opts || !w->opts->checkpoint) return 0;
+	const char *rel = walk_relative(w, path);
+	size_t len = strlen(rel) + 1;
+	if(len > w->done_alloc) {
+		char *done = realloc(w->done, len);
+		if(!done) return ENOMEM;
+		w->done = done;
+		w->done_alloc = len;
+	}
+	memcpy(w->done, rel, len);
+	w->done_entry = entry;
+	size_t interval = w->opts->checkpoint_interval ? w->opts->checkpoint_interval : WALK_CHECKPOINT_INTERVAL;
+	if(++w->done_count < interval) return 0;
+	w->done_count = 0;
+	return walk_checkpoint(w);
+}
+
+// compare the current path with the checkpoint component by component, as names are sorted
+static int walk_resume_pos(struct walk *w) {
+	const unsigned char *a = (const unsigned char *)walk_relative(w, w->path);
+	const unsigned char *b = (const unsigned char *)w->resume->path;
+	while(*a && *a == *b) {
+		a++;
+		b++;
 	}
-	if(closedir(d)) return errno;
+	if(!*a && !*b) return WALK_RESUME_AT;
+	if(!*a && *b == '/') return WALK_RESUME_ANCESTOR;
+	// the end of a component sorts before any character
+	int ca = *a == '/' ? 0 : *a, cb = *b == '/' ? 0 : *b;
+	return ca < cb ? WALK_RESUME_BEFORE : WALK_RESUME_AFTER;
+}
+
+static size_t walk_dirname_len(const char *path) {
+	const char *slash = strrchr(path, '/');
+	return slash ? (size_t)(slash - path) : 0;
+}
+
+// end the walk of a directory on the stack, if dir is one of them
+static void walk_skip_dir(struct walk *w, const char *dir, size_t dir_len) {
+	for(int k = 0; k < w->depth; k++) {
+		struct walk_frame *f = &w->frames[k];
+		if(f->path_len != dir_len || memcmp(w->path, dir, dir_len)) continue;
+		f->cur = f->num_entries;
+		f->eof = 1;
+		while(w->depth > k + 1)
+			walk_pop_dir(w);
+		w->skipped = 1;
+		return;
+	}
+}
+
+static int walk_is_skip(int r) {
+	return r == EF_SKIP_SIBLINGS || r == EF_SKIP_SUBTREE;
+}
+
+// ask the directory callback whether to walk the directory at w->path
+static int walk_enter_dir(struct walk *w) {
+	if(!w->opts || !w->opts->dir_cb) return EF_CONTINUE;
+	int r = w->opts->dir_cb(w->path, w->opts->dir_user_data);
+	return r == EF_STOP || walk_is_skip(r) ? r : EF_CONTINUE;
+}
+
+// end the walk or skip the rest of the directory as the callbacks of the file at w->path asked
+static int walk_dir_file_done(struct walk *w, int r) {
+	// errors of single files do not end the walk
+	if(r == EF_STOP) return r;
+	if(walk_is_skip(r)) walk_skip_dir(w, w->path, w->frames[w->depth - 1].path_len);
 	return 0;
 }
 
+// a subdirectory that went away or may not be read is skipped, other errors end the walk
+static int walk_unlistable(int r) {
+	return r == EACCES || r == EPERM || r == ENOENT || r == ENOTDIR || r == ELOOP;
+}
+
+// walk the directories on the stack, returns WALK_YIELD with the stack kept for an iterator
+static int walk_dir_loop(struct walk *w) {
+	int r = 0;
+	while(!r && w->depth > 0) {
+		struct walk_frame *f = &w->frames[w->depth - 1];
+		if(f->cur == f->num_entries) {
+			if(f->eof) {
+				int root = w->depth == 1;
+				int cr = walk_pop_dir(w);
+				if(root) r = cr;
+			} else {
+				r = walk_fill(w, f);
+			}
+			continue;
+		}
+		size_t idx = f->cur++;
+		struct walk_entry *e = &f->entries[idx];
+		const char *name = f->names + e->name;
+		r = walk_set_path(w, f->path_len, name);
+		if(r) break;
+		if(w->resume) {
+			// entries before the checkpoint were completed by the interrupted walk
+			int pos = walk_resume_pos(w);
+			if(pos == WALK_RESUME_BEFORE) continue;
+			if(pos == WALK_RESUME_AT || pos == WALK_RESUME_AFTER) {
+				if(pos == WALK_RESUME_AT) w->resume_entry = w->resume->entry;
+				w->resume = 0;
+				if(pos == WALK_RESUME_AT && w->resume_entry < 0) continue;
+			}
+		}
+		if(!e->weight) continue;
+		// directories are stat'ed to validate their cached listing or to know their device and inode
+		struct stat est;
+		int have_st = 0, type = e->type;
+		int stat_dirs = (w->opts && w->opts->dir_cache) || (w->flags & (EF_ONE_FILESYSTEM | EF_SKIP_VISITED_DIRS));
+		if(type == WALK_UNKNOWN || (type == WALK_DIR && stat_dirs)) {
+			if(walk_stat(w, f, name, &est) < 0) continue;
+			have_st = 1;
+			type = S_ISDIR(est.st_mode) ? WALK_DIR : WALK_FILE;
+		}
+		if(type == WALK_DIR) {
+			if(w->opts && w->opts->predicate && !predicate_match_dir(w->opts->predicate, walk_relative(w, w->path)))
+				continue;
+			if(walk_sharded(w) && w->depth + w->depth_base == w->opts->shard_depth && !walk_in_shard(w, w->path, 0))
+				continue;
+			if((w->flags & EF_ONE_FILESYSTEM) && est.st_dev != w->root_dev)
+				continue;
+			if(w->flags & EF_SKIP_VISITED_DIRS) {
+				int seen = inode_set_insert(&w->dirs, est.st_dev, est.st_ino);
+				if(seen < 0) {
+					r = -seen;
+					break;
+				}
+				if(seen) continue;
+			}
+			int dr = walk_enter_dir(w);
+			if(dr == EF_STOP) {
+				r = dr;
+				break;
+			}
+			if(dr == EF_SKIP_SIBLINGS) walk_skip_dir(w, w->path, f->path_len);
+			if(dr) continue;
+			r = walk_push_dir(w, have_st ? &est : 0);
+			if(walk_unlistable(r)) r = 0;
+			if(r) break;
+		} else {
+			const char *ext = strrchr(name, '.');
+			const uint8_t *header = e->header_len >= 0 ? f->headers + idx * w->header_len : 0;
+			if(w->stats) w->stats->files++;
+			if(!ext && !w->num_magics) continue;
+			w->weight = f->weight * e->weight;
+			int fr = walk_file(w, ext, have_st ? &est : 0, header, e->header_len);
+			if(fr == WALK_YIELD) return fr;
+			r = walk_dir_file_done(w, fr);
+		}
+	}
+	return r;
+}
+
+static int walk_dir(struct walk *w, const struct stat *st) {
+	int r = walk_enter_dir(w);
+	if(r) return r == EF_STOP ? r : 0;
+	r = walk_push_dir(w, st);
+	return r ? r : walk_dir_loop(w);
+}
+
 #ifdef WIN32
 static int each_file_dirw(const wchar_t *path, struct file_type_filterw *filters, int flags) {
 	WIN32_FIND_DATAW fdata;
@@ -55,20 +961,6 @@ static int each_file_dirw(const wchar_t *path, struct file_type_filterw *filters
 }
 #endif
 
-#define FILL_PATH_INFO(path) \
-	p.file_name = (char *)path; \
-	char *file_dirname_str = strdup(path); \
-	p.file_dirname = dirname(file_dirname_str); \
-	char *file_basename_str = strdup(path); \
-	p.file_basename = basename(file_basename_str); \
-	char *file_ext_str = strdup(p.file_basename); \
-	char *file_ext = strrchr(file_ext_str, '.'); \
-	if(file_ext) { \
-		*file_ext = 0; \
-		p.file_ext = file_ext[1] ? file_ext + 1 : 0; \
-	} \
-	p.file_base = file_ext_str;
-
 #define FILL_PATH_INFOW(path) \
 	p.file_name = (wchar_t *)path; \
 	wchar_t *file_dirname_str = _wcsdup(path); \
@@ -83,16 +975,366 @@ static int each_file_dirw(const wchar_t *path, struct file_type_filterw *filters
 	} \
 	p.file_base = file_ext_str;
 
-#define FREE_PATH_INFO() \
-	free(file_ext_str); \
-	free(file_basename_str); \
-	free(file_dirname_str);
+// account the opens and reads of a callback's stream, the rest of its time is callback time
+static void walk_stats_item(struct each_file_stats *stats, const char *path, struct lazy_stream *s, int compressed, uint64_t ns) {
+	uint64_t io = 0;
+	if(s) {
+		if(s->open_ns) each_file_stats_add(stats, EF_PHASE_OPEN, s->open_ns);
+		if(s->read_ns) each_file_stats_add(stats, compressed ? EF_PHASE_DECOMPRESS : EF_PHASE_READ, s->read_ns);
+		stats->bytes_read += s->bytes_read;
+		io = s->open_ns + s->read_ns;
+	}
+	each_file_stats_add(stats, EF_PHASE_CALLBACK, ns > io ? ns - io : 0);
+	each_file_stats_slow(stats, 0, path, ns);
+}
+
+static void walk_item_names(struct walk_item *item, const char *path) {
+	struct path_info p = item->p;
+	p.file_ext = 0;
+	FILL_PATH_INFO(path);
+	item->p = p;
+	item->dirname_str = file_dirname_str;
+	item->basename_str = file_basename_str;
+	item->ext_str = file_ext_str;
+}
 
+static int walk_item_call(struct walk_item *item) {
+	return item->filter->file_cb(&item->p, item->has_stream ? &item->s.stream : 0, item->filter->user_data);
+}
+
+static void walk_item_close(struct walk *w, struct walk_item *item) {
+	free(item->ext_str);
+	free(item->basename_str);
+	free(item->dirname_str);
+	if(item->has_stream) stream_close(&item->s.stream);
+	if(w->stats) {
+		int compressed = item->compressed || (item->has_stream && (item->s.stream.flags & STREAM_IS_GZIPPED));
+		if(item->entry >= 0) w->stats->archive_entries++;
+		walk_stats_item(w->stats, item->path, item->has_stream ? &item->s : 0, compressed, monotonic_ns() - item->start);
+	}
+}
+
+// fd is a prefetched descriptor of path, or -1
+static int walk_item_file(struct walk *w, struct walk_item *item, const char *path, struct file_type_filter *f, int fd, struct stream *output, void *acc, double weight) {
+	item->start = w->stats ? monotonic_ns() : 0;
 #ifdef HAVE_LIBZIP
-static int each_file_zip(const char *path, struct file_type_filter *filters, int flags) {
-	(void)flags;
+	item->p.zip_file_name = item->p.zip_file_base = item->p.zip_file_dirname = 0;
+#endif
+	item->p.output = output;
+	item->p.acc = acc;
+	item->p.weight = weight;
+	item->filter = f;
+	item->path = path;
+	item->entry = -1;
+	item->compressed = 0;
+	item->has_stream = (w->flags & EF_OPEN_STREAM) != 0;
+	if(item->has_stream) {
+		// opened on first access, callbacks that decide from the path alone never open the file
+#ifdef HAVE_GZIP
+		int stream_flags = (w->flags & EF_TRANSPARENT_GZIP) ? STREAM_TRANSPARENT_GZIP : 0;
+#else
+		int stream_flags = 0;
+#endif
+		int r;
+		if(fd >= 0)
+			r = lazy_stream_init_fd(&item->s, fd, "rb", stream_flags);
+		else
+			r = lazy_stream_init_file(&item->s, path, "rb", stream_flags);
+		if(r) return r;
+		item->s.timed = w->stats != 0;
+		item->s.throttle = w->throttle;
+	} else if(fd >= 0) {
+		close(fd);
+	}
+	walk_item_names(item, path);
+	return 0;
+}
+
+// queue a file, zip entry or chunk for the worker threads or processes, EF_STOP once a callback stopped the walk
+static int walk_schedule(struct walk *w, const char *path, const char *entry, int64_t index, struct file_type_filter *filter, double weight, uint64_t size, uint64_t offset, uint64_t len) {
+	size_t path_len = strlen(path), entry_len = entry ? strlen(entry) + 1 : 0;
+	struct schedule_task task;
+	memset(&task, 0, sizeof(task));
+	task.path = malloc(path_len + 1 + entry_len);
+	if(!task.path) return ENOMEM;
+	memcpy(task.path, path, path_len + 1);
+	if(entry) {
+		memcpy(task.path + path_len + 1, entry, entry_len);
+		task.entry = task.path + path_len + 1;
+	}
+	task.data = filter;
+	task.index = index;
+	task.size = size;
+	task.offset = offset;
+	task.len = len;
+	task.weight = weight;
+#ifndef WIN32
+	if(w->pool) return process_pool_push(w->pool, &task) ? EF_STOP : 0;
+#endif
+	return schedule_push(w->schedule, &task) ? EF_STOP : 0;
+}
+
+// whether callbacks run on worker threads or processes
+static int walk_parallel(struct walk *w) {
+#ifndef WIN32
+	if(w->pool) return 1;
+#endif
+	return w->schedule != 0;
+}
+
+static int walk_run_chunk(struct walk *w, struct schedule_task *task, void *acc) {
+	struct lazy_stream s;
+	int r = lazy_stream_init_file(&s, task->path, "rb", 0);
+	if(r) return r;
+	s.throttle = w->throttle;
+	if(stream_seek(&s.stream, (long)task->offset, SEEK_SET)) {
+		r = s.open_errno ? s.open_errno : EIO;
+		stream_close(&s.stream);
+		return r;
+	}
+	struct path_info p;
+#ifdef HAVE_LIBZIP
+	p.zip_file_name = p.zip_file_dirname = p.zip_file_base = 0;
+#endif
+	p.output = task->output;
+	p.acc = acc;
+	p.weight = task->weight;
+	FILL_PATH_INFO(task->path);
+	r = w->opts->chunk_cb(&p, &s.stream, task->offset, task->len, w->opts->chunk_user_data);
+	FREE_PATH_INFO();
+	stream_close(&s.stream);
+	return r;
+}
+
+// state of a worker thread
+struct walk_worker {
+	void *acc;       // opts->reduce accumulator
+#ifdef HAVE_LIBZIP
+	// archive kept open, entries of the same archive tend to be queued together
+	zip_t *zip;
+	char *zip_path;
+#endif
+};
+
+static struct walk_worker *walk_get_worker(struct walk *w, void **worker) {
+	struct walk_worker *ww = *worker;
+	if(ww) return ww;
+	ww = calloc(1, sizeof(*ww));
+	if(!ww) return 0;
+	const struct each_file_reduce *reduce = w->opts->reduce;
+	if(reduce) {
+		ww->acc = malloc(reduce->size ? reduce->size : 1);
+		if(!ww->acc) {
+			free(ww);
+			return 0;
+		}
+		if(reduce->init) reduce->init(ww->acc, reduce->user_data);
+	}
+	*worker = ww;
+	return ww;
+}
+
+#ifdef HAVE_LIBZIP
+static int walk_run_entry(struct walk *w, struct schedule_task *task, struct walk_worker *ww) {
+	if(!ww->zip || strcmp(ww->zip_path, task->path)) {
+		if(ww->zip) zip_close(ww->zip);
+		free(ww->zip_path);
+		int err;
+		if(w->throttle) throttle_open(w->throttle);
+		ww->zip = zip_open(task->path, ZIP_RDONLY, &err);
+		ww->zip_path = ww->zip ? strdup(task->path) : 0;
+		if(!ww->zip) return err;
+		if(!ww->zip_path) return ENOMEM;
+	}
+	struct lazy_stream s;
+#ifdef HAVE_GZIP
+	int r = lazy_stream_init_zip_index(&s, ww->zip, task->index, (w->flags & EF_TRANSPARENT_GZIP) ? STREAM_TRANSPARENT_GZIP : 0);
+#else
+	int r = lazy_stream_init_zip_index(&s, ww->zip, task->index, 0);
+#endif
+	if(r) return r;
+	s.throttle = w->throttle;
+	struct file_type_filter *f = task->data;
+	struct path_info p;
+	p.output = task->output;
+	p.acc = ww->acc;
+	p.weight = task->weight;
+	FILL_ZIP_PATH_INFO(task->path);
+	FILL_PATH_INFO(task->entry);
+	r = f->file_cb(&p, (struct stream *)&s, f->user_data);
+	FREE_PATH_INFO();
+	FREE_ZIP_PATH_INFO();
+	stream_close((struct stream *)&s);
+	return r;
+}
+#endif
+
+static void walk_worker_done(void *worker, void *user_data) {
+	struct walk *w = user_data;
+	struct walk_worker *ww = worker;
+	if(!ww) return;
+#ifdef HAVE_LIBZIP
+	if(ww->zip) zip_close(ww->zip);
+	free(ww->zip_path);
+#endif
+	// merge with the accumulator of another exited worker until none is left, then leave the result for the next one
+	void *acc = ww->acc;
+	while(acc) {
+		pthread_mutex_lock(&w->workers_lock);
+		void *other = w->num_reduce_pending ? w->reduce_pending[--w->num_reduce_pending] : 0;
+		if(!other) w->reduce_pending[w->num_reduce_pending++] = acc;
+		pthread_mutex_unlock(&w->workers_lock);
+		if(!other) break;
+		w->opts->reduce->merge(acc, other, w->opts->reduce->user_data);
+		free(other);
+	}
+	free(ww);
+}
+
+static int each_file_file(struct walk *w, const char *path, struct file_type_filter *f, int fd, struct stream *output, void *acc, double weight);
+
+// callback results other than EF_STOP are ignored, as they are for files in a directory walk
+static int walk_run_task(struct schedule_task *task, void **worker, void *user_data) {
+	struct walk *w = user_data;
+	struct walk_worker *ww = walk_get_worker(w, worker);
+	if(!ww) {
+		// the results of the worker's tasks would be missing from the walk
+		pthread_mutex_lock(&w->workers_lock);
+		w->workers_err = ENOMEM;
+		pthread_mutex_unlock(&w->workers_lock);
+		return 1;
+	}
+	int r;
+#ifdef HAVE_LIBZIP
+	if(task->index >= 0) r = walk_run_entry(w, task, ww);
+	else
+#endif
+	if(task->len) r = walk_run_chunk(w, task, ww->acc);
+	else r = each_file_file(w, task->path, task->data, -1, task->output, ww->acc, task->weight);
+	return r == EF_STOP;
+}
+
+#ifndef WIN32
+// the accumulator a worker process sends back before it exits
+static const void *walk_process_result(void *worker, size_t *len, void *user_data) {
+	struct walk *w = user_data;
+	struct walk_worker *ww = worker;
+	if(!ww) return 0;
+	*len = w->opts->reduce->size;
+	return ww->acc;
+}
+
+static void walk_process_merge(void *result, size_t len, void *user_data) {
+	struct walk *w = user_data;
+	const struct each_file_reduce *reduce = w->opts->reduce;
+	if(len == reduce->size) reduce->merge(reduce->result, result, reduce->user_data);
+}
+
+// a worker process sent its accumulator back already
+static void walk_process_done(void *worker, void *user_data) {
+	struct walk_worker *ww = worker;
+	(void)user_data;
+	if(!ww) return;
+#ifdef HAVE_LIBZIP
+	if(ww->zip) zip_close(ww->zip);
+	free(ww->zip_path);
+#endif
+	free(ww->acc);
+	free(ww);
+}
+
+static void walk_process_crashed(const char *path, const char *entry, int status, void *user_data) {
+	struct walk *w = user_data;
+	if(w->opts->process_crash_cb)
+		w->opts->process_crash_cb(path, entry, status, w->opts->process_crash_user_data);
+}
+#endif
+
+static int walk_batch_init(struct walk *w, size_t batch_size) {
+	w->batch_size = batch_size ? batch_size : WALK_BATCH_SIZE;
+	w->batch = malloc(w->batch_size * sizeof(*w->batch));
+	w->batch_entries = malloc(w->batch_size * sizeof(*w->batch_entries));
+	w->batch_streams = malloc(w->batch_size * sizeof(*w->batch_streams));
+	if(!w->batch || !w->batch_entries || !w->batch_streams) return ENOMEM;
+	return 0;
+}
+
+static int walk_batch_append(struct walk *w, const char *str, uint64_t *offset) {
+	size_t len = strlen(str) + 1;
+	if(w->batch_heap_len + len > w->batch_heap_alloc) {
+		size_t alloc = w->batch_heap_alloc ? w->batch_heap_alloc : 4096;
+		while(alloc < w->batch_heap_len + len) alloc *= 2;
+		char *heap = realloc(w->batch_heap, alloc);
+		if(!heap) return ENOMEM;
+		w->batch_heap = heap;
+		w->batch_heap_alloc = alloc;
+	}
+	*offset = w->batch_heap_len;
+	memcpy(w->batch_heap + w->batch_heap_len, str, len);
+	w->batch_heap_len += len;
+	return 0;
+}
+
+// pass the collected entries to the batch callback, results other than EF_STOP are ignored
+static int walk_batch_flush(struct walk *w) {
+	if(!w->batch_count) return 0;
+#ifdef HAVE_GZIP
+	int stream_flags = (w->flags & EF_TRANSPARENT_GZIP) ? STREAM_TRANSPARENT_GZIP : 0;
+#else
+	int stream_flags = 0;
+#endif
+	for(size_t i = 0; i < w->batch_count; i++) {
+		struct walk_batch_item *item = &w->batch[i];
+		struct each_file_entry *e = &w->batch_entries[i];
+		e->path = w->batch_heap + item->path;
+		e->entry = item->index >= 0 ? w->batch_heap + item->entry : 0;
+		e->filter = item->filter;
+		e->st = item->st;
+		e->weight = item->weight;
+		e->stream = 0;
+		if(!(w->flags & EF_OPEN_STREAM)) continue;
+		int r;
+#ifdef HAVE_LIBZIP
+		if(item->index >= 0)
+			r = lazy_stream_init_zip_index(&w->batch_streams[i], w->zip, item->index, stream_flags);
+		else
+#endif
+		r = lazy_stream_init_file(&w->batch_streams[i], e->path, "rb", stream_flags);
+		if(r) continue;
+		w->batch_streams[i].throttle = w->throttle;
+		e->stream = (struct stream *)&w->batch_streams[i];
+	}
+	int r = w->opts->batch_cb(w->batch_entries, w->batch_count, w->opts->batch_user_data);
+	for(size_t i = 0; i < w->batch_count; i++) {
+		if(w->batch_entries[i].stream) stream_close(w->batch_entries[i].stream);
+	}
+	w->batch_count = 0;
+	w->batch_heap_len = 0;
+	return r == EF_STOP ? r : 0;
+}
+
+static int walk_batch_add(struct walk *w, const char *path, const char *entry, int64_t index, struct file_type_filter *filter, const struct stat *st, double weight) {
+	struct walk_batch_item *item = &w->batch[w->batch_count];
+	if(walk_batch_append(w, path, &item->path)) return ENOMEM;
+	if(entry && walk_batch_append(w, entry, &item->entry)) return ENOMEM;
+	item->index = entry ? index : -1;
+	item->filter = filter;
+	item->st = *st;
+	item->weight = weight;
+	if(++w->batch_count < w->batch_size) return 0;
+	return walk_batch_flush(w);
+}
+
+#ifdef HAVE_LIBZIP
+static int walk_zip_open(struct walk *w, struct walk_zip *zs, const char *path, double weight) {
 	int err;
+	uint64_t start = w->stats ? monotonic_ns() : 0;
+	if(w->throttle) throttle_open(w->throttle);
 	zip_t *z = zip_open(path, ZIP_RDONLY, &err);
+	if(w->stats) {
+		w->stats->archives++;
+		each_file_stats_add(w->stats, EF_PHASE_OPEN, monotonic_ns() - start);
+	}
 	if(!z) return err;
 	int num_entries = zip_get_num_entries(z, 0);
 	if(num_entries < 0) {
@@ -100,42 +1342,150 @@ static int each_file_zip(const char *path, struct file_type_filter *filters, int
 		return -1;
 	}
 	struct path_info p;
-	p.zip_file_name = (char *)path;
-	char *zip_dirname_str = strdup(path);
-	p.zip_file_dirname = dirname(zip_dirname_str);
-	char *zip_basename_str = strdup(path);
-	p.zip_file_base = basename(zip_basename_str);
-	char *zip_ext = strrchr(p.zip_file_base, '.');
-	if(zip_ext) *zip_ext = 0;
+	FILL_ZIP_PATH_INFO(path);
+	zs->p = p;
+	zs->p.output = w->opts ? w->opts->output : 0;
+	zs->p.acc = walk_acc(w);
+	zs->dirname_str = zip_dirname_str;
+	zs->basename_str = zip_basename_str;
+	zs->z = z;
+	zs->path = path;
+	zs->weight = weight;
+	zs->num_entries = num_entries;
+	zs->entry_path = 0;
+	zs->entry_path_alloc = 0;
+	// an archive interrupted in the middle continues after its last completed entry
+	zs->next = 0;
+	if(w->resume_entry >= 0) {
+		zs->next = w->resume_entry + 1;
+		w->resume_entry = -1;
+	}
+	return 0;
+}
 
-	for(int j = 0; j < num_entries; j++) {
+static int walk_zip_close(struct walk *w, struct walk_zip *zs, int r) {
+	// the batch cannot outlive the archive its entries are read from, on errors its entries are dropped with it
+	if(w->zip) {
+		if(r) w->batch_count = 0;
+		else r = walk_batch_flush(w);
+	}
+	w->zip = 0;
+	free(zs->entry_path);
+	free(zs->basename_str);
+	free(zs->dirname_str);
+	zip_close(zs->z);
+	zs->z = 0;
+	return r;
+}
+
+// after the callback of the entry in w->item returned r, 0 to go on with the next entry
+static int walk_zip_entry_done(struct walk *w, struct walk_zip *zs, int r) {
+	walk_item_close(w, &w->item);
+	if(r && !walk_is_skip(r)) return r;
+	walk_completed(w, zs->path, w->item.entry);
+	// skipping the siblings of an entry skips the rest of the archive
+	if(r) zs->next = zs->num_entries;
+	return 0;
+}
+
+// match the remaining entries of the archive, returns WALK_YIELD with an entry in w->item for an iterator
+static int walk_zip_entries(struct walk *w, struct walk_zip *zs) {
+	struct file_type_filter *filters = w->filters;
+	int flags = w->flags;
+	int shard_entries = walk_sharded(w) && !w->opts->shard_depth && w->opts->shard_zip_entries;
+	const struct predicate *pred = w->opts ? w->opts->predicate : 0;
+	const char *path = zs->path;
+	zip_t *z = zs->z;
+	int r = 0;
+	while(zs->next < zs->num_entries) {
+		int j = zs->next++;
 		zip_stat_t st;
 		zip_stat_index(z, j, ZIP_STAT_NAME | ZIP_STAT_SIZE, &st);
 		const char *ext = strrchr(st.name, '.');
 		if(!ext || !ext[1]) continue;
+		if(shard_entries && !walk_in_shard(w, path, st.name)) continue;
+		if(pred || w->stats) {
+			// entries are matched and reported as the archive path followed by the entry name
+			const char *rel = walk_relative(w, path);
+			size_t rel_len = strlen(rel), name_len = strlen(st.name);
+			if(rel_len + name_len + 2 > zs->entry_path_alloc) {
+				size_t alloc = rel_len + name_len + 2;
+				char *p = realloc(zs->entry_path, alloc);
+				if(!p) return ENOMEM;
+				zs->entry_path = p;
+				zs->entry_path_alloc = alloc;
+			}
+			memcpy(zs->entry_path, rel, rel_len);
+			zs->entry_path[rel_len] = '/';
+			memcpy(zs->entry_path + rel_len + 1, st.name, name_len + 1);
+		}
+		if(pred) {
+			if(!predicate_match_path(pred, zs->entry_path)) continue;
+			int64_t mtime_ns = (st.valid & ZIP_STAT_MTIME) ? (int64_t)st.mtime * 1000000000 : 0;
+			if(!predicate_match_stat(pred, st.size, mtime_ns)) continue;
+		}
 		for(struct file_type_filter *f = filters; f->ext; f++) {
 			if(strcasecmp(ext, f->ext)) continue;
-			struct zip_file_stream s;
+			double entry_weight = zs->weight;
+			if(!walk_sample_file(w, path, st.name, &entry_weight)) break;
+			if(w->opts && w->opts->dedup) {
+				uint32_t crc = st.crc;
+				r = each_file_dedup_add(w->opts->dedup, path, st.name, j, st.size, (st.valid & ZIP_STAT_CRC) ? &crc : 0);
+				if(r) return r;
+				walk_completed(w, path, j);
+				break;
+			}
+			if(walk_parallel(w) || w->batch) {
+				if(walk_parallel(w)) {
+					r = walk_schedule(w, path, st.name, j, f, entry_weight, st.size, 0, 0);
+				} else {
+					struct stat est;
+					memset(&est, 0, sizeof(est));
+					est.st_mode = S_IFREG | 0444;
+					est.st_size = st.size;
+					if(st.valid & ZIP_STAT_MTIME) est.st_mtime = st.mtime;
+					w->zip = z;
+					r = walk_batch_add(w, path, st.name, j, f, &est, entry_weight);
+				}
+				if(r) return r;
+				break;
+			}
+			struct walk_item *item = &w->item;
+			item->start = w->stats ? monotonic_ns() : 0;
 #ifdef HAVE_GZIP
-			int r = zip_file_stream_init_index(&s, z, j, (flags & EF_TRANSPARENT_GZIP) ? STREAM_TRANSPARENT_GZIP : 0);
+			r = lazy_stream_init_zip_index(&item->s, z, j, (flags & EF_TRANSPARENT_GZIP) ? STREAM_TRANSPARENT_GZIP : 0);
 #else
-			int r = zip_file_stream_init_index(&s, z, j, 0);
+			r = lazy_stream_init_zip_index(&item->s, z, j, 0);
 #endif
 			if(r) return r;
-			FILL_PATH_INFO(st.name);
-			r = f->file_cb(&p, (struct stream *)&s, f->user_data);
-			FREE_PATH_INFO();
-			stream_close((struct stream *)&s);
+			item->s.timed = w->stats != 0;
+			item->s.throttle = w->throttle;
+			item->has_stream = 1;
+			item->p = zs->p;
+			item->p.weight = entry_weight;
+			item->filter = f;
+			item->path = zs->entry_path;
+			item->entry = j;
+			// stored entries are read as they are unless they hold gzip data
+			item->compressed = (st.valid & ZIP_STAT_COMP_METHOD) && st.comp_method != ZIP_CM_STORE;
+			walk_item_names(item, st.name);
+			if(w->iter) return WALK_YIELD;
+			r = walk_zip_entry_done(w, zs, walk_item_call(item));
 			if(r) return r;
 			break;
 		}
 	}
-	free(zip_basename_str);
-	free(zip_dirname_str);
-	zip_close(z);
 	return 0;
 }
 
+static int each_file_zip(struct walk *w, const char *path, double weight) {
+	struct walk_zip *zs = &w->archive;
+	int r = walk_zip_open(w, zs, path, weight);
+	if(r) return r;
+	r = walk_zip_entries(w, zs);
+	return r == WALK_YIELD ? r : walk_zip_close(w, zs, r);
+}
+
 #ifdef WIN32
 wchar_t *_wbasename(wchar_t* path) {
 	wchar_t* base = wcspbrk(path, L"\\/");
@@ -212,34 +1562,16 @@ static int each_file_zipw(const wchar_t *path, struct file_type_filterw *filters
 
 #endif /* HAVE_LIBZIP */
 
-static int each_file_file(const char *path, const char *ext, struct file_type_filter *filters, int flags) {
-	for(struct file_type_filter *f = filters; f->ext; f++) {
-		if(strcasecmp(ext, f->ext)) continue;
-		struct path_info p;
-#ifdef HAVE_LIBZIP
-		p.zip_file_name = p.zip_file_base = p.zip_file_dirname = 0;
-#endif
-		if(flags & EF_OPEN_STREAM) {
-			struct file_stream s;
-#ifdef HAVE_GZIP
-			int r = file_stream_init(&s, path, "rb", (flags & EF_TRANSPARENT_GZIP) ? STREAM_TRANSPARENT_GZIP : 0);
-#else
-			int r = file_stream_init(&s, path, "rb", 0);
-#endif
-			if(r) return r;
-			FILL_PATH_INFO(path);
-			r = f->file_cb(&p, (struct stream *)&s, f->user_data);
-			FREE_PATH_INFO();
-			stream_close((struct stream *)&s);
-			if(r) return r;
-		} else {
-			FILL_PATH_INFO(path);
-			f->file_cb(&p, 0, f->user_data);
-			FREE_PATH_INFO();
-		}
-		return 0;
-	}
-	return 1;
+// fd is a prefetched descriptor of path, or -1
+static int each_file_file(struct walk *w, const char *path, struct file_type_filter *f, int fd, struct stream *output, void *acc, double weight) {
+	// worker threads run files concurrently, an iterator returns the item kept in the walk
+	struct walk_item local, *item = w->iter ? &w->item : &local;
+	int r = walk_item_file(w, item, path, f, fd, output, acc, weight);
+	if(r) return r;
+	if(w->iter) return WALK_YIELD;
+	r = walk_item_call(item);
+	walk_item_close(w, item);
+	return r;
 }
 
 #ifdef WIN32
@@ -272,25 +1604,579 @@ static int each_file_filew(const wchar_t *path, const wchar_t *ext, struct file_
 }
 #endif
 
-int each_file(const char *path, struct file_type_filter *filters, int flags) {
-	struct stat st;
-	int r = stat(path, &st);
-	if(r < 0) return errno;
-	if(S_ISDIR(st.st_mode) && (flags & EF_RECURSE_DIRS)) {
-		return each_file_dir(path, filters, flags);
+static int walk_is_archive(struct walk *w, const char *ext) {
+#ifdef HAVE_LIBZIP
+	return ext && !strcasecmp(ext, ".zip") && (w->flags & EF_RECURSE_ARCHIVES) && (w->flags & EF_OPEN_STREAM);
+#else
+	(void)w;
+	(void)ext;
+	return 0;
+#endif
+}
+
+static struct file_type_filter *walk_match_ext(struct walk *w, const char *ext) {
+	if(!ext) return 0;
+	for(struct file_type_filter *f = w->filters; f->ext; f++)
+		if(!strcasecmp(ext, f->ext)) return f;
+	return 0;
+}
+
+static struct file_type_filter *walk_match_magic(struct walk *w, const uint8_t *header, ssize_t header_len) {
+	for(size_t i = 0; i < w->num_magics; i++) {
+		const struct file_magic *m = w->magics[i];
+		if((ssize_t)(m->offset + m->len) > header_len) continue;
+		const uint8_t *h = header + m->offset, *b = m->bytes, *mask = m->mask;
+		size_t j = 0;
+		if(mask) {
+			while(j < m->len && !((h[j] ^ b[j]) & mask[j])) j++;
+		} else {
+			while(j < m->len && h[j] == b[j]) j++;
+		}
+		if(j == m->len) return m->filter;
+	}
+	return 0;
+}
+
+static ssize_t walk_read_header(const char *path, uint8_t *header, size_t len) {
+	int fd = open(path, O_RDONLY | O_BINARY);
+	if(fd < 0) return -1;
+	size_t n = 0;
+	while(n < len) {
+		ssize_t r = read(fd, header + n, len - n);
+		if(r <= 0) break;
+		n += r;
+	}
+	close(fd);
+	return n;
+}
+
+// flatten the magic list and find how much of each file has to be read
+static int walk_compile_magic(struct walk *w, const struct file_magic *magic) {
+	size_t num = 0;
+	for(const struct file_magic *m = magic; m->len; m++)
+		num++;
+	if(!num) return 0;
+	w->magics = malloc(num * sizeof(*w->magics));
+	if(!w->magics) return ENOMEM;
+	for(const struct file_magic *m = magic; m->len; m++) {
+		w->magics[w->num_magics++] = m;
+		if(m->offset + m->len > w->header_len)
+			w->header_len = m->offset + m->len;
+	}
+	return 0;
+}
+
+// run the callbacks of the oldest queued file, or of the entries of the oldest queued archive
+static int walk_dispatch(struct walk *w) {
+	struct prefetch_item *item = prefetch_head(w->prefetch);
+	struct file_type_filter *filter = item->data;
+	int r = 0;
+	// results written by the callback go to the manifest record of this file
+	if(w->opts->manifest) w->opts->manifest->current = item->tag;
+	if(filter) {
+		// a file that failed to open is opened again by path so that the callback sees the error
+		int fd = item->fd;
+		item->fd = -1;
+		r = each_file_file(w, item->path, filter, fd, w->opts->output, walk_acc(w), item->weight);
+	}
+#ifdef HAVE_LIBZIP
+	else {
+		r = each_file_zip(w, item->path, item->weight);
+	}
+#endif
+	if(!r && w->opts->manifest) manifest_commit(w->opts->manifest, item->tag);
+	int cr = walk_completed(w, item->path, -1);
+	if(!walk_is_skip(r)) {
+		prefetch_pop(w->prefetch);
+		return r ? r : cr;
+	}
+
+	// the files queued after this one in its directory come right after it
+	size_t dir_len = walk_dirname_len(item->path);
+	char *dir = malloc(dir_len + 1);
+	if(!dir) {
+		prefetch_pop(w->prefetch);
+		return ENOMEM;
+	}
+	memcpy(dir, item->path, dir_len);
+	dir[dir_len] = '/';
+	prefetch_pop(w->prefetch);
+	while((item = prefetch_head(w->prefetch)) && !strncmp(item->path, dir, dir_len + 1))
+		prefetch_pop(w->prefetch);
+	walk_skip_dir(w, dir, dir_len);
+	free(dir);
+	return cr;
+}
+
+// queue the current path for its callbacks, archives are queued to keep the walk order but not read ahead
+static int walk_prefetch(struct walk *w, struct file_type_filter *filter) {
+	int r = 0;
+	int current = w->opts->manifest ? w->opts->manifest->current : -1;
+	if(prefetch_full(w->prefetch)) {
+		w->skipped = 0;
+		r = walk_dispatch(w);
+		// a skipped directory on the stack is an ancestor of the current path
+		if(r == EF_STOP || w->skipped) return r;
+	}
+	int pr = prefetch_push(w->prefetch, w->path, filter, current, w->weight, filter != 0);
+	return pr ? pr : r;
+}
+
+// stat the current path relative to its directory, unless st already holds it
+static int walk_stat_file(struct walk *w, const struct stat **st, struct stat *buf) {
+	if(*st) return 0;
+	int r;
+	if(w->depth) {
+		struct walk_frame *f = &w->frames[w->depth - 1];
+		r = walk_stat(w, f, w->path + f->path_len + 1, buf);
 	} else {
-		const char *ext = strrchr(path, '.');
-		if(ext) {
+		r = walk_stat(w, 0, 0, buf);
+	}
+	if(r < 0) return errno;
+	*st = buf;
+	return 0;
+}
+
+// after the callbacks of the file or archive at w->path returned r
+static int walk_file_done(struct walk *w, int r, int record) {
+	if(!r && record >= 0) manifest_commit(w->opts->manifest, record);
+	int cr = walk_completed(w, w->path, -1);
+	return r ? r : cr;
+}
+
+static int walk_file(struct walk *w, const char *ext, const struct stat *st, const uint8_t *header, ssize_t header_len) {
+	int archive = walk_is_archive(w, ext);
+	// files below shard_depth are in a directory that was already assigned to this shard
+	if(walk_sharded(w) && (!w->opts->shard_depth || w->depth + w->depth_base <= w->opts->shard_depth)
+		&& !(archive && !w->opts->shard_depth && w->opts->shard_zip_entries) && !walk_in_shard(w, w->path, 0))
+		return 0;
+	// archives are pruned like directories, their entries are matched when they are read
+	const struct predicate *pred = w->opts ? w->opts->predicate : 0;
+	if(pred) {
+		const char *rel = walk_relative(w, w->path);
+		if(archive ? !predicate_match_dir(pred, rel) : !predicate_match_path(pred, rel)) return WALK_NO_MATCH;
+	}
+	struct file_type_filter *filter = archive ? 0 : walk_match_ext(w, ext);
+	if(!archive && !filter && w->num_magics) {
+		uint8_t *buf = 0;
+		if(!header) {
+			buf = malloc(w->header_len);
+			if(!buf) return ENOMEM;
+			header_len = walk_read_header(w->path, buf, w->header_len);
+			header = buf;
+		}
+		filter = walk_match_magic(w, header, header_len);
+		free(buf);
+	}
+	if(!archive && !filter) return WALK_NO_MATCH;
+	// archives are sampled by entry
+	if(!archive && !walk_sample_file(w, w->path, 0, &w->weight)) return 0;
+
+	struct stat fst;
+	if(pred && !archive && predicate_needs_stat(pred)) {
+		int r = walk_stat_file(w, &st, &fst);
+		if(r) return r;
+		if(!predicate_match_stat(pred, st->st_size, STAT_MTIME_NS(st))) return WALK_NO_MATCH;
+	}
+	if(w->flags & EF_SKIP_HARDLINKS) {
+		int r = walk_stat_file(w, &st, &fst);
+		if(r) return r;
+		if(st->st_nlink > 1) {
+			int seen = inode_set_insert(&w->files, st->st_dev, st->st_ino);
+			if(seen) return seen < 0 ? -seen : 0;
+		}
+	}
+	if(w->opts && w->opts->dedup && !archive) {
+		int r = walk_stat_file(w, &st, &fst);
+		if(!r) r = each_file_dedup_add(w->opts->dedup, w->path, 0, -1, st->st_size, 0);
+		int cr = walk_completed(w, w->path, -1);
+		return r ? r : cr;
+	}
+
+	const struct each_file_options *opts = w->opts;
+	int record = -1;
+	if(opts && opts->manifest) {
+		int r = walk_stat_file(w, &st, &fst);
+		if(r) return r;
+		const void *result;
+		size_t result_len;
+		r = manifest_update(opts->manifest, w->path, st, &result, &result_len);
+		if(r < 0) return -r;
+		record = opts->manifest->current;
+		if(r == MANIFEST_UNCHANGED) {
+			r = 0;
+			if(opts->manifest_replay_cb)
+				r = opts->manifest_replay_cb(w->path, result, result_len, opts->manifest_user_data);
+			int cr = walk_completed(w, w->path, -1);
+			return r ? r : cr;
+		}
+	}
+	if(w->batch && !archive) {
+		int r = walk_stat_file(w, &st, &fst);
+		if(r) return r;
+		return walk_batch_add(w, w->path, 0, -1, filter, st, w->weight);
+	}
+	if(walk_parallel(w) && !archive) {
+		int r = walk_stat_file(w, &st, &fst);
+		if(r) return r;
+		// chunks are byte ranges of the file as stored
+		uint64_t size = st->st_size, chunk = opts->chunk_size;
+		if(!chunk || !opts->chunk_cb || size <= chunk)
+			return walk_schedule(w, w->path, 0, -1, filter, w->weight, size, 0, 0);
+		for(uint64_t offset = 0; !r && offset < size; offset += chunk)
+			r = walk_schedule(w, w->path, 0, -1, filter, w->weight, MIN(chunk, size - offset), offset, MIN(chunk, size - offset));
+		return r;
+	}
+	if(w->prefetch)
+		return walk_prefetch(w, filter);
+	int r = 0;
 #ifdef HAVE_LIBZIP
-			if(!strcasecmp(ext, ".zip") && (flags & EF_RECURSE_ARCHIVES) && (flags & EF_OPEN_STREAM))
-				return each_file_zip(path, filters, flags);
+	if(archive)
+		r = each_file_zip(w, w->path, w->weight);
 #endif
-			return each_file_file(path, ext, filters, flags);
+	if(!archive)
+		r = each_file_file(w, w->path, filter, -1, w->opts ? w->opts->output : 0, walk_acc(w), w->weight);
+	if(r == WALK_YIELD) {
+		w->record = record;
+		return r;
+	}
+	return walk_file_done(w, r, record);
+}
+
+// set up a walk of path, whose stat is st, the walk is ended with walk_end() whether this fails or not
+static int walk_begin(struct walk *w, const char *root, const char *path, const struct stat *st, struct file_type_filter *filters, int flags, const struct each_file_options *opts, const struct checkpoint *resume) {
+	memset(w, 0, sizeof(*w));
+	w->filters = filters;
+	w->flags = flags;
+	w->opts = opts;
+	w->stats = opts ? opts->stats : 0;
+	w->root = root ? root : path;
+	w->resume = resume;
+	w->resume_entry = -1;
+	w->root_dev = st->st_dev;
+	w->weight = 1;
+#ifdef __linux__
+	w->old_ioprio = -1;
+#endif
+	int r = walk_set_path(w, 0, path);
+	if(!r && (flags & EF_SKIP_VISITED_DIRS) && inode_set_insert(&w->dirs, st->st_dev, st->st_ino) < 0)
+		r = ENOMEM;
+	// a root file is sharded by its name
+	const char *base = strrchr(path, '/');
+	w->root_len = S_ISDIR(st->st_mode) ? w->path_len : base ? (size_t)(base - path) : 0;
+	if(!r && root && strcmp(root, path)) {
+		// a walk below the root sees paths and depths as a walk of the whole tree would
+		size_t len = strlen(root);
+		while(len > 1 && root[len - 1] == '/') len--;
+		if(strncmp(path, root, len) || path[len] != '/' || (opts && opts->checkpoint)) {
+			r = EINVAL;
+		} else {
+			w->root_len = len;
+			for(const char *c = walk_relative(w, path); *c; c++)
+				if(*c != '/' && (c[-1] == '/')) w->depth_base++;
+		}
+		if(!r && walk_sharded(w) && opts->shard_depth && w->depth_base >= opts->shard_depth && !walk_base_in_shard(w)) {
+			w->outside_shard = 1;
+			return 0;
 		}
 	}
+	if(!r && opts && (opts->max_bytes_per_sec || opts->max_opens_per_sec)) {
+		// forked workers each get a copy of the buckets
+		uint64_t n = opts->processes ? opts->processes : 1;
+		r = throttle_init(&w->limits, (opts->max_bytes_per_sec + n - 1) / n, (opts->max_opens_per_sec + n - 1) / n);
+		if(!r) w->throttle = &w->limits;
+	}
+	if(!r && opts && opts->sample) {
+		// a sampled walk does not see every file
+		const struct each_file_sample *sample = opts->sample;
+		if(!(sample->file_rate >= 0 && sample->file_rate <= 1) || !(sample->subdir_rate >= 0 && sample->subdir_rate <= 1)
+			|| opts->manifest || opts->dedup)
+			r = EINVAL;
+	}
+	if(!r && opts && (opts->ioprio < EF_IOPRIO_DEFAULT || opts->ioprio > EF_IOPRIO_IDLE))
+		r = EINVAL;
+#ifdef __linux__
+	// set before any worker or prefetch thread is started, threads and forked processes inherit it
+	if(!r && opts && opts->ioprio) {
+		int prio = opts->ioprio == EF_IOPRIO_IDLE ? WALK_IOPRIO_VALUE(WALK_IOPRIO_CLASS_IDLE, 0) : WALK_IOPRIO_VALUE(WALK_IOPRIO_CLASS_BE, 7);
+		w->old_ioprio = syscall(SYS_ioprio_get, WALK_IOPRIO_WHO_PROCESS, 0);
+		if(w->old_ioprio < 0 || syscall(SYS_ioprio_set, WALK_IOPRIO_WHO_PROCESS, 0, prio) < 0) {
+			r = errno;
+			w->old_ioprio = -1;
+		}
+	}
+#endif
+	if(!r && opts && opts->magic)
+		r = walk_compile_magic(w, opts->magic);
+	if(!r && opts && opts->reduce) {
+		const struct each_file_reduce *reduce = opts->reduce;
+		if(!reduce->result || ((opts->threads || opts->processes) && !reduce->merge)) r = EINVAL;
+		else if(reduce->init) reduce->init(reduce->result, reduce->user_data);
+	}
+	if(!r && opts && opts->batch_cb) {
+		// a batch completes its files after the walk moved past them
+		if(opts->threads || opts->processes || opts->manifest || opts->checkpoint) r = EINVAL;
+		else r = walk_batch_init(w, opts->batch_size);
+	}
+	return r;
+}
+
+// finish a walk that ended with r and free it, returns r or the first error of finishing
+static int walk_end(struct walk *w, int r) {
+	const struct each_file_options *opts = w->opts;
+	if(w->batch && r != EF_STOP) {
+		int br = walk_batch_flush(w);
+		if(!r) r = br;
+	}
+	// a walk below the root does not see the files that are not below its path
+	if(!r && opts && opts->manifest && opts->manifest_deleted_cb && !w->depth_base)
+		r = manifest_each_deleted(opts->manifest, opts->manifest_deleted_cb, opts->manifest_user_data);
+	if(opts && opts->checkpoint) {
+		// a completed walk leaves nothing to resume
+		if(!r) remove(opts->checkpoint);
+		else walk_checkpoint(w);
+	}
+	walk_free(w);
+	if(w->throttle) throttle_destroy(w->throttle);
+#ifdef __linux__
+	if(w->old_ioprio >= 0) syscall(SYS_ioprio_set, WALK_IOPRIO_WHO_PROCESS, 0, w->old_ioprio);
+#endif
+	if(w->stats && opts->stats_json) {
+		struct file_stream out;
+		int sr = file_stream_init(&out, opts->stats_json, "w", 0);
+		if(!sr) {
+			sr = each_file_stats_json(w->stats, &out.stream);
+			if(stream_close(&out.stream) && !sr) sr = EIO;
+		}
+		if(!r) r = sr;
+	}
+	return r;
+}
+
+// pass the root, a file or a directory without EF_RECURSE_DIRS, to its callback
+static int walk_root_file(struct walk *w, const struct stat *st) {
+	const char *base = strrchr(w->path, '/');
+	const char *ext = strrchr(base ? base : w->path, '.');
+	if(w->stats) w->stats->files++;
+	int r = 0;
+	if(ext || w->num_magics) r = walk_file(w, ext, st, 0, 0);
+	return walk_is_skip(r) ? 0 : r;
+}
+
+static int each_file_walk(const char *root, const char *path, struct file_type_filter *filters, int flags, const struct each_file_options *opts, const struct checkpoint *resume) {
+	struct stat st;
+	if(stat(path, &st) < 0) return errno;
+
+	struct walk w;
+	int r = walk_begin(&w, root, path, &st, filters, flags, opts, resume);
+	if(!r && !w.outside_shard) {
+		if(S_ISDIR(st.st_mode) && (flags & EF_RECURSE_DIRS)) {
+			struct prefetch prefetch;
+			struct schedule schedule;
+#ifndef WIN32
+			struct process_pool pool;
+#endif
+			if(opts && opts->processes) {
+#ifdef WIN32
+				r = ENOTSUP;
+#else
+				// callbacks run in other address spaces, only their output and accumulators are sent back
+				if(opts->threads || opts->manifest || opts->checkpoint || opts->stats) {
+					r = EINVAL;
+				} else {
+					r = pthread_mutex_init(&w.workers_lock, 0);
+					if(!r) {
+						r = process_pool_init(&pool, opts->processes, opts->process_batch, opts->output, walk_run_task, walk_process_done,
+							opts->reduce ? walk_process_result : 0, walk_process_merge, walk_process_crashed, &w);
+						if(r) pthread_mutex_destroy(&w.workers_lock);
+					}
+					if(!r) w.pool = &pool;
+				}
+#endif
+			} else if(opts && opts->threads) {
+				// the walking thread is the only one that may touch these
+				if(opts->manifest || opts->checkpoint || opts->stats) {
+					r = EINVAL;
+				} else {
+					size_t window = opts->schedule_window ? opts->schedule_window : 4 * opts->threads;
+					if(opts->reduce) {
+						w.reduce_pending = malloc(opts->threads * sizeof(*w.reduce_pending));
+						if(!w.reduce_pending) r = ENOMEM;
+					}
+					if(!r) r = pthread_mutex_init(&w.workers_lock, 0);
+					if(!r) {
+						r = schedule_init(&schedule, opts->threads, window, (flags & EF_LARGEST_FIRST) != 0, opts->output, walk_run_task, walk_worker_done, &w);
+						if(r) pthread_mutex_destroy(&w.workers_lock);
+					}
+					if(!r) w.schedule = &schedule;
+				}
+			} else if(opts && opts->prefetch_depth && (flags & EF_OPEN_STREAM) && !opts->batch_cb) {
+				size_t bytes = opts->prefetch_bytes ? opts->prefetch_bytes : WALK_PREFETCH_BYTES;
+				size_t budget = opts->prefetch_budget ? opts->prefetch_budget : opts->prefetch_depth * bytes;
+				r = prefetch_init(&prefetch, opts->prefetch_depth, bytes, budget, w.throttle);
+				if(!r) w.prefetch = &prefetch;
+			}
+			if(!r) r = walk_dir(&w, &st);
+			if(w.prefetch) {
+				while(r != EF_STOP && !prefetch_empty(w.prefetch)) {
+					if(walk_dispatch(&w) == EF_STOP) r = EF_STOP;
+				}
+				prefetch_destroy(w.prefetch);
+				w.prefetch = 0;
+			}
+			if(w.schedule) {
+				int stopped;
+				int sr = schedule_finish(w.schedule, &stopped);
+				if(stopped && !r) r = EF_STOP;
+				if(sr && (!r || r == EF_STOP)) r = sr;
+				if(w.workers_err && (!r || r == EF_STOP)) r = w.workers_err;
+				w.schedule = 0;
+				pthread_mutex_destroy(&w.workers_lock);
+				for(size_t i = 0; i < w.num_reduce_pending; i++) {
+					opts->reduce->merge(opts->reduce->result, w.reduce_pending[i], opts->reduce->user_data);
+					free(w.reduce_pending[i]);
+				}
+			}
+#ifndef WIN32
+			if(w.pool) {
+				int stopped;
+				int pr = process_pool_finish(w.pool, &stopped);
+				if(stopped && !r) r = EF_STOP;
+				if(pr && (!r || r == EF_STOP)) r = pr;
+				w.pool = 0;
+				pthread_mutex_destroy(&w.workers_lock);
+			}
+#endif
+		} else {
+			r = walk_root_file(&w, &st);
+		}
+	}
+	return walk_end(&w, r);
+}
+
+// a stopped walk succeeded, a root file that matches nothing is reported as 1
+static int each_file_result(int r) {
+	if(r == EF_STOP) return 0;
+	if(r == WALK_NO_MATCH) return 1;
+	return r;
+}
+
+int each_file_opts(const char *path, struct file_type_filter *filters, int flags, const struct each_file_options *opts) {
+	return each_file_result(each_file_walk(0, path, filters, flags, opts, 0));
+}
+
+int each_file_below(const char *root, const char *path, struct file_type_filter *filters, int flags, const struct each_file_options *opts) {
+	int r = each_file_walk(root, path, filters, flags, opts, 0);
+	// as in a walk of the whole tree, files that match nothing are left out
+	return r == WALK_NO_MATCH ? 0 : r;
+}
+
+int each_file_resume(const char *path, struct file_type_filter *filters, int flags, const struct each_file_options *opts) {
+	if(!opts || !opts->checkpoint) return EINVAL;
+	struct checkpoint c;
+	int r = checkpoint_load(&c, opts->checkpoint);
+	if(r == ENOENT) return each_file_result(each_file_walk(0, path, filters, flags, opts, 0));
+	if(r) return r;
+	if(strcmp(c.root, path)) r = EINVAL;
+	else r = each_file_result(each_file_walk(0, path, filters, flags, opts, &c));
+	checkpoint_free(&c);
+	return r;
+}
+
+// each_file_iter.walk
+struct walk_iter {
+	struct walk w;
+	struct stat st; // of the root
+	int started;
+};
+
+// continue a walk after its iterator returned the item in w->item, r is the result the caller set for it
+static int walk_resume(struct walk *w, int r) {
+#ifdef HAVE_LIBZIP
+	if(w->archive.z) {
+		r = walk_zip_entry_done(w, &w->archive, r);
+		if(!r) r = walk_zip_entries(w, &w->archive);
+		if(r == WALK_YIELD) return r;
+		r = walk_zip_close(w, &w->archive, r);
+	} else
+#endif
+	walk_item_close(w, &w->item);
+	r = walk_file_done(w, r, w->record);
+	if(!w->depth) return walk_is_skip(r) ? 0 : r;
+	r = walk_dir_file_done(w, r);
+	return r ? r : walk_dir_loop(w);
+}
+
+int each_file_iter_init(struct each_file_iter *iter, const char *path, struct file_type_filter *filters, int flags, const struct each_file_options *opts) {
+	memset(iter, 0, sizeof(*iter));
+	// files are returned one at a time, in walk order, on the calling thread
+	if(opts && (opts->threads || opts->processes || opts->batch_cb || opts->prefetch_depth)) return EINVAL;
+	struct walk_iter *it = malloc(sizeof(*it));
+	if(!it) return ENOMEM;
+	if(stat(path, &it->st) < 0) {
+		free(it);
+		return errno;
+	}
+	int r = walk_begin(&it->w, 0, path, &it->st, filters, flags, opts, 0);
+	if(r) {
+		r = walk_end(&it->w, r);
+		free(it);
+		return r;
+	}
+	it->w.iter = 1;
+	it->started = 0;
+	iter->walk = it;
 	return 0;
 }
 
+int each_file_iter_next(struct each_file_iter *iter) {
+	struct walk_iter *it = iter->walk;
+	if(!it) return 0;
+	struct walk *w = &it->w;
+	int r;
+	if(it->started) {
+		r = walk_resume(w, iter->result);
+	} else {
+		it->started = 1;
+		if(S_ISDIR(it->st.st_mode) && (w->flags & EF_RECURSE_DIRS)) r = walk_dir(w, &it->st);
+		else r = walk_root_file(w, &it->st);
+	}
+	iter->result = EF_CONTINUE;
+	if(r == WALK_YIELD) {
+		iter->info = &w->item.p;
+		iter->stream = w->item.has_stream ? &w->item.s.stream : 0;
+		iter->filter = w->item.filter;
+		return 0;
+	}
+	iter->info = 0;
+	iter->stream = 0;
+	iter->filter = 0;
+	iter->walk = 0;
+	r = walk_end(w, r);
+	free(it);
+	return r == EF_STOP || r == WALK_NO_MATCH ? 0 : r;
+}
+
+void each_file_iter_free(struct each_file_iter *iter) {
+	struct walk_iter *it = iter->walk;
+	if(!it) return;
+	struct walk *w = &it->w;
+	// the current file is not completed, the walk ends as if its callback had stopped it
+	if(iter->info) {
+		walk_item_close(w, &w->item);
+#ifdef HAVE_LIBZIP
+		if(w->archive.z) walk_zip_close(w, &w->archive, EF_STOP);
+#endif
+	}
+	walk_end(w, EF_STOP);
+	free(it);
+	memset(iter, 0, sizeof(*iter));
+}
+
+int each_file(const char *path, struct file_type_filter *filters, int flags) {
+	return each_file_opts(path, filters, flags, 0);
+}
+
 #ifdef WIN32
 int each_filew(const wchar_t *path, struct file_type_filterw *filters, int flags) {
 	struct _stat st;
@@ -3,6 +3,13 @@
 #include "stream_base.h"
 #include "file_stream.h"
 #include "zip_file_stream.h"
+#include "lazy_stream.h"
+#include "manifest.h"
+#include "dir_cache.h"
+#include "checkpoint.h"
+#include "predicate.h"
+#include "each_file_stats.h"
+#include "each_file_dedup.h"
 
 struct path_info {
 #ifdef HAVE_LIBZIP
@@ -16,6 +23,10 @@ struct path_info {
 	char *file_basename;       // baz.txt
 	char *file_base;           // baz
 	char *file_ext;            // txt
+
+	struct stream *output;     // each_file_options.output, or with threads or processes a buffer committed to it in walk order
+	void *acc;                 // accumulator of the thread or process running the callback, see each_file_options.reduce
+	double weight;             // inverse of the probability that the file was passed, see each_file_options.sample
 };
 #ifdef WIN32
 struct path_infow {
@@ -50,12 +61,210 @@ struct file_type_filterw {
 #ifdef HAVE_LIBZIP
 #define EF_RECURSE_ARCHIVES 0x02
 #endif
+// pass a stream to the callbacks, opened on its first access
 #define EF_OPEN_STREAM 0x04
 #ifdef HAVE_GZIP
 #define EF_TRANSPARENT_GZIP 0x08
 #endif
+// process directory entries in inode order instead of readdir order
+#define EF_SORT_INODE 0x10
+// process directory entries in order of their first physical extent (FIEMAP, Linux only, inode order elsewhere)
+#define EF_SORT_EXTENT 0x20
+// skip files whose device and inode were already passed to a callback, such as further hard links to a file
+#define EF_SKIP_HARDLINKS 0x40
+// do not descend into directories on another filesystem than the root
+#define EF_ONE_FILESYSTEM 0x80
+// skip directories whose device and inode were already walked, which breaks symbolic link cycles and bind mount loops
+#define EF_SKIP_VISITED_DIRS 0x100
+// with worker threads, run the largest of the queued files and zip entries first instead of the oldest
+#define EF_LARGEST_FIRST 0x200
+
+// file and directory callback results, any other non-zero file callback result is an error that ends the
+// archive it was returned for and is returned by each_file() for a single file
+#define EF_CONTINUE      0
+#define EF_SKIP_SIBLINGS (-2) // skip the rest of the directory or archive the file or directory is in
+#define EF_SKIP_SUBTREE  (-3) // do not walk the directory, from a file callback the same as EF_SKIP_SIBLINGS
+#define EF_STOP          (-4) // end the walk, each_file() returns 0
+
+// I/O priority of a walk, see each_file_options.ioprio
+#define EF_IOPRIO_DEFAULT 0
+#define EF_IOPRIO_LOW     1 // lowest best-effort level
+#define EF_IOPRIO_IDLE    2 // only when no other process uses the disk
+
+// a file or zip entry passed to each_file_options.batch_cb, valid until the callback returns
+struct each_file_entry {
+	const char *path;          // file, or archive containing the entry
+	const char *entry;         // name of the zip entry, NULL for a file
+	struct file_type_filter *filter; // filter that matched, its callback is not called
+	struct stat st;            // for a zip entry only st_mode, st_size and st_mtime are set
+	struct stream *stream;     // opened on first access, NULL without EF_OPEN_STREAM
+	double weight;             // see path_info.weight
+};
+
+// map-reduce over a walk: the file callbacks are the map step and fold each file into path_info.acc, one
+// accumulator per thread, so that aggregations need no shared state
+struct each_file_reduce {
+	size_t size;               // bytes per accumulator
+	void (*init)(void *acc, void *user_data);
+	// fold from into into, partial results are merged in any order and from is freed afterwards
+	void (*merge)(void *into, void *from, void *user_data);
+	void *user_data;
+	void *result;              // size bytes, initialized at the start of the walk, holds the merged result after it
+};
+
+// sampling for estimates over trees too large to walk fully: only some of the matching files and zip entries are
+// passed, each with path_info.weight, so that the sum of weight * x over them is an unbiased estimate of the sum of
+// x over all of them, such as a count (x = 1) or total size, and of ratios of such sums
+// the choices depend only on the seed and the paths relative to the root, the same walk takes the same sample
+struct each_file_sample {
+	double file_rate;          // pass each file and zip entry with this probability, 0 for all
+	size_t dir_reservoir;      // pass at most this many of the files and archives of each directory, 0 for all
+	double subdir_rate;        // walk this fraction of the subdirectories of each directory, at least one, 0 for all
+	uint64_t seed;
+};
+
+// magic bytes at an offset from the start of a file, the bits set in mask are compared (all of them if mask is NULL)
+struct file_magic {
+	size_t offset;
+	const void *bytes;
+	const void *mask;
+	size_t len;
+	struct file_type_filter *filter; // filter the file is passed to
+};
+
+struct each_file_options {
+	size_t sort_window;        // entries collected and sorted at a time per directory, 0 for the whole directory
+	                           // on Linux a window is rounded up to whole getdents64 batches
+
+	// skip files that did not change since the manifest was last saved, a file counts as seen once its callback returned 0
+	struct manifest *manifest;
+	// called instead of the file callback for unchanged files, with the result stored by manifest_write_result()
+	int (*manifest_replay_cb)(const char *path, const void *result, size_t result_len, void *user_data);
+	// called after the walk for files that were in the manifest but were not seen
+	int (*manifest_deleted_cb)(const char *path, const void *result, size_t result_len, void *user_data);
+	void *manifest_user_data;
+
+	// expand directories that did not change since they were cached without reading them
+	struct dir_cache *dir_cache;
+
+	// files that no filter extension matches are passed to the filter of the first matching magic, ends with a zero len entry
+	// zip entries are matched by extension only
+	const struct file_magic *magic;
+
+	// with EF_OPEN_STREAM, open files and read ahead their start on a background thread while
+	// callbacks run, up to this many files ahead of them, 0 to disable
+	// callbacks still run in walk order on the calling thread
+	size_t prefetch_depth;
+	size_t prefetch_bytes;     // read ahead per file, 0 for 1 MiB
+	size_t prefetch_budget;    // read ahead of files not yet passed to a callback, 0 for prefetch_depth * prefetch_bytes
+
+	// process only the files whose path relative to the walk root hashes to shard_index, 0 shard_count to disable
+	unsigned shard_index, shard_count;
+	int shard_depth;           // >0 assigns whole directories at this depth below the root, other shards never list them
+	int shard_zip_entries;     // without shard_depth, assign zip entries by archive path and entry name instead of whole archives
+
+	// only files that match are passed to callbacks, directories and archives that cannot contain a match are not read
+	const struct predicate *predicate;
+
+	// called before a directory is read with an EF_* callback result, runs ahead of the file callbacks when prefetching
+	int (*dir_cb)(const char *path, void *user_data);
+	void *dir_user_data;
+
+	// run the callbacks of a directory walk on this many worker threads, 0 to run them on the calling thread
+	// callbacks then run concurrently and out of order, results other than EF_STOP are ignored,
+	// and manifest, checkpoint and stats cannot be used
+	unsigned threads;
+	size_t schedule_window;    // files and zip entries queued ahead of the workers, 0 for 4 per thread
+	// with threads, files larger than chunk_size are passed to chunk_cb in chunks of that many bytes instead of
+	// to their filter's callback, the stream is positioned at offset and the callback reads at most size bytes
+	uint64_t chunk_size;
+	int (*chunk_cb)(struct path_info *path_info, struct stream *stream, uint64_t offset, uint64_t size, void *user_data);
+	void *chunk_user_data;
+	// passed to callbacks as path_info.output, with threads or processes each callback writes to a buffer of its own and
+	// the buffers are written to output in the order the callbacks would run without them
+	struct stream *output;
+
+	// run the callbacks of a directory walk in this many forked worker processes instead, for callbacks that are not
+	// thread-safe, files and zip entries are written to the workers over Unix sockets process_batch (0 for 16) at a time
+	// results other than EF_STOP are ignored, and manifest, checkpoint, stats and threads cannot be used
+	// a worker that dies is replaced and the file it died on is passed to process_crash_cb, not available on WIN32
+	// the buffers of output are sent back with each file, and reduce accumulators when the workers exit, after the
+	// rest of their batch if the walk was stopped, with reduce a worker that dies fails the walk with ECHILD as its
+	// accumulator is lost
+	unsigned processes;
+	size_t process_batch;
+	void (*process_crash_cb)(const char *path, const char *entry, int status, void *user_data);
+	void *process_crash_user_data;
+
+	// for background scans: files and zip entries opened and bytes read or mapped through the streams passed to
+	// callbacks and by prefetching are limited to these rates, shared by all threads and split evenly between
+	// processes, 0 for no limit
+	uint64_t max_bytes_per_sec;
+	uint64_t max_opens_per_sec;
+	// EF_IOPRIO_* I/O priority of the walk and the threads and processes it starts, restored when it returns,
+	// ignored outside Linux
+	int ioprio;
+
+	// pass matching files and zip entries to batch_cb in arrays of up to batch_size (0 for 256) instead of to their
+	// filter's callback, a batch is passed before the archive its entries are in is closed
+	// results other than EF_STOP are ignored, and threads, manifest and checkpoint cannot be used
+	int (*batch_cb)(struct each_file_entry *entries, size_t num_entries, void *user_data);
+	void *batch_user_data;
+	size_t batch_size;
+
+	// without threads callbacks accumulate into reduce->result directly, with threads every worker thread gets an
+	// accumulator of its own, and workers that exit merge theirs in pairs so that large merges run in parallel
+	// with processes every worker process gets one, sent back as size bytes and merged into reduce->result
+	// batch callbacks get no accumulator and use reduce->result
+	const struct each_file_reduce *reduce;
+
+	// walk a random sample of the tree, directories are then read whole, manifest and dedup cannot be used
+	const struct each_file_sample *sample;
+
+	// counters, time per phase and the slowest files and directories are added to stats
+	struct each_file_stats *stats;
+	const char *stats_json;    // with stats, written as JSON to this file at the end of the walk
+
+	// dedup mode: matching files and zip entries are added to dedup as candidates instead of being passed to
+	// callbacks, each_file_dedup_report() then finds the duplicates among them
+	struct each_file_dedup *dedup;
+
+	// record the last completed file in this checkpoint file so that each_file_resume() can continue an interrupted walk
+	// directories are then read whole and walked in name order instead of any EF_SORT_* order
+	// the file is removed when the walk completes and written when it fails
+	const char *checkpoint;
+	size_t checkpoint_interval; // completed files between checkpoints, 0 for 1000
+};
 
 int each_file(const char *path, struct file_type_filter *filters, int flags);
+int each_file_opts(const char *path, struct file_type_filter *filters, int flags, const struct each_file_options *opts);
+// continue the walk recorded in opts->checkpoint without calling callbacks for completed files, or start it if there is none
+int each_file_resume(const char *path, struct file_type_filter *filters, int flags, const struct each_file_options *opts);
+// walk path, a file or directory below root, as part of a walk of root: shards, predicates, samples and checkpoints
+// see paths relative to root and depths below it, and a file that matches nothing is not an error
+// returns EF_STOP when a callback stopped the walk, checkpoint can only be used when path is root, manifest deletions
+// are only reported when path is root, and dir_reservoir and subdir_rate only sample below path
+int each_file_below(const char *root, const char *path, struct file_type_filter *filters, int flags, const struct each_file_options *opts);
+
+// pull-style walk: each_file_iter_next() returns the matching files and zip entries one at a time, in the order their
+// callbacks would run, instead of calling the filter callbacks
+struct each_file_iter {
+	struct path_info *info;    // current file or zip entry, NULL at the end of the walk
+	struct stream *stream;     // its stream, opened on first access, NULL without EF_OPEN_STREAM
+	struct file_type_filter *filter; // filter that matched, its callback is not called
+	int result;                // EF_* result for the current entry as its callback would return it, EF_CONTINUE by default
+	void *walk;                // private
+};
+// start walking path with the options of each_file_opts(), except that threads, processes, batch_cb and prefetch_depth
+// cannot be used, path and filters must stay valid until the walk ends, dir_cb and the other callbacks in opts run
+// inside each_file_iter_next()
+int each_file_iter_init(struct each_file_iter *iter, const char *path, struct file_type_filter *filters, int flags, const struct each_file_options *opts);
+// apply the result of the current entry and move to the next one, info and stream stay valid until the next call
+// returns 0 with info set, 0 with info NULL when the walk completed or was stopped (also for a root file that matches
+// nothing), or an error status that ends the walk
+int each_file_iter_next(struct each_file_iter *iter);
+// end a walk before each_file_iter_next() ended it, a checkpoint is written as for a stopped walk
+void each_file_iter_free(struct each_file_iter *iter);
 #ifdef WIN32
 int each_filew(const wchar_t *path, struct file_type_filterw *filters, int flags);
 #endif
@@ -0,0 +1,215 @@
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <iterator>
+#include <memory>
+#include <ranges>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include "stream.h"
+}
+
+namespace streamlib {
+
+/**
+ * @class generator
+ * @brief Minimal coroutine generator yielding references, an input view for std::ranges.
+ *
+ * A yielded value is only valid until the iterator is incremented.
+ * Exceptions thrown by the coroutine are rethrown from begin() and
+ * operator++.
+ */
+template<class T>
+class generator : public std::ranges::view_interface<generator<T>> {
+public:
+	struct promise_type {
+		T *value = nullptr;
+		std::exception_ptr error;
+
+		generator get_return_object() { return generator(handle::from_promise(*this)); }
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		std::suspend_always final_suspend() noexcept { return {}; }
+		std::suspend_always yield_value(T &v) noexcept {
+			value = std::addressof(v);
+			return {};
+		}
+		void return_void() noexcept {}
+		void unhandled_exception() { error = std::current_exception(); }
+	};
+	using handle = std::coroutine_handle<promise_type>;
+
+	class iterator {
+	public:
+		using value_type = std::remove_cv_t<T>;
+		using difference_type = std::ptrdiff_t;
+
+		iterator() = default;
+		T &operator*() const { return *h.promise().value; }
+		T *operator->() const { return h.promise().value; }
+		iterator &operator++() {
+			generator::resume(h);
+			return *this;
+		}
+		void operator++(int) { ++*this; }
+		bool operator==(std::default_sentinel_t) const { return !h || h.done(); }
+
+	private:
+		friend class generator;
+		explicit iterator(handle h) : h(h) {}
+		handle h;
+	};
+
+	generator() = default;
+	generator(generator &&o) noexcept : h(std::exchange(o.h, nullptr)) {}
+	generator &operator=(generator &&o) noexcept {
+		if(this != &o) {
+			if(h) h.destroy();
+			h = std::exchange(o.h, nullptr);
+		}
+		return *this;
+	}
+	~generator() {
+		if(h) h.destroy();
+	}
+
+	/** @brief Run up to the first value, can only be called once. */
+	iterator begin() {
+		if(h) resume(h);
+		return iterator(h);
+	}
+	std::default_sentinel_t end() const noexcept { return {}; }
+
+private:
+	explicit generator(handle h) : h(h) {}
+	static void resume(handle h) {
+		h.resume();
+		if(h.promise().error) std::rethrow_exception(std::exchange(h.promise().error, nullptr));
+	}
+	handle h;
+};
+
+/**
+ * @class entry
+ * @brief A file or zip entry passed by each_file, valid until the walk advances.
+ *
+ * The strings are views of the walker's path_info and the stream is the
+ * walker's lazy_stream: it is opened on its first access and closed by the
+ * walker when the walk advances.
+ */
+class entry {
+public:
+	/** @brief Path of the file, or name of the entry in its archive. */
+	std::string_view path() const { return view(info->file_name); }
+	std::string_view dirname() const { return view(info->file_dirname); }
+	std::string_view basename() const { return view(info->file_basename); }
+	std::string_view ext() const { return view(info->file_ext); }
+	/** @brief Path of the archive containing the entry, empty for a file. */
+	std::string_view archive() const {
+#ifdef HAVE_LIBZIP
+		return view(info->zip_file_name);
+#else
+		return {};
+#endif
+	}
+
+	/** @brief Stream of the content, NULL without EF_OPEN_STREAM. */
+	struct stream *stream() const { return s; }
+	ssize_t read(void *ptr, size_t size) const { return stream_read(s, ptr, size); }
+	/** @brief Output of the entry, see each_file_options::output. */
+	struct stream *output() const { return info->output; }
+	/** @brief Accumulator of the walk, see each_file_options::reduce. */
+	void *acc() const { return info->acc; }
+	/** @brief Sampling weight of the entry, see each_file_options::sample. */
+	double weight() const { return info->weight; }
+
+	/** @brief Result of the file callback for this entry, one of EF_*, see each_file.h. */
+	void control(int r) { result = r; }
+	void skip_siblings() { result = EF_SKIP_SIBLINGS; }
+	void stop() { result = EF_STOP; }
+
+private:
+	friend class walk_iter;
+	static std::string_view view(const char *str) { return str ? std::string_view(str) : std::string_view(); }
+	struct path_info *info = nullptr;
+	struct stream *s = nullptr;
+	int result = EF_CONTINUE;
+};
+
+/**
+ * @class walk_iter
+ * @brief Owns an each_file_iter and the root and filters it points to.
+ *
+ * The walk runs inside next() on the consumer's thread, so handing over
+ * an entry is a return from next(). The entry is shared, not copied.
+ */
+class walk_iter {
+public:
+	walk_iter(std::string root, std::vector<std::string> exts, int flags, const struct each_file_options *opts)
+		: root(std::move(root)), exts(std::move(exts)) {
+		for(const std::string &ext : this->exts)
+			filters.push_back({ ext.c_str(), nullptr, nullptr });
+		filters.push_back({ nullptr, nullptr, nullptr });
+		status = each_file_iter_init(&iter, this->root.c_str(), filters.data(), flags, opts);
+	}
+	walk_iter(const walk_iter &) = delete;
+	walk_iter &operator=(const walk_iter &) = delete;
+
+	/** @brief Ends a walk that was left early as if the current entry had stopped it. */
+	~walk_iter() { each_file_iter_free(&iter); }
+
+	/** @brief Apply the result of the current entry and move to the next one, NULL at the end of the walk. */
+	entry *next() {
+		if(status) return nullptr;
+		iter.result = current.result;
+		status = each_file_iter_next(&iter);
+		if(status || !iter.info) return nullptr;
+		current.info = iter.info;
+		current.s = iter.stream;
+		current.result = EF_CONTINUE;
+		return &current;
+	}
+
+	/** @brief Status of the walk once next() returned NULL, 0 if it completed or was stopped. */
+	int result() const { return status; }
+
+private:
+	std::string root;
+	std::vector<std::string> exts;
+	std::vector<struct file_type_filter> filters;
+	struct each_file_iter iter;
+	entry current;
+	int status = 0;
+};
+
+/**
+ * @brief Walk a tree as a range of entries.
+ *
+ * Files are selected by extension as with each_file(), everything else
+ * composes with std::ranges views, for example
+ * `walk(root, {".txt"}) | std::views::filter(...)`. Entries are not copied
+ * and nothing is allocated per entry. Leaving the range early stops the
+ * walk. The walk advances with the range on the calling thread, callbacks
+ * in opts such as dir_cb run from operator++, and threads, processes,
+ * batch_cb and prefetch_depth cannot be used.
+ * @param root Root directory or file.
+ * @param exts Extensions to select, like file_type_filter::ext.
+ * @param flags EF_* flags.
+ * @param opts Walk options, may be NULL, must stay valid while the range is used.
+ * @throws std::system_error with the status code if the walk fails.
+ */
+inline generator<entry> walk(std::string root, std::vector<std::string> exts, int flags = EF_RECURSE_DIRS | EF_OPEN_STREAM, const struct each_file_options *opts = nullptr) {
+	walk_iter w(std::move(root), std::move(exts), flags, opts);
+	while(entry *e = w.next())
+		co_yield *e;
+	// a root file that matches no filter is an empty range, not an error
+	if(w.result())
+		throw std::system_error(w.result(), std::generic_category());
+}
+
+}
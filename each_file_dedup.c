@@ -0,0 +1,314 @@
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "each_file_dedup.h"
+#include "file_stream.h"
+#include "zip_file_stream.h"
+#include "util.h"
+
+int each_file_dedup_init(struct each_file_dedup *dedup) {
+	memset(dedup, 0, sizeof(*dedup));
+	return 0;
+}
+
+static int dedup_heap_append(struct each_file_dedup *dedup, const char *str, uint64_t *offset) {
+	size_t len = strlen(str) + 1;
+	if(dedup->heap_len + len > dedup->heap_alloc) {
+		size_t alloc = dedup->heap_alloc ? dedup->heap_alloc : 4096;
+		while(alloc < dedup->heap_len + len) alloc *= 2;
+		char *heap = realloc(dedup->heap, alloc);
+		if(!heap) return ENOMEM;
+		dedup->heap = heap;
+		dedup->heap_alloc = alloc;
+	}
+	*offset = dedup->heap_len;
+	memcpy(dedup->heap + dedup->heap_len, str, len);
+	dedup->heap_len += len;
+	return 0;
+}
+
+int each_file_dedup_add(struct each_file_dedup *dedup, const char *path, const char *entry, int64_t index, uint64_t size, const uint32_t *crc) {
+	if(dedup->num_candidates >= dedup->candidates_alloc) {
+		size_t alloc = dedup->candidates_alloc ? dedup->candidates_alloc * 2 : 256;
+		struct each_file_dedup_candidate *candidates = realloc(dedup->candidates, alloc * sizeof(*candidates));
+		if(!candidates) return ENOMEM;
+		dedup->candidates = candidates;
+		dedup->candidates_alloc = alloc;
+	}
+	struct each_file_dedup_candidate c;
+	memset(&c, 0, sizeof(c));
+	if(dedup_heap_append(dedup, path, &c.path)) return ENOMEM;
+	c.index = -1;
+	if(entry) {
+		if(dedup_heap_append(dedup, entry, &c.entry)) return ENOMEM;
+		c.index = index;
+	}
+	c.size = size;
+	if(crc) {
+		c.crc = *crc;
+		c.has_crc = 1;
+	}
+	dedup->candidates[dedup->num_candidates++] = c;
+	return 0;
+}
+
+// candidates without a CRC come first in their size group, ties keep the order they were added in
+static int dedup_size_cmp(const void *a, const void *b) {
+	const struct each_file_dedup_candidate *ca = a, *cb = b;
+	if(ca->size != cb->size) return ca->size < cb->size ? -1 : 1;
+	if(ca->has_crc != cb->has_crc) return ca->has_crc - cb->has_crc;
+	if(ca->crc != cb->crc) return ca->crc < cb->crc ? -1 : 1;
+	return ca->path < cb->path ? -1 : ca->path > cb->path;
+}
+
+// candidates that could not be read come last
+static int dedup_hash_cmp(const void *a, const void *b) {
+	const struct each_file_dedup_candidate *ca = a, *cb = b;
+	if(!ca->hashed != !cb->hashed) return ca->hashed ? -1 : 1;
+	if(ca->hash != cb->hash) return ca->hash < cb->hash ? -1 : 1;
+	return ca->path < cb->path ? -1 : ca->path > cb->path;
+}
+
+struct dedup_state {
+	struct each_file_dedup *dedup;
+	int (*cb)(const struct each_file_dedup_item *items, size_t num_items, void *user_data);
+	void *user_data;
+	struct each_file_dedup_item *items;
+	size_t items_alloc;
+#ifdef HAVE_LIBZIP
+	// entries of the same archive tend to be hashed one after another
+	zip_t *zip;
+	char *zip_path;
+#endif
+};
+
+#ifdef HAVE_LIBZIP
+static zip_t *dedup_zip(struct dedup_state *s, const char *path) {
+	if(s->zip && !strcmp(s->zip_path, path)) return s->zip;
+	if(s->zip) zip_close(s->zip);
+	free(s->zip_path);
+	int err;
+	s->zip = zip_open(path, ZIP_RDONLY, &err);
+	s->zip_path = s->zip ? strdup(path) : 0;
+	if(s->zip && !s->zip_path) {
+		zip_close(s->zip);
+		s->zip = 0;
+	}
+	return s->zip;
+}
+#endif
+
+static int dedup_read(struct stream *stream, uint64_t len, uint64_t *hash, uint64_t *bytes) {
+	uint8_t buf[65536];
+	while(len) {
+		ssize_t n = stream_read(stream, buf, len < sizeof(buf) ? len : sizeof(buf));
+		if(n <= 0) return EIO; // shorter than when it was listed
+		*hash = fnv1a64(*hash, buf, n);
+		*bytes += n;
+		len -= n;
+	}
+	return 0;
+}
+
+union dedup_stream {
+	struct stream stream;
+	struct file_stream file;
+#ifdef HAVE_LIBZIP
+	struct zip_file_stream zip;
+#endif
+};
+
+// open the content of a candidate, an entry in the archive *own if own is not NULL, or in the shared one
+static int dedup_open(struct dedup_state *s, struct each_file_dedup_candidate *c, union dedup_stream *u, void **own) {
+	const char *path = s->dedup->heap + c->path;
+	if(c->index < 0) return file_stream_init(&u->file, path, "rb", 0);
+#ifdef HAVE_LIBZIP
+	zip_t *z;
+	if(own) {
+		int err;
+		z = *own = zip_open(path, ZIP_RDONLY, &err);
+	} else {
+		z = dedup_zip(s, path);
+	}
+	return z ? zip_file_stream_init_index(&u->zip, z, c->index, 0) : EIO;
+#else
+	(void)s;
+	(void)own;
+	return ENOTSUP;
+#endif
+}
+
+// hash the whole content, or with partial only its head and, with tail, its tail
+static int dedup_hash(struct dedup_state *s, struct each_file_dedup_candidate *c, int partial, int tail) {
+	union dedup_stream u;
+	int r = dedup_open(s, c, &u, 0);
+	if(r) return r;
+
+	uint64_t hash = FNV1A64_INIT;
+	if(partial && c->size > 2 * DEDUP_PARTIAL_BYTES) {
+		r = dedup_read(&u.stream, DEDUP_PARTIAL_BYTES, &hash, &s->dedup->bytes_hashed);
+		if(!r && tail) {
+			if(stream_seek(&u.stream, (long)(c->size - DEDUP_PARTIAL_BYTES), SEEK_SET)) r = EIO;
+			else r = dedup_read(&u.stream, DEDUP_PARTIAL_BYTES, &hash, &s->dedup->bytes_hashed);
+		}
+		c->hashed = 1;
+	} else {
+		r = dedup_read(&u.stream, c->size, &hash, &s->dedup->bytes_hashed);
+		c->hashed = 2;
+	}
+	stream_close(&u.stream);
+	c->hash = hash;
+	if(r) c->hashed = 0;
+	return r;
+}
+
+// compare the contents of two candidates of the same size byte by byte
+static int dedup_same(struct dedup_state *s, struct each_file_dedup_candidate *a, struct each_file_dedup_candidate *b, int *same) {
+	*same = 1;
+	if(!a->size) return 0;
+	union dedup_stream ua, ub;
+	void *zip = 0;
+	int r = dedup_open(s, a, &ua, 0);
+	if(r) return r;
+	// b may be in another archive than the shared one that a is read from
+	r = dedup_open(s, b, &ub, &zip);
+	if(r) {
+		stream_close(&ua.stream);
+#ifdef HAVE_LIBZIP
+		if(zip) zip_close(zip);
+#endif
+		return r;
+	}
+	uint8_t bufa[32768], bufb[32768];
+	for(uint64_t left = a->size; left && *same; ) {
+		size_t len = left < sizeof(bufa) ? left : sizeof(bufa);
+		ssize_t na = stream_read(&ua.stream, bufa, len), nb = stream_read(&ub.stream, bufb, len);
+		if(na != (ssize_t)len || nb != (ssize_t)len) {
+			// shorter than when it was listed
+			r = EIO;
+			break;
+		}
+		s->dedup->bytes_hashed += 2 * len;
+		*same = !memcmp(bufa, bufb, len);
+		left -= len;
+	}
+	stream_close(&ua.stream);
+	stream_close(&ub.stream);
+#ifdef HAVE_LIBZIP
+	if(zip) zip_close(zip);
+#endif
+	return r;
+}
+
+static int dedup_report_set(struct dedup_state *s, size_t first, size_t end) {
+	struct each_file_dedup *dedup = s->dedup;
+	size_t num = end - first;
+	if(num > s->items_alloc) {
+		struct each_file_dedup_item *items = realloc(s->items, num * sizeof(*items));
+		if(!items) return ENOMEM;
+		s->items = items;
+		s->items_alloc = num;
+	}
+	for(size_t i = 0; i < num; i++) {
+		const struct each_file_dedup_candidate *c = &dedup->candidates[first + i];
+		s->items[i].path = dedup->heap + c->path;
+		s->items[i].entry = c->index >= 0 ? dedup->heap + c->entry : 0;
+		s->items[i].size = c->size;
+	}
+	return s->cb(s->items, num, s->user_data);
+}
+
+// report the sets of identical content among candidates with equal full hashes, comparing the others to the first
+// one left, candidates that cannot be read are left out
+static int dedup_compare(struct dedup_state *s, size_t first, size_t end) {
+	struct each_file_dedup_candidate *c = s->dedup->candidates;
+	while(end - first > 1) {
+		// the ones identical to the first move right after it
+		size_t same_end = first + 1;
+		for(size_t i = first + 1; i < end; i++) {
+			int same;
+			if(dedup_same(s, &c[first], &c[i], &same) || !same) continue;
+			struct each_file_dedup_candidate t = c[i];
+			c[i] = c[same_end];
+			c[same_end++] = t;
+		}
+		if(same_end - first > 1) {
+			int r = dedup_report_set(s, first, same_end);
+			if(r) return r;
+		}
+		first = same_end;
+	}
+	return 0;
+}
+
+// hash the candidates in [first, end), then compare the runs of equal full hashes and hash the runs of equal partial hashes again
+static int dedup_group(struct dedup_state *s, size_t first, size_t end, int partial) {
+	struct each_file_dedup_candidate *c = s->dedup->candidates;
+	// compressed entries cannot seek, so their head has to do, and identical content only hashes alike when every
+	// candidate of the group is hashed over the same bytes
+	int tail = 1;
+	for(size_t i = first; i < end; i++)
+		if(c[i].index >= 0) tail = 0;
+	for(size_t i = first; i < end; i++) {
+		if(!c[i].size) {
+			c[i].hash = FNV1A64_INIT;
+			c[i].hashed = 2;
+		} else {
+			dedup_hash(s, &c[i], partial, tail);
+		}
+	}
+	qsort(c + first, end - first, sizeof(*c), dedup_hash_cmp);
+	int r = 0;
+	for(size_t i = first; !r && i < end && c[i].hashed; ) {
+		size_t j = i + 1;
+		while(j < end && c[j].hashed && c[j].hash == c[i].hash) j++;
+		if(j - i > 1)
+			r = c[i].hashed == 2 ? dedup_compare(s, i, j) : dedup_group(s, i, j, 0);
+		i = j;
+	}
+	return r;
+}
+
+int each_file_dedup_report(struct each_file_dedup *dedup, int (*cb)(const struct each_file_dedup_item *items, size_t num_items, void *user_data), void *user_data) {
+	struct dedup_state s;
+	memset(&s, 0, sizeof(s));
+	s.dedup = dedup;
+	s.cb = cb;
+	s.user_data = user_data;
+
+	struct each_file_dedup_candidate *c = dedup->candidates;
+	size_t n = dedup->num_candidates;
+	qsort(c, n, sizeof(*c), dedup_size_cmp);
+	int r = 0;
+	for(size_t i = 0; !r && i < n; ) {
+		size_t j = i + 1;
+		while(j < n && c[j].size == c[i].size) j++;
+		if(c[i].has_crc) {
+			// every candidate of the size has a CRC, only equal CRCs can be duplicates
+			for(size_t k = i; !r && k < j; ) {
+				size_t l = k + 1;
+				while(l < j && c[l].crc == c[k].crc) l++;
+				if(l - k > 1) r = dedup_group(&s, k, l, 1);
+				k = l;
+			}
+		} else if(j - i > 1) {
+			r = dedup_group(&s, i, j, 1);
+		}
+		i = j;
+	}
+
+#ifdef HAVE_LIBZIP
+	if(s.zip) zip_close(s.zip);
+	free(s.zip_path);
+#endif
+	free(s.items);
+	return r;
+}
+
+void each_file_dedup_free(struct each_file_dedup *dedup) {
+	free(dedup->candidates);
+	free(dedup->heap);
+	memset(dedup, 0, sizeof(*dedup));
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * @struct each_file_dedup_item
+ * @brief A member of a set of files with identical contents.
+ */
+struct each_file_dedup_item {
+	const char *path;  /**< File, or archive containing the entry */
+	const char *entry; /**< Name of the entry in the archive, NULL for a file */
+	uint64_t size;
+};
+
+/**
+ * @struct each_file_dedup
+ * @brief Candidates for duplicate detection, collected by each_file in dedup mode.
+ *
+ * Only candidates that share their size with another one are read. Zip
+ * entries of the same size whose CRC-32 differs are told apart from the
+ * central directory alone. The remaining candidates are hashed over their
+ * first and last DEDUP_PARTIAL_BYTES, or only the first when zip entries
+ * are among them, and only those whose partial hashes collide are hashed
+ * in full. Candidates whose full hashes are equal are
+ * then compared byte by byte, so members of a reported set have identical
+ * contents even when the 64-bit FNV-1a hash collides.
+ */
+struct each_file_dedup {
+	struct each_file_dedup_candidate {
+		uint64_t path;     /**< Heap offset of the path */
+		uint64_t entry;    /**< Heap offset of the entry name */
+		int64_t index;     /**< Entry index in the archive, -1 for a file */
+		uint64_t size;
+		uint64_t hash;
+		uint32_t crc;
+		uint8_t has_crc;
+		uint8_t hashed;    /**< 0, 1 after the partial hash, 2 when the hash covers the whole content */
+	} *candidates;
+	size_t num_candidates, candidates_alloc;
+	char *heap;
+	size_t heap_len, heap_alloc;
+
+	uint64_t bytes_hashed; /**< Bytes read by each_file_dedup_report(), for hashing and comparing */
+};
+
+#define DEDUP_PARTIAL_BYTES 4096
+
+/**
+ * @brief Initialize an empty set of candidates.
+ * @param dedup Pointer to the dedup object.
+ * @return Status code.
+ */
+int each_file_dedup_init(struct each_file_dedup *dedup);
+
+/**
+ * @brief Add a candidate.
+ * @param dedup Pointer to the dedup object.
+ * @param path File, or archive containing the entry.
+ * @param entry Name of the entry in the archive, NULL for a file.
+ * @param index Index of the entry in the archive, ignored for a file.
+ * @param size Size of the file or uncompressed entry.
+ * @param crc CRC-32 of the content if known, or NULL.
+ * @return Status code.
+ */
+int each_file_dedup_add(struct each_file_dedup *dedup, const char *path, const char *entry, int64_t index, uint64_t size, const uint32_t *crc);
+
+/**
+ * @brief Find the sets of candidates with identical contents.
+ *
+ * Candidates that cannot be read are left out. Sets are reported in order
+ * of size, each member once.
+ * @param dedup Pointer to the dedup object.
+ * @param cb Called for every set of two or more members, a non-zero result ends the report and is returned.
+ * @param user_data Passed to cb.
+ * @return Status code.
+ */
+int each_file_dedup_report(struct each_file_dedup *dedup, int (*cb)(const struct each_file_dedup_item *items, size_t num_items, void *user_data), void *user_data);
+
+/**
+ * @brief Release the candidates.
+ * @param dedup Pointer to the dedup object.
+ */
+void each_file_dedup_free(struct each_file_dedup *dedup);
@@ -0,0 +1,97 @@
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+#include "each_file_stats.h"
+
+static const char *const each_file_stats_phases[EF_NUM_PHASES] = {
+	"enumerate", "stat", "open", "read", "decompress", "callback", "prepare",
+};
+
+int each_file_stats_init(struct each_file_stats *stats, size_t top_n) {
+	memset(stats, 0, sizeof(*stats));
+	stats->top_n = top_n;
+	if(!top_n) return 0;
+	stats->slowest_files = calloc(top_n, sizeof(*stats->slowest_files));
+	stats->slowest_dirs = calloc(top_n, sizeof(*stats->slowest_dirs));
+	if(!stats->slowest_files || !stats->slowest_dirs) {
+		each_file_stats_free(stats);
+		return ENOMEM;
+	}
+	return 0;
+}
+
+void each_file_stats_add(struct each_file_stats *stats, int phase, uint64_t ns) {
+	stats->phase_ns[phase] += ns;
+	int bucket = 0;
+	while(bucket < EF_STATS_BUCKETS - 1 && ns >> bucket)
+		bucket++;
+	stats->histogram[phase][bucket]++;
+}
+
+int each_file_stats_slow(struct each_file_stats *stats, int dir, const char *path, uint64_t ns) {
+	struct each_file_stats_item *items = dir ? stats->slowest_dirs : stats->slowest_files;
+	size_t *num = dir ? &stats->num_slowest_dirs : &stats->num_slowest_files;
+	if(!stats->top_n || (*num == stats->top_n && ns <= items[*num - 1].ns)) return 0;
+	char *p = strdup(path);
+	if(!p) return ENOMEM;
+	size_t i = *num;
+	if(*num == stats->top_n) free(items[--i].path);
+	else (*num)++;
+	for(; i > 0 && items[i - 1].ns < ns; i--)
+		items[i] = items[i - 1];
+	items[i].path = p;
+	items[i].ns = ns;
+	return 0;
+}
+
+static void each_file_stats_json_string(struct stream *out, const char *str) {
+	stream_printf(out, "\"");
+	for(const unsigned char *p = (const unsigned char *)str; *p; p++) {
+		if(*p == '"' || *p == '\\') stream_printf(out, "\\%c", *p);
+		else if(*p < 0x20) stream_printf(out, "\\u%04x", *p);
+		else stream_printf(out, "%c", *p);
+	}
+	stream_printf(out, "\"");
+}
+
+static void each_file_stats_json_items(struct stream *out, const struct each_file_stats_item *items, size_t num) {
+	stream_printf(out, "[");
+	for(size_t i = 0; i < num; i++) {
+		stream_printf(out, "%s{\"path\":", i ? "," : "");
+		each_file_stats_json_string(out, items[i].path);
+		stream_printf(out, ",\"ns\":%" PRIu64 "}", items[i].ns);
+	}
+	stream_printf(out, "]");
+}
+
+int each_file_stats_json(const struct each_file_stats *stats, struct stream *out) {
+	stream_printf(out, "{\"dirs\":%" PRIu64 ",\"files\":%" PRIu64 ",\"archives\":%" PRIu64 ",\"archive_entries\":%" PRIu64 ",\"bytes_read\":%" PRIu64 ",\"phases\":{",
+		stats->dirs, stats->files, stats->archives, stats->archive_entries, stats->bytes_read);
+	for(int i = 0; i < EF_NUM_PHASES; i++) {
+		stream_printf(out, "%s\"%s\":{\"ns\":%" PRIu64 ",\"histogram\":[", i ? "," : "", each_file_stats_phases[i], stats->phase_ns[i]);
+		// trailing empty buckets are left out
+		int n = EF_STATS_BUCKETS;
+		while(n > 0 && !stats->histogram[i][n - 1])
+			n--;
+		for(int b = 0; b < n; b++)
+			stream_printf(out, "%s%" PRIu64, b ? "," : "", stats->histogram[i][b]);
+		stream_printf(out, "]}");
+	}
+	stream_printf(out, "},\"slowest_files\":");
+	each_file_stats_json_items(out, stats->slowest_files, stats->num_slowest_files);
+	stream_printf(out, ",\"slowest_dirs\":");
+	each_file_stats_json_items(out, stats->slowest_dirs, stats->num_slowest_dirs);
+	return stream_printf(out, "}\n") < 0 ? EIO : 0;
+}
+
+void each_file_stats_free(struct each_file_stats *stats) {
+	for(size_t i = 0; i < stats->num_slowest_files; i++)
+		free(stats->slowest_files[i].path);
+	for(size_t i = 0; i < stats->num_slowest_dirs; i++)
+		free(stats->slowest_dirs[i].path);
+	free(stats->slowest_files);
+	free(stats->slowest_dirs);
+	memset(stats, 0, sizeof(*stats));
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "stream_base.h"
+
+// phases of a walk
+#define EF_PHASE_ENUMERATE  0 /**< Reading directories */
+#define EF_PHASE_STAT       1
+#define EF_PHASE_OPEN       2 /**< Opening files, archives and zip entries */
+#define EF_PHASE_READ       3 /**< Reads of uncompressed files */
+#define EF_PHASE_DECOMPRESS 4 /**< Reads of compressed zip entries and of gzip data read with EF_TRANSPARENT_GZIP */
+#define EF_PHASE_CALLBACK   5 /**< Callback time not spent in opens and reads */
+#define EF_PHASE_PREPARE    6 /**< Sorting and sampling listings and sniffing the headers of their files */
+#define EF_NUM_PHASES       7
+
+#define EF_STATS_BUCKETS 48
+
+/**
+ * @struct each_file_stats_item
+ * @brief A file or directory and the time spent on it.
+ */
+struct each_file_stats_item {
+	char *path;
+	uint64_t ns;
+};
+
+/**
+ * @struct each_file_stats
+ * @brief Counters, time per phase and the slowest items of one or more walks.
+ *
+ * Files are timed from the start of their callback to the close of their
+ * stream, directories by the time spent reading them, stat'ing their
+ * entries and sniffing their files. Opens done ahead by prefetching are not counted.
+ */
+struct each_file_stats {
+	uint64_t dirs, files, archives, archive_entries, bytes_read;
+	uint64_t phase_ns[EF_NUM_PHASES];
+	uint64_t histogram[EF_NUM_PHASES][EF_STATS_BUCKETS]; /**< Operations per phase, bucket i counts latencies in [2^(i-1), 2^i) ns */
+
+	size_t top_n;
+	struct each_file_stats_item *slowest_files; /**< Slowest first */
+	size_t num_slowest_files;
+	struct each_file_stats_item *slowest_dirs;  /**< Slowest first */
+	size_t num_slowest_dirs;
+};
+
+/**
+ * @brief Initialize statistics.
+ * @param stats Pointer to the statistics object.
+ * @param top_n Number of slowest files and directories to keep.
+ * @return Status code.
+ */
+int each_file_stats_init(struct each_file_stats *stats, size_t top_n);
+
+/**
+ * @brief Account one operation of a phase.
+ * @param stats Pointer to the statistics object.
+ * @param phase EF_PHASE_*.
+ * @param ns Duration of the operation.
+ */
+void each_file_stats_add(struct each_file_stats *stats, int phase, uint64_t ns);
+
+/**
+ * @brief Offer a file or directory to the slowest items.
+ * @param stats Pointer to the statistics object.
+ * @param dir Non-zero for a directory.
+ * @param path Path of the item, copied if kept.
+ * @param ns Time spent on the item.
+ * @return Status code.
+ */
+int each_file_stats_slow(struct each_file_stats *stats, int dir, const char *path, uint64_t ns);
+
+/**
+ * @brief Write the statistics as a JSON object.
+ * @param stats Pointer to the statistics object.
+ * @param out Stream to write to.
+ * @return Status code.
+ */
+int each_file_stats_json(const struct each_file_stats *stats, struct stream *out);
+
+/**
+ * @brief Release the statistics.
+ * @param stats Pointer to the statistics object.
+ */
+void each_file_stats_free(struct each_file_stats *stats);
@@ -0,0 +1,290 @@
+#ifdef __linux__
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include "each_file_watch.h"
+
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_MOVE_SELF | IN_DELETE_SELF | IN_ONLYDIR)
+
+// pending events are dispatched at the latest after this many coalescing periods
+#define WATCH_MAX_DELAY 10
+
+static char *watch_join(const char *dir, const char *name) {
+	size_t dir_len = strlen(dir), name_len = strlen(name);
+	char *path = malloc(dir_len + name_len + 2);
+	if(!path) return 0;
+	memcpy(path, dir, dir_len);
+	path[dir_len] = '/';
+	memcpy(path + dir_len + 1, name, name_len + 1);
+	return path;
+}
+
+// a directory that is already watched under a parent path is a symlink or bind mount loop
+static int watch_add(struct each_file_watch *watch, const char *path, int *loop) {
+	*loop = 0;
+	int wd = inotify_add_watch(watch->fd, path, WATCH_MASK);
+	if(wd < 0) return errno;
+	if(wd >= watch->wd_paths_alloc) {
+		int alloc = watch->wd_paths_alloc ? watch->wd_paths_alloc : 64;
+		while(alloc <= wd) alloc *= 2;
+		char **wd_paths = realloc(watch->wd_paths, alloc * sizeof(*wd_paths));
+		if(!wd_paths) return ENOMEM;
+		memset(wd_paths + watch->wd_paths_alloc, 0, (alloc - watch->wd_paths_alloc) * sizeof(*wd_paths));
+		watch->wd_paths = wd_paths;
+		watch->wd_paths_alloc = alloc;
+	}
+	char *old = watch->wd_paths[wd];
+	if(old) {
+		size_t old_len = strlen(old);
+		if(!strncmp(path, old, old_len) && path[old_len] == '/') {
+			*loop = 1;
+			return 0;
+		}
+	}
+	char *p = strdup(path);
+	if(!p) return ENOMEM;
+	free(old);
+	watch->wd_paths[wd] = p;
+	return 0;
+}
+
+static int watch_add_tree(struct each_file_watch *watch, const char *path) {
+	int loop;
+	int r = watch_add(watch, path, &loop);
+	if(r || loop) return r;
+	DIR *d = opendir(path);
+	if(!d) return 0; // removed in the meantime
+	struct dirent *de;
+	while(!r && (de = readdir(d))) {
+		if(de->d_name[0] == '.' && de->d_name[1] == 0) continue;
+		if(de->d_name[0] == '.' && de->d_name[1] == '.' && de->d_name[2] == 0) continue;
+		if(de->d_type != DT_DIR && de->d_type != DT_UNKNOWN && de->d_type != DT_LNK) continue;
+		char *sub = watch_join(path, de->d_name);
+		if(!sub) {
+			r = ENOMEM;
+			break;
+		}
+		struct stat st;
+		if(!stat(sub, &st) && S_ISDIR(st.st_mode))
+			r = watch_add_tree(watch, sub);
+		free(sub);
+	}
+	closedir(d);
+	return r;
+}
+
+static int watch_queue(struct each_file_watch *watch, char *path, int is_dir) {
+	if(watch->num_pending >= watch->pending_alloc) {
+		size_t alloc = watch->pending_alloc ? watch->pending_alloc * 2 : 64;
+		struct each_file_watch_pending *pending = realloc(watch->pending, alloc * sizeof(*pending));
+		if(!pending) {
+			free(path);
+			return ENOMEM;
+		}
+		watch->pending = pending;
+		watch->pending_alloc = alloc;
+	}
+	watch->pending[watch->num_pending].path = path;
+	watch->pending[watch->num_pending].is_dir = is_dir;
+	watch->num_pending++;
+	return 0;
+}
+
+static int watch_event(struct each_file_watch *watch, const struct inotify_event *ev) {
+	if(ev->mask & IN_Q_OVERFLOW) {
+		watch->rescan = 1;
+		return 0;
+	}
+	if(ev->wd < 0 || ev->wd >= watch->wd_paths_alloc || !watch->wd_paths[ev->wd]) return 0;
+	if(ev->mask & IN_IGNORED) {
+		free(watch->wd_paths[ev->wd]);
+		watch->wd_paths[ev->wd] = 0;
+		return 0;
+	}
+	if(ev->mask & IN_MOVE_SELF) {
+		// the path is stale, the move target is watched again when it is walked
+		inotify_rm_watch(watch->fd, ev->wd);
+		return 0;
+	}
+	if(!ev->len) return 0;
+	if(ev->mask & IN_ISDIR) {
+		if(!(ev->mask & (IN_CREATE | IN_MOVED_TO))) return 0;
+	} else if(!(ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))) {
+		return 0;
+	}
+	char *path = watch_join(watch->wd_paths[ev->wd], ev->name);
+	if(!path) return ENOMEM;
+	return watch_queue(watch, path, (ev->mask & IN_ISDIR) ? 1 : 0);
+}
+
+// by path components, '/' before any other byte, so that the contents of a directory
+// follow it before a sibling such as "a-x" that strcmp puts between "a" and "a/f"
+static int watch_path_cmp(const char *a, const char *b) {
+	while(*a && *a == *b) {
+		a++;
+		b++;
+	}
+	int ca = *a == '/' ? 1 : *a ? (unsigned char)*a + 1 : 0;
+	int cb = *b == '/' ? 1 : *b ? (unsigned char)*b + 1 : 0;
+	return ca - cb;
+}
+
+static int watch_pending_cmp(const void *a, const void *b) {
+	const struct each_file_watch_pending *pa = a, *pb = b;
+	int c = watch_path_cmp(pa->path, pb->path);
+	if(c) return c;
+	return pb->is_dir - pa->is_dir;
+}
+
+// walk the pending events as parts of the tree, returns EF_STOP when a callback stopped the walk
+static int watch_flush(struct each_file_watch *watch) {
+	int r = 0;
+	if(watch->rescan) {
+		r = watch_add_tree(watch, watch->root);
+		if(!r) r = each_file_below(watch->root, watch->root, watch->filters, watch->flags, &watch->opts);
+	} else {
+		// only a walk of the whole tree can be resumed from a checkpoint
+		struct each_file_options opts = watch->opts;
+		opts.checkpoint = 0;
+		// directories sort before their contents, which their walk already covers
+		qsort(watch->pending, watch->num_pending, sizeof(*watch->pending), watch_pending_cmp);
+		const char *dir = 0;
+		size_t dir_len = 0;
+		for(size_t i = 0; !r && i < watch->num_pending; i++) {
+			struct each_file_watch_pending *p = &watch->pending[i];
+			if(i > 0 && !strcmp(p->path, watch->pending[i - 1].path)) continue;
+			if(dir && !strncmp(p->path, dir, dir_len) && p->path[dir_len] == '/') continue;
+			if(p->is_dir) {
+				r = watch_add_tree(watch, p->path);
+				if(r == ENOENT) r = 0;
+				if(r) break;
+				dir = p->path;
+				dir_len = strlen(dir);
+			}
+			r = each_file_below(watch->root, p->path, watch->filters, watch->flags, &opts);
+			// removed again before it was dispatched
+			if(r == ENOENT) r = 0;
+		}
+	}
+	for(size_t i = 0; i < watch->num_pending; i++)
+		free(watch->pending[i].path);
+	watch->num_pending = 0;
+	watch->rescan = 0;
+	return r;
+}
+
+static long watch_now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int each_file_watch_init(struct each_file_watch *watch, const char *path, struct file_type_filter *filters, int flags, const struct each_file_options *opts) {
+	memset(watch, 0, sizeof(*watch));
+	watch->stop_pipe[0] = watch->stop_pipe[1] = -1;
+	watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(watch->fd < 0) return errno;
+	int r = 0;
+	if(pipe(watch->stop_pipe)) {
+		r = errno;
+		goto fail;
+	}
+	fcntl(watch->stop_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(watch->stop_pipe[1], F_SETFL, O_NONBLOCK);
+	watch->root = strdup(path);
+	if(!watch->root) {
+		r = ENOMEM;
+		goto fail;
+	}
+	watch->filters = filters;
+	watch->flags = flags | EF_RECURSE_DIRS;
+	if(opts) watch->opts = *opts;
+	watch->opts.manifest_deleted_cb = 0;
+
+	// watch first so that nothing created during the initial walk is missed
+	r = watch_add_tree(watch, path);
+	if(!r) r = each_file_opts(path, filters, watch->flags, opts);
+	if(!r) return 0;
+
+fail:
+	each_file_watch_close(watch);
+	return r;
+}
+
+int each_file_watch_run(struct each_file_watch *watch, int coalesce_ms) {
+	char buf[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+	long first_pending = 0;
+	for(;;) {
+		int timeout = -1;
+		if(watch->num_pending || watch->rescan) {
+			long left = first_pending + (long)coalesce_ms * WATCH_MAX_DELAY - watch_now_ms();
+			timeout = left < coalesce_ms ? (left > 0 ? left : 0) : coalesce_ms;
+		}
+		struct pollfd pfd[2] = {
+			{ watch->fd, POLLIN, 0 },
+			{ watch->stop_pipe[0], POLLIN, 0 },
+		};
+		int n = poll(pfd, 2, timeout);
+		if(n < 0) {
+			if(errno == EINTR) continue;
+			return errno;
+		}
+		if(pfd[1].revents) {
+			while(read(watch->stop_pipe[0], buf, sizeof(buf)) > 0);
+			return 0;
+		}
+		if(n == 0) {
+			int r = watch_flush(watch);
+			if(r) return r == EF_STOP ? 0 : r;
+			continue;
+		}
+		if(!(pfd[0].revents & POLLIN)) continue;
+		ssize_t len = read(watch->fd, buf, sizeof(buf));
+		if(len < 0) {
+			if(errno == EINTR || errno == EAGAIN) continue;
+			return errno;
+		}
+		int had_pending = watch->num_pending || watch->rescan;
+		for(char *p = buf; p < buf + len; ) {
+			struct inotify_event *ev = (struct inotify_event *)p;
+			int r = watch_event(watch, ev);
+			if(r) return r;
+			p += sizeof(*ev) + ev->len;
+		}
+		if(!had_pending && (watch->num_pending || watch->rescan))
+			first_pending = watch_now_ms();
+	}
+}
+
+void each_file_watch_stop(struct each_file_watch *watch) {
+	char c = 0;
+	if(write(watch->stop_pipe[1], &c, 1) < 0) {
+		// the pipe is full, a stop is already pending
+	}
+}
+
+void each_file_watch_close(struct each_file_watch *watch) {
+	if(watch->fd >= 0) close(watch->fd);
+	if(watch->stop_pipe[0] >= 0) close(watch->stop_pipe[0]);
+	if(watch->stop_pipe[1] >= 0) close(watch->stop_pipe[1]);
+	for(int i = 0; i < watch->wd_paths_alloc; i++)
+		free(watch->wd_paths[i]);
+	free(watch->wd_paths);
+	for(size_t i = 0; i < watch->num_pending; i++)
+		free(watch->pending[i].path);
+	free(watch->pending);
+	free(watch->root);
+	memset(watch, 0, sizeof(*watch));
+	watch->fd = watch->stop_pipe[0] = watch->stop_pipe[1] = -1;
+}
+
+#endif
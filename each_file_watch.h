@@ -0,0 +1,70 @@
+#pragma once
+
+#ifdef __linux__
+
+#include "each_file.h"
+
+/**
+ * @struct each_file_watch
+ * @brief Continuous each_file over a directory tree, driven by inotify.
+ *
+ * After the initial walk, only files that are written and closed or moved
+ * into the tree are passed to the filters, and directories that appear are
+ * walked as a whole. Events are coalesced so that a burst touching the same
+ * file dispatches it once. When the event queue overflows the whole tree is
+ * walked again.
+ */
+struct each_file_watch {
+	int fd;                    /**< inotify descriptor */
+	int stop_pipe[2];          /**< Written by each_file_watch_stop() */
+	char *root;
+	struct file_type_filter *filters;
+	int flags;
+	struct each_file_options opts;
+
+	char **wd_paths;           /**< Directory path of each watch descriptor */
+	int wd_paths_alloc;
+
+	struct each_file_watch_pending {
+		char *path;
+		int is_dir;
+	} *pending;
+	size_t num_pending, pending_alloc;
+	int rescan;
+};
+
+/**
+ * @brief Watch a directory tree and walk it once.
+ * @param watch Pointer to the watch object.
+ * @param path Root of the tree.
+ * @param filters File type filters, used for the initial walk and every event.
+ * @param flags EF_* flags, EF_RECURSE_DIRS is implied.
+ * @param opts Walk options, may be NULL. Deletions are only reported by the initial walk.
+ * @return Status code.
+ */
+int each_file_watch_init(struct each_file_watch *watch, const char *path, struct file_type_filter *filters, int flags, const struct each_file_options *opts);
+
+/**
+ * @brief Dispatch filesystem events until each_file_watch_stop() is called or a callback returns EF_STOP.
+ *
+ * Events are walked with each_file_below() relative to the root, without
+ * the checkpoint. The first error of a walk ends the watch.
+ * @param watch Pointer to the watch object.
+ * @param coalesce_ms Events are collected until none arrived for this long before being dispatched.
+ * @return 0 when stopped, otherwise a status code.
+ */
+int each_file_watch_run(struct each_file_watch *watch, int coalesce_ms);
+
+/**
+ * @brief Make each_file_watch_run() return. Safe to call from other threads and signal handlers.
+ * @param watch Pointer to the watch object.
+ */
+void each_file_watch_stop(struct each_file_watch *watch);
+
+/**
+ * @brief Remove all watches and release the watch object.
+ * @param watch Pointer to the watch object.
+ */
+void each_file_watch_close(struct each_file_watch *watch);
+
+#endif
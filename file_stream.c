@@ -91,10 +91,12 @@ static void *file_stream_get_memory_access(struct stream *stream, size_t *length
 
 static int file_stream_revoke_memory_access(struct stream *stream) {
 #ifdef WIN32
-	return UnmapViewOfFile(stream->mem) ? 0 : -1;
+	int r = UnmapViewOfFile(stream->mem) ? 0 : -1;
 #else
-	return munmap(stream->mem, stream->mem_size);
+	int r = munmap(stream->mem, stream->mem_size);
 #endif
+	stream->mem = 0;
+	return r;
 }
 
 static int file_stream_close(struct stream *stream) {
@@ -181,6 +183,8 @@ static int file_stream_close_gz(struct stream *stream) {
 
 static int file_stream_init_gz(struct file_stream *stream, gzFile gz) {
 	stream->gz = gz;
+	// gzread() passes files without a gzip header through as they are
+	if(!gzdirect(gz)) stream->stream.flags |= STREAM_IS_GZIPPED;
 	stream->stream.read = file_stream_read_gz;
 	stream->stream.write = file_stream_write_gz;
 	stream->stream.seek = file_stream_seek_gz;
@@ -210,6 +214,22 @@ int file_stream_init(struct file_stream *stream, const char *filename, const cha
 	return file_stream_init_fp(stream, f);
 }
 
+int file_stream_init_fd(struct file_stream *stream, int fd, const char *mode, int stream_flags) {
+	stream_init(&stream->stream, stream_flags);
+#ifdef HAVE_GZIP
+	if(stream_flags & STREAM_TRANSPARENT_GZIP) {
+		gzFile f = gzdopen(fd, mode);
+		stream->stream._errno = errno;
+		if(!f) return errno ? errno : ENOMEM;
+		return file_stream_init_gz(stream, f);
+	}
+#endif
+	FILE *f = fdopen(fd, mode);
+	stream->stream._errno = errno;
+	if(!f) return errno;
+	return file_stream_init_fp(stream, f);
+}
+
 struct stream *file_stream_new(const char *filename, const char *mode, int stream_flags) {
 	struct file_stream *s = malloc(sizeof(struct file_stream));
 	if(!s) return 0;
@@ -30,6 +30,15 @@ struct file_stream {
  */
 int file_stream_init(struct file_stream *stream, const char *filename, const char *mode, int stream_flags);
 
+/**
+ * @brief Initialize a file stream from an open file descriptor.
+ * @param stream Pointer to the file stream object.
+ * @param fd File descriptor, owned by the stream on success.
+ * @param mode Mode of the file descriptor.
+ * @return Status code.
+ */
+int file_stream_init_fd(struct file_stream *stream, int fd, const char *mode, int stream_flags);
+
 #ifdef WIN32
 /**
  * @brief Initialize a file stream with wide-character filename.
@@ -0,0 +1,62 @@
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "inode_set.h"
+
+#define INODE_SET_MIN_SLOTS 1024
+
+static size_t inode_set_hash(uint64_t dev, uint64_t ino) {
+	uint64_t h = ino * 0x9e3779b97f4a7c15ull ^ dev;
+	h ^= h >> 32;
+	h *= 0xd6e8feb86659fd93ull;
+	h ^= h >> 32;
+	return (size_t)h;
+}
+
+static int inode_set_grow(struct inode_set *set) {
+	size_t num_slots = set->slots ? (set->mask + 1) * 2 : INODE_SET_MIN_SLOTS;
+	struct inode_set_slot *slots = calloc(num_slots, sizeof(*slots));
+	if(!slots) return ENOMEM;
+	size_t mask = num_slots - 1;
+	if(set->slots) {
+		for(size_t i = 0; i <= set->mask; i++) {
+			struct inode_set_slot *s = &set->slots[i];
+			if(!s->dev && !s->ino) continue;
+			size_t j = inode_set_hash(s->dev, s->ino) & mask;
+			while(slots[j].dev || slots[j].ino)
+				j = (j + 1) & mask;
+			slots[j] = *s;
+		}
+		free(set->slots);
+	}
+	set->slots = slots;
+	set->mask = mask;
+	return 0;
+}
+
+int inode_set_insert(struct inode_set *set, uint64_t dev, uint64_t ino) {
+	if(!dev && !ino) {
+		int had = set->has_zero;
+		set->has_zero = 1;
+		return had;
+	}
+	// keep the load factor below 3/4
+	if(!set->slots || (set->count + 1) * 4 > (set->mask + 1) * 3) {
+		if(inode_set_grow(set)) return -ENOMEM;
+	}
+	size_t i = inode_set_hash(dev, ino) & set->mask;
+	while(set->slots[i].dev || set->slots[i].ino) {
+		if(set->slots[i].dev == dev && set->slots[i].ino == ino) return 1;
+		i = (i + 1) & set->mask;
+	}
+	set->slots[i].dev = dev;
+	set->slots[i].ino = ino;
+	set->count++;
+	return 0;
+}
+
+void inode_set_free(struct inode_set *set) {
+	free(set->slots);
+	memset(set, 0, sizeof(*set));
+}
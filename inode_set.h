@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * @struct inode_set
+ * @brief Open addressing hash set of (device, inode) pairs.
+ */
+struct inode_set {
+	struct inode_set_slot {
+		uint64_t dev;
+		uint64_t ino;
+	} *slots;        /**< Empty slots are all zero */
+	size_t count, mask;
+	int has_zero;    /**< Whether the (0, 0) pair was inserted */
+};
+
+/**
+ * @brief Insert a pair unless it is present.
+ * @param set Pointer to the set, zero initialized before the first insert.
+ * @param dev Device number.
+ * @param ino Inode number.
+ * @return 1 if the pair was already present, 0 if it was inserted, ENOMEM as a negative value.
+ */
+int inode_set_insert(struct inode_set *set, uint64_t dev, uint64_t ino);
+
+/**
+ * @brief Release the set.
+ * @param set Pointer to the set.
+ */
+void inode_set_free(struct inode_set *set);
@@ -0,0 +1,199 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lazy_stream.h"
+#include "throttle.h"
+#include "util.h"
+
+static struct stream *lazy_stream_target(struct stream *stream) {
+	struct lazy_stream *lazy_stream = (struct lazy_stream *)stream;
+	if(!lazy_stream->target && !lazy_stream->open_errno) {
+		uint64_t start = lazy_stream->timed ? monotonic_ns() : 0;
+		int r = lazy_stream->open(lazy_stream);
+		if(lazy_stream->timed) lazy_stream->open_ns += monotonic_ns() - start;
+		if(r) {
+			lazy_stream->open_errno = r;
+		} else {
+			stream->flags |= lazy_stream->target->flags;
+		}
+	}
+	if(!lazy_stream->target) stream->_errno = lazy_stream->open_errno;
+	return lazy_stream->target;
+}
+
+static ssize_t lazy_stream_read(struct stream *stream, void *ptr, size_t size) {
+	struct lazy_stream *lazy_stream = (struct lazy_stream *)stream;
+	struct stream *target = lazy_stream_target(stream);
+	if(!target) return -1;
+	uint64_t start = lazy_stream->timed ? monotonic_ns() : 0;
+	ssize_t r = stream_read(target, ptr, size);
+	if(lazy_stream->timed) {
+		lazy_stream->read_ns += monotonic_ns() - start;
+		if(r > 0) lazy_stream->bytes_read += r;
+	}
+	if(lazy_stream->throttle && r > 0) throttle_bytes(lazy_stream->throttle, r);
+	stream->_errno = target->_errno;
+	return r;
+}
+
+static ssize_t lazy_stream_write(struct stream *stream, const void *ptr, size_t size) {
+	struct stream *target = lazy_stream_target(stream);
+	if(!target) return -1;
+	ssize_t r = stream_write(target, ptr, size);
+	stream->_errno = target->_errno;
+	return r;
+}
+
+static size_t lazy_stream_seek(struct stream *stream, long offset, int whence) {
+	struct stream *target = lazy_stream_target(stream);
+	if(!target) return -1;
+	size_t r = stream_seek(target, offset, whence);
+	stream->_errno = target->_errno;
+	return r;
+}
+
+static int lazy_stream_eof(struct stream *stream) {
+	struct stream *target = lazy_stream_target(stream);
+	if(!target) return 1;
+	return stream_eof(target);
+}
+
+static long lazy_stream_tell(struct stream *stream) {
+	struct stream *target = lazy_stream_target(stream);
+	if(!target) return -1;
+	return stream_tell(target);
+}
+
+static int lazy_stream_vprintf(struct stream *stream, const char *fmt, va_list ap) {
+	struct stream *target = lazy_stream_target(stream);
+	if(!target) return -1;
+	return target->vprintf(target, fmt, ap);
+}
+
+static void *lazy_stream_get_memory_access(struct stream *stream, size_t *length) {
+	struct lazy_stream *lazy_stream = (struct lazy_stream *)stream;
+	struct stream *target = lazy_stream_target(stream);
+	if(!target) return 0;
+	int mapped = stream->mem != 0;
+	stream->mem = stream_get_memory_access(target, length);
+	stream->mem_size = target->mem_size;
+	stream->_errno = target->_errno;
+	// a mapping is charged in full once, it is read as it is touched
+	if(lazy_stream->throttle && stream->mem && !mapped) throttle_bytes(lazy_stream->throttle, stream->mem_size);
+	return stream->mem;
+}
+
+static int lazy_stream_revoke_memory_access(struct stream *stream) {
+	struct lazy_stream *lazy_stream = (struct lazy_stream *)stream;
+	if(!lazy_stream->target) return 0;
+	stream->mem = 0;
+	return stream_revoke_memory_access(lazy_stream->target);
+}
+
+static int lazy_stream_close(struct stream *stream) {
+	struct lazy_stream *lazy_stream = (struct lazy_stream *)stream;
+	if(lazy_stream->fd >= 0) {
+		close(lazy_stream->fd);
+		lazy_stream->fd = -1;
+	}
+	if(!lazy_stream->target) return 0;
+	int r = stream_close(lazy_stream->target);
+	stream->_errno = lazy_stream->target->_errno;
+	lazy_stream->target = 0;
+	return r;
+}
+
+static void lazy_stream_init(struct lazy_stream *stream, int stream_flags) {
+	stream_init(&stream->stream, stream_flags);
+	stream->target = 0;
+	stream->open_errno = 0;
+	stream->timed = 0;
+	stream->open_ns = stream->read_ns = stream->bytes_read = 0;
+	stream->throttle = 0;
+	stream->fd = -1;
+	stream->stream_flags = stream_flags;
+	stream->stream.read = lazy_stream_read;
+	stream->stream.write = lazy_stream_write;
+	stream->stream.seek = lazy_stream_seek;
+	stream->stream.eof = lazy_stream_eof;
+	stream->stream.tell = lazy_stream_tell;
+	stream->stream.vprintf = lazy_stream_vprintf;
+	stream->stream.get_memory_access = lazy_stream_get_memory_access;
+	stream->stream.revoke_memory_access = lazy_stream_revoke_memory_access;
+	stream->stream.close = lazy_stream_close;
+}
+
+static int lazy_stream_open_file(struct lazy_stream *stream) {
+	if(stream->throttle) throttle_open(stream->throttle);
+	int r = file_stream_init(&stream->backing.file, stream->filename, stream->mode, stream->stream_flags);
+	if(r) return r;
+	stream->target = &stream->backing.file.stream;
+	return 0;
+}
+
+int lazy_stream_init_file(struct lazy_stream *stream, const char *filename, const char *mode, int stream_flags) {
+	lazy_stream_init(stream, stream_flags);
+	stream->open = lazy_stream_open_file;
+	stream->filename = filename;
+	stream->mode = mode;
+	return 0;
+}
+
+static int lazy_stream_open_fd(struct lazy_stream *stream) {
+	int r = file_stream_init_fd(&stream->backing.file, stream->fd, stream->mode, stream->stream_flags);
+	if(r) return r;
+	stream->fd = -1;
+	stream->target = &stream->backing.file.stream;
+	return 0;
+}
+
+int lazy_stream_init_fd(struct lazy_stream *stream, int fd, const char *mode, int stream_flags) {
+	lazy_stream_init(stream, stream_flags);
+	stream->open = lazy_stream_open_fd;
+	stream->fd = fd;
+	stream->mode = mode;
+	return 0;
+}
+
+#ifdef HAVE_LIBZIP
+static int lazy_stream_open_zip_index(struct lazy_stream *stream) {
+	if(stream->throttle) throttle_open(stream->throttle);
+	int r = zip_file_stream_init_index(&stream->backing.zip_file, stream->zip, stream->index, stream->stream_flags);
+	if(r) return stream->backing.zip_file.stream._errno ? stream->backing.zip_file.stream._errno : EIO;
+	stream->target = &stream->backing.zip_file.stream;
+	return 0;
+}
+
+int lazy_stream_init_zip_index(struct lazy_stream *stream, zip_t *zip, int index, int stream_flags) {
+	lazy_stream_init(stream, stream_flags);
+	stream->open = lazy_stream_open_zip_index;
+	stream->zip = zip;
+	stream->index = index;
+	return 0;
+}
+
+static int lazy_stream_open_zip_path(struct lazy_stream *stream) {
+	if(!*stream->shared_zip) {
+		if(stream->throttle) throttle_open(stream->throttle);
+		int err;
+		*stream->shared_zip = zip_open(stream->filename, ZIP_RDONLY, &err);
+		if(!*stream->shared_zip) return EIO;
+	}
+	stream->zip = *stream->shared_zip;
+	return lazy_stream_open_zip_index(stream);
+}
+
+int lazy_stream_init_zip_path(struct lazy_stream *stream, zip_t **zip, const char *filename, int index, int stream_flags) {
+	lazy_stream_init(stream, stream_flags);
+	stream->open = lazy_stream_open_zip_path;
+	stream->shared_zip = zip;
+	stream->filename = filename;
+	stream->index = index;
+	return 0;
+}
+#endif
+
+int lazy_stream_is_open(struct lazy_stream *stream) {
+	return stream->target != 0;
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "stream_base.h"
+#include "file_stream.h"
+#include "zip_file_stream.h"
+
+struct throttle;
+
+/**
+ * @struct lazy_stream
+ * @brief Stream that opens its backing file stream or zip entry stream on the first access.
+ *
+ * A lazy stream that is closed without having been read, written, seeked
+ * or mapped never opens its backing stream. If opening fails, the access
+ * that triggered it fails with the open error in _errno, and so does every
+ * later access.
+ */
+struct lazy_stream {
+	struct stream stream; /**< Base stream structure */
+	int (*open)(struct lazy_stream *stream);
+	struct stream *target; /**< Backing stream, NULL until opened */
+	int open_errno;
+	int stream_flags;
+
+	int timed;            /**< Measure the fields below, set after initialization */
+	uint64_t open_ns, read_ns, bytes_read;
+	struct throttle *throttle; /**< Charged for opens and bytes read or mapped, NULL for none, set after initialization */
+
+	const char *filename; /**< Not copied, must stay valid until the stream is closed */
+	const char *mode;
+	int fd;               /**< Already open file, -1 if none */
+#ifdef HAVE_LIBZIP
+	zip_t *zip;
+	zip_t **shared_zip;   /**< Archive opened on demand, see lazy_stream_init_zip_path() */
+	int index;
+#endif
+
+	union {
+		struct file_stream file;
+#ifdef HAVE_LIBZIP
+		struct zip_file_stream zip_file;
+#endif
+	} backing;
+};
+
+/**
+ * @brief Initialize a lazy file stream.
+ * @param stream Pointer to the lazy stream object.
+ * @param filename Name of the file to open, not copied.
+ * @param mode Mode in which to open the file, not copied.
+ * @return Status code.
+ */
+int lazy_stream_init_file(struct lazy_stream *stream, const char *filename, const char *mode, int stream_flags);
+
+/**
+ * @brief Initialize a lazy file stream over an already open file descriptor.
+ * @param stream Pointer to the lazy stream object.
+ * @param fd File descriptor, owned by the stream and closed with it.
+ * @param mode Mode of the file descriptor, not copied.
+ * @return Status code.
+ */
+int lazy_stream_init_fd(struct lazy_stream *stream, int fd, const char *mode, int stream_flags);
+
+#ifdef HAVE_LIBZIP
+/**
+ * @brief Initialize a lazy zip file stream by index.
+ * @param stream Pointer to the lazy stream object.
+ * @param zip Pointer to the zip archive.
+ * @param index Index of the file within the zip archive.
+ * @return Status code.
+ */
+int lazy_stream_init_zip_index(struct lazy_stream *stream, zip_t *zip, int index, int stream_flags);
+
+/**
+ * @brief Initialize a lazy zip file stream by index, opening the archive on the first access.
+ *
+ * Streams over entries of the same archive share *zip, so the archive is
+ * opened at most once. The caller closes *zip after closing the streams.
+ * @param stream Pointer to the lazy stream object.
+ * @param zip Archive shared with other streams, NULL until one of them is accessed.
+ * @param filename Path of the zip archive, not copied.
+ * @param index Index of the file within the zip archive.
+ * @return Status code.
+ */
+int lazy_stream_init_zip_path(struct lazy_stream *stream, zip_t **zip, const char *filename, int index, int stream_flags);
+#endif
+
+/**
+ * @brief Check whether the backing stream has been opened.
+ * @param stream Pointer to the lazy stream object.
+ * @return Non-zero if opened.
+ */
+int lazy_stream_is_open(struct lazy_stream *stream);
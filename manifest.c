@@ -0,0 +1,282 @@
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "manifest.h"
+#include "util.h"
+
+#define MANIFEST_MAGIC "SLMANIF"
+#define MANIFEST_VERSION 1
+
+struct manifest_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+	uint64_t num_records;
+	uint64_t heap_size;
+};
+
+int manifest_open(struct manifest *manifest, const char *filename, int flags) {
+	memset(manifest, 0, sizeof(*manifest));
+	manifest->flags = flags;
+	manifest->current = -1;
+	manifest->filename = strdup(filename);
+	if(!manifest->filename) return ENOMEM;
+
+	int r = file_stream_init(&manifest->file, filename, "rb", 0);
+	if(r == ENOENT) return 0;
+	if(r) goto fail;
+	manifest->file_open = 1;
+
+	size_t len = 0;
+	const uint8_t *data = stream_get_memory_access(&manifest->file.stream, &len);
+	if(!data) {
+		// an empty file cannot be mapped, treat it as an empty manifest
+		r = len ? manifest->file.stream._errno : 0;
+		stream_close(&manifest->file.stream);
+		manifest->file_open = 0;
+		if(r) goto fail;
+		return 0;
+	}
+
+	const struct manifest_header *h = (const struct manifest_header *)data;
+	r = EINVAL;
+	if(len < sizeof(*h) || memcmp(h->magic, MANIFEST_MAGIC, sizeof(h->magic)) || h->version != MANIFEST_VERSION)
+		goto fail_mapped;
+	if(h->num_records > (len - sizeof(*h)) / sizeof(struct manifest_record))
+		goto fail_mapped;
+	uint64_t heap_start = sizeof(*h) + h->num_records * sizeof(struct manifest_record);
+	if(h->heap_size != len - heap_start || (h->heap_size && data[len - 1]))
+		goto fail_mapped;
+	manifest->old = (const struct manifest_record *)(data + sizeof(*h));
+	manifest->num_old = h->num_records;
+	manifest->old_heap = (const char *)data + heap_start;
+	manifest->old_heap_size = h->heap_size;
+	for(uint64_t i = 0; i < manifest->num_old; i++) {
+		const struct manifest_record *rec = &manifest->old[i];
+		if(rec->path >= h->heap_size || rec->result > h->heap_size || rec->result_len > h->heap_size - rec->result)
+			goto fail_mapped;
+	}
+
+	manifest->seen = calloc(manifest->num_old ? manifest->num_old : 1, 1);
+	if(!manifest->seen) {
+		r = ENOMEM;
+		goto fail_mapped;
+	}
+	return 0;
+
+fail_mapped:
+	stream_revoke_memory_access(&manifest->file.stream);
+	stream_close(&manifest->file.stream);
+	manifest->file_open = 0;
+fail:
+	free(manifest->filename);
+	manifest->filename = 0;
+	return r;
+}
+
+static int64_t manifest_find_old(struct manifest *manifest, const char *path) {
+	uint64_t lo = 0, hi = manifest->num_old;
+	while(lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		int c = strcmp(path, manifest->old_heap + manifest->old[mid].path);
+		if(!c) return mid;
+		if(c < 0) hi = mid;
+		else lo = mid + 1;
+	}
+	return -1;
+}
+
+static int manifest_heap_reserve(struct manifest *manifest, size_t len) {
+	if(manifest->heap_len + len <= manifest->heap_alloc) return 0;
+	size_t alloc = manifest->heap_alloc ? manifest->heap_alloc : 4096;
+	while(alloc < manifest->heap_len + len) alloc *= 2;
+	char *heap = realloc(manifest->heap, alloc);
+	if(!heap) return ENOMEM;
+	manifest->heap = heap;
+	manifest->heap_alloc = alloc;
+	return 0;
+}
+
+static int manifest_heap_append(struct manifest *manifest, const void *data, size_t len, uint64_t *offset) {
+	if(manifest_heap_reserve(manifest, len)) return ENOMEM;
+	if(offset) *offset = manifest->heap_len;
+	memcpy(manifest->heap + manifest->heap_len, data, len);
+	manifest->heap_len += len;
+	return 0;
+}
+
+static int manifest_hash_file(const char *path, uint64_t *hash) {
+	struct file_stream s;
+	int r = file_stream_init(&s, path, "rb", 0);
+	if(r) return r;
+	uint64_t h = FNV1A64_INIT;
+	uint8_t buf[65536];
+	ssize_t n;
+	while((n = stream_read(&s.stream, buf, sizeof(buf))) > 0)
+		h = fnv1a64(h, buf, n);
+	stream_close(&s.stream);
+	*hash = h ? h : 1; // 0 means not hashed
+	return 0;
+}
+
+int manifest_update(struct manifest *manifest, const char *path, const struct stat *st, const void **result, size_t *result_len) {
+	manifest->current = -1;
+
+	const struct manifest_record *old = 0;
+	int64_t idx = manifest_find_old(manifest, path);
+	if(idx >= 0) {
+		old = &manifest->old[idx];
+		manifest->seen[idx] = 1;
+	}
+
+	int status = old ? MANIFEST_CHANGED : MANIFEST_NEW;
+	uint64_t hash = 0;
+	if(old && old->size == (uint64_t)st->st_size && old->mtime_ns == STAT_MTIME_NS(st) && old->ino == (uint64_t)st->st_ino) {
+		status = MANIFEST_UNCHANGED;
+		hash = old->hash;
+	} else if(manifest->flags & MANIFEST_HASH) {
+		if(manifest_hash_file(path, &hash)) hash = 0;
+		if(old && hash && old->hash == hash && old->size == (uint64_t)st->st_size)
+			status = MANIFEST_UNCHANGED;
+	}
+
+	if(manifest->num_records >= manifest->records_alloc) {
+		size_t alloc = manifest->records_alloc ? manifest->records_alloc * 2 : 256;
+		struct manifest_record *records = realloc(manifest->records, alloc * sizeof(*records));
+		if(!records) return -ENOMEM;
+		manifest->records = records;
+		uint8_t *committed = realloc(manifest->committed, alloc);
+		if(!committed) return -ENOMEM;
+		manifest->committed = committed;
+		manifest->records_alloc = alloc;
+	}
+	struct manifest_record rec;
+	memset(&rec, 0, sizeof(rec));
+	rec.size = st->st_size;
+	rec.mtime_ns = STAT_MTIME_NS(st);
+	rec.ino = st->st_ino;
+	rec.hash = hash;
+	if(manifest_heap_append(manifest, path, strlen(path) + 1, &rec.path)) return -ENOMEM;
+	if(status == MANIFEST_UNCHANGED) {
+		if(manifest_heap_append(manifest, manifest->old_heap + old->result, old->result_len, &rec.result)) return -ENOMEM;
+		rec.result_len = old->result_len;
+		if(result) *result = manifest->old_heap + old->result;
+		if(result_len) *result_len = old->result_len;
+	} else {
+		rec.result = manifest->heap_len;
+		manifest->current = manifest->num_records;
+		if(result) *result = 0;
+		if(result_len) *result_len = 0;
+	}
+	manifest->committed[manifest->num_records] = status == MANIFEST_UNCHANGED;
+	manifest->records[manifest->num_records++] = rec;
+	return status;
+}
+
+void manifest_commit(struct manifest *manifest, int record) {
+	if(record >= 0 && (size_t)record < manifest->num_records)
+		manifest->committed[record] = 1;
+}
+
+int manifest_write_result(struct manifest *manifest, const void *data, size_t len) {
+	if(manifest->current < 0) return EINVAL;
+	struct manifest_record *rec = &manifest->records[manifest->current];
+	if(rec->result + rec->result_len != manifest->heap_len) {
+		// something was appended after this result, move it to the end of the heap
+		if(manifest_heap_reserve(manifest, rec->result_len + len)) return ENOMEM;
+		memcpy(manifest->heap + manifest->heap_len, manifest->heap + rec->result, rec->result_len);
+		rec->result = manifest->heap_len;
+		manifest->heap_len += rec->result_len;
+	}
+	if(manifest_heap_append(manifest, data, len, 0)) return ENOMEM;
+	rec->result_len += len;
+	return 0;
+}
+
+int manifest_each_deleted(struct manifest *manifest, int (*cb)(const char *path, const void *result, size_t result_len, void *user_data), void *user_data) {
+	for(uint64_t i = 0; i < manifest->num_old; i++) {
+		if(manifest->seen[i]) continue;
+		const struct manifest_record *rec = &manifest->old[i];
+		int r = cb(manifest->old_heap + rec->path, manifest->old_heap + rec->result, rec->result_len, user_data);
+		if(r) return r;
+	}
+	return 0;
+}
+
+struct manifest_sort {
+	const char *path;
+	size_t index;
+};
+
+static int manifest_sort_cmp(const void *a, const void *b) {
+	const struct manifest_sort *sa = a, *sb = b;
+	return strcmp(sa->path, sb->path);
+}
+
+int manifest_save(struct manifest *manifest) {
+	manifest->current = -1;
+	struct manifest_sort *order = malloc((manifest->num_records ? manifest->num_records : 1) * sizeof(*order));
+	if(!order) return ENOMEM;
+	for(size_t i = 0; i < manifest->num_records; i++) {
+		order[i].path = manifest->heap + manifest->records[i].path;
+		order[i].index = i;
+	}
+	qsort(order, manifest->num_records, sizeof(*order), manifest_sort_cmp);
+
+	size_t tmp_len = strlen(manifest->filename) + 5;
+	char *tmp = malloc(tmp_len);
+	if(!tmp) {
+		free(order);
+		return ENOMEM;
+	}
+	snprintf(tmp, tmp_len, "%s.tmp", manifest->filename);
+
+	struct manifest_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, MANIFEST_MAGIC, sizeof(h.magic));
+	h.version = MANIFEST_VERSION;
+	h.flags = manifest->flags;
+	h.num_records = manifest->num_records;
+	h.heap_size = manifest->heap_len;
+
+	struct file_stream s;
+	int r = file_stream_init(&s, tmp, "wb", 0);
+	if(r) goto out;
+	if(stream_write(&s.stream, &h, sizeof(h)) != sizeof(h))
+		r = EIO;
+	for(size_t i = 0; !r && i < manifest->num_records; i++) {
+		struct manifest_record rec = manifest->records[order[i].index];
+		if(!manifest->committed[order[i].index]) {
+			// a file whose callback failed or never ran matches no file and has no result
+			rec.size = rec.ino = rec.hash = rec.result = rec.result_len = 0;
+			rec.mtime_ns = 0;
+		}
+		if(stream_write(&s.stream, &rec, sizeof(rec)) != sizeof(rec))
+			r = EIO;
+	}
+	if(!r && stream_write(&s.stream, manifest->heap, manifest->heap_len) != (ssize_t)manifest->heap_len)
+		r = EIO;
+	if(stream_close(&s.stream) && !r) r = EIO;
+	if(!r && rename(tmp, manifest->filename)) r = errno;
+	if(r) remove(tmp);
+out:
+	free(tmp);
+	free(order);
+	return r;
+}
+
+void manifest_close(struct manifest *manifest) {
+	if(manifest->file_open) {
+		stream_revoke_memory_access(&manifest->file.stream);
+		stream_close(&manifest->file.stream);
+	}
+	free(manifest->seen);
+	free(manifest->records);
+	free(manifest->committed);
+	free(manifest->heap);
+	free(manifest->filename);
+	memset(manifest, 0, sizeof(*manifest));
+	manifest->current = -1;
+}
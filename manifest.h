@@ -0,0 +1,125 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+#include "stream_base.h"
+#include "file_stream.h"
+
+// manifest open flags
+#define MANIFEST_HASH 0x01 /**< Hash file contents so that touched but identical files count as unchanged */
+
+// manifest_update() results
+#define MANIFEST_NEW       0
+#define MANIFEST_CHANGED   1
+#define MANIFEST_UNCHANGED 2
+
+/**
+ * @struct manifest_record
+ * @brief On-disk manifest record. Records are sorted by path so the file can be searched in place.
+ */
+struct manifest_record {
+	uint64_t path;       /**< Heap offset of the NUL terminated path */
+	uint64_t result;     /**< Heap offset of the caller-provided result */
+	uint64_t result_len; /**< Length of the result */
+	uint64_t size;
+	int64_t mtime_ns;
+	uint64_t ino;
+	uint64_t hash;       /**< Content hash, 0 if not hashed */
+};
+
+/**
+ * @struct manifest
+ * @brief Persistent record of the files seen by a previous each_file run.
+ *
+ * The file written by manifest_save() is a header, an array of
+ * manifest_record sorted by path and a heap holding paths and results, all
+ * in host byte order. The previous manifest is memory mapped and looked up
+ * with a binary search, the current run is collected in memory.
+ */
+struct manifest {
+	char *filename;
+	int flags;
+
+	// previous run
+	struct file_stream file;
+	int file_open;
+	const struct manifest_record *old;
+	uint64_t num_old;
+	const char *old_heap;
+	uint64_t old_heap_size;
+	uint8_t *seen;
+
+	// current run
+	struct manifest_record *records;
+	uint8_t *committed;  /**< Per record, see manifest_commit() */
+	size_t num_records, records_alloc;
+	char *heap;
+	size_t heap_len, heap_alloc;
+	int current; /**< Record of the file being processed, -1 if none */
+};
+
+/**
+ * @brief Open a manifest, loading the previous run from filename if it exists.
+ * @param manifest Pointer to the manifest object.
+ * @param filename Manifest file name.
+ * @param flags MANIFEST_* flags.
+ * @return Status code.
+ */
+int manifest_open(struct manifest *manifest, const char *filename, int flags);
+
+/**
+ * @brief Record a file in the current run and compare it against the previous run.
+ *
+ * The record of a new or changed file is staged in manifest->current and
+ * only kept once manifest_commit() is called for it.
+ * @param manifest Pointer to the manifest object.
+ * @param path Path of the file.
+ * @param st Result of stat() on the file.
+ * @param result Set to the previous result of an unchanged file, may be NULL.
+ * @param result_len Set to the length of the previous result, may be NULL.
+ * @return MANIFEST_NEW, MANIFEST_CHANGED, MANIFEST_UNCHANGED or a negative value on error.
+ */
+int manifest_update(struct manifest *manifest, const char *path, const struct stat *st, const void **result, size_t *result_len);
+
+/**
+ * @brief Append to the result stored for the file being processed. Meant to be called from file callbacks.
+ * @param manifest Pointer to the manifest object.
+ * @param data Result data.
+ * @param len Length of the result data.
+ * @return Status code.
+ */
+int manifest_write_result(struct manifest *manifest, const void *data, size_t len);
+
+/**
+ * @brief Keep the record of a new or changed file, once its callback succeeded.
+ *
+ * Records that are not committed are saved without their size, time, inode,
+ * hash and result, so the next run sees the file as changed again.
+ * @param manifest Pointer to the manifest object.
+ * @param record Value of manifest->current after manifest_update().
+ */
+void manifest_commit(struct manifest *manifest, int record);
+
+/**
+ * @brief Call cb for every file of the previous run that was not seen in the current run.
+ * @param manifest Pointer to the manifest object.
+ * @param cb Callback receiving the path and the last stored result.
+ * @param user_data Passed to cb.
+ * @return The first non-zero value returned by cb, or 0.
+ */
+int manifest_each_deleted(struct manifest *manifest, int (*cb)(const char *path, const void *result, size_t result_len, void *user_data), void *user_data);
+
+/**
+ * @brief Write the current run to the manifest file, replacing it atomically.
+ * @param manifest Pointer to the manifest object.
+ * @return Status code.
+ */
+int manifest_save(struct manifest *manifest);
+
+/**
+ * @brief Release the manifest without saving.
+ * @param manifest Pointer to the manifest object.
+ */
+void manifest_close(struct manifest *manifest);
@@ -67,12 +67,18 @@ static long mem_stream_tell(struct stream *stream) {
 
 static int mem_stream_vprintf(struct stream *stream, const char *fmt, va_list ap) {
 	struct mem_stream *mem_stream = (struct mem_stream *)stream;
-	long size = vsnprintf(0, 0, fmt, ap);
-	if(mem_stream->position + size > mem_stream->data_len) {
-		int err = mem_stream_reserve(mem_stream, mem_stream->position + size - mem_stream->data_len);
+	// ap is used twice
+	va_list ap2;
+	va_copy(ap2, ap);
+	long size = vsnprintf(0, 0, fmt, ap2);
+	va_end(ap2);
+	// room for the terminator that vsprintf() writes
+	if(mem_stream->position + size + 1 > mem_stream->data_len) {
+		int err = mem_stream_reserve(mem_stream, mem_stream->position + size + 1 - mem_stream->data_len);
 		stream->_errno = err;
 		if(err) return 0;
-		mem_stream->data_len = mem_stream->position + size;
+		if(mem_stream->position + size > mem_stream->data_len)
+			mem_stream->data_len = mem_stream->position + size;
 	}
 	vsprintf(mem_stream->data + mem_stream->position, fmt, ap);
 	mem_stream->position += size;
@@ -195,6 +201,7 @@ int mem_stream_init(struct mem_stream *stream, void *existing_data, size_t exist
 		stream->z_stream.next_in = (z_const Bytef *)stream->data;
 		if(inflateInit2(&stream->z_stream, 0x20 | 15) != Z_OK)
 			return 1;
+		stream->stream.flags |= STREAM_IS_GZIPPED;
 		stream->stream.write = mem_stream_write_gz;
 		stream->stream.read = mem_stream_read_gz;
 		stream->stream.seek = mem_stream_seek_gz;
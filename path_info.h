@@ -0,0 +1,39 @@
+#pragma once
+
+#include <string.h>
+#include <stdlib.h>
+#include <libgen.h>
+
+// fill the path_info p from a path, in a scope that ends with the matching FREE_ macro
+
+#define FILL_PATH_INFO(path) \
+	p.file_name = (char *)path; \
+	char *file_dirname_str = strdup(path); \
+	p.file_dirname = dirname(file_dirname_str); \
+	char *file_basename_str = strdup(path); \
+	p.file_basename = basename(file_basename_str); \
+	char *file_ext_str = strdup(p.file_basename); \
+	char *file_ext = strrchr(file_ext_str, '.'); \
+	if(file_ext) { \
+		*file_ext = 0; \
+		p.file_ext = file_ext[1] ? file_ext + 1 : 0; \
+	} \
+	p.file_base = file_ext_str;
+
+#define FREE_PATH_INFO() \
+	free(file_ext_str); \
+	free(file_basename_str); \
+	free(file_dirname_str);
+
+#define FILL_ZIP_PATH_INFO(path) \
+	p.zip_file_name = (char *)path; \
+	char *zip_dirname_str = strdup(path); \
+	p.zip_file_dirname = dirname(zip_dirname_str); \
+	char *zip_basename_str = strdup(path); \
+	p.zip_file_base = basename(zip_basename_str); \
+	char *zip_ext = strrchr(p.zip_file_base, '.'); \
+	if(zip_ext) *zip_ext = 0;
+
+#define FREE_ZIP_PATH_INFO() \
+	free(zip_basename_str); \
+	free(zip_dirname_str);
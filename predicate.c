@@ -0,0 +1,230 @@
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "predicate.h"
+
+static char *predicate_strndup(const char *str, size_t len) {
+	char *s = malloc(len + 1);
+	if(!s) return 0;
+	memcpy(s, str, len);
+	s[len] = 0;
+	return s;
+}
+
+static int predicate_compile_prefixes(const char *const *prefixes, char ***out, size_t *num) {
+	if(!prefixes) return 0;
+	size_t n = 0;
+	while(prefixes[n]) n++;
+	*out = calloc(n ? n : 1, sizeof(**out));
+	if(!*out) return ENOMEM;
+	for(; *num < n; (*num)++) {
+		const char *p = prefixes[*num];
+		size_t len = strlen(p);
+		while(len && p[len - 1] == '/') len--;
+		(*out)[*num] = predicate_strndup(p, len);
+		if(!(*out)[*num]) return ENOMEM;
+	}
+	return 0;
+}
+
+int predicate_compile(struct predicate *predicate, const struct predicate_spec *spec) {
+	memset(predicate, 0, sizeof(*predicate));
+	predicate->min_size = spec->min_size;
+	predicate->max_size = spec->max_size;
+	predicate->min_mtime_ns = spec->min_mtime_ns;
+	predicate->max_mtime_ns = spec->max_mtime_ns;
+	int r = 0;
+	if(spec->glob) {
+		predicate->has_glob = 1;
+		size_t n = 1;
+		for(const char *p = spec->glob; *p; p++)
+			if(*p == '/') n++;
+		predicate->segments = calloc(n, sizeof(*predicate->segments));
+		if(!predicate->segments) {
+			r = ENOMEM;
+			goto fail;
+		}
+		for(const char *p = spec->glob; ; ) {
+			const char *slash = strchr(p, '/');
+			size_t len = slash ? (size_t)(slash - p) : strlen(p);
+			predicate->segments[predicate->num_segments] = predicate_strndup(p, len);
+			if(!predicate->segments[predicate->num_segments]) {
+				r = ENOMEM;
+				goto fail;
+			}
+			predicate->num_segments++;
+			if(!slash) break;
+			p = slash + 1;
+		}
+	}
+	if(spec->regex) {
+#ifndef WIN32
+		if(regcomp(&predicate->regex, spec->regex, REG_EXTENDED | REG_NOSUB)) {
+			r = EINVAL;
+			goto fail;
+		}
+		predicate->has_regex = 1;
+#else
+		r = ENOTSUP;
+		goto fail;
+#endif
+	}
+	r = predicate_compile_prefixes(spec->include, &predicate->include, &predicate->num_include);
+	if(!r) r = predicate_compile_prefixes(spec->exclude, &predicate->exclude, &predicate->num_exclude);
+	if(!r) return 0;
+fail:
+	predicate_free(predicate);
+	return r;
+}
+
+// match one character against the pattern token at pat, returns the next token or NULL
+static const char *predicate_match_char(const char *pat, char c) {
+	if(*pat == '?') return pat + 1;
+	if(*pat == '[') {
+		const char *p = pat + 1;
+		int negate = *p == '!' || *p == '^';
+		if(negate) p++;
+		// a ] right after the [ is a member of the set
+		const char *first = p;
+		int found = 0;
+		while(*p && (*p != ']' || p == first)) {
+			if(p[1] == '-' && p[2] && p[2] != ']') {
+				if((unsigned char)c >= (unsigned char)p[0] && (unsigned char)c <= (unsigned char)p[2]) found = 1;
+				p += 3;
+			} else {
+				if(c == *p) found = 1;
+				p++;
+			}
+		}
+		// an unterminated [ is literal
+		if(!*p) return c == '[' ? pat + 1 : 0;
+		return found != negate ? p + 1 : 0;
+	}
+	if(*pat == '\\' && pat[1]) pat++;
+	return *pat == c ? pat + 1 : 0;
+}
+
+static int predicate_match_segment(const char *pat, const char *str, size_t len) {
+	const char *star = 0;
+	size_t star_i = 0, i = 0;
+	while(i < len) {
+		if(*pat == '*') {
+			star = ++pat;
+			star_i = i;
+			continue;
+		}
+		const char *next = *pat ? predicate_match_char(pat, str[i]) : 0;
+		if(next) {
+			pat = next;
+			i++;
+			continue;
+		}
+		if(!star) return 0;
+		pat = star;
+		i = ++star_i;
+	}
+	while(*pat == '*') pat++;
+	return !*pat;
+}
+
+static int predicate_is_globstar(const struct predicate *predicate, size_t seg) {
+	return !strcmp(predicate->segments[seg], "**");
+}
+
+// match the components of path against the segments from seg on
+static int predicate_match_glob(const struct predicate *predicate, size_t seg, const char *path) {
+	if(seg == predicate->num_segments) return !*path;
+	if(predicate_is_globstar(predicate, seg)) {
+		for(const char *p = path; ; ) {
+			if(predicate_match_glob(predicate, seg + 1, p)) return 1;
+			if(!*p) return 0;
+			const char *slash = strchr(p, '/');
+			p = slash ? slash + 1 : p + strlen(p);
+		}
+	}
+	if(!*path) return 0;
+	const char *slash = strchr(path, '/');
+	size_t len = slash ? (size_t)(slash - path) : strlen(path);
+	if(!predicate_match_segment(predicate->segments[seg], path, len)) return 0;
+	return predicate_match_glob(predicate, seg + 1, slash ? slash + 1 : path + len);
+}
+
+// whether the components of a directory can be the start of a match
+static int predicate_match_glob_prefix(const struct predicate *predicate, size_t seg, const char *path) {
+	if(!*path) return 1;
+	if(seg == predicate->num_segments) return 0;
+	if(predicate_is_globstar(predicate, seg)) return 1;
+	const char *slash = strchr(path, '/');
+	size_t len = slash ? (size_t)(slash - path) : strlen(path);
+	if(!predicate_match_segment(predicate->segments[seg], path, len)) return 0;
+	return predicate_match_glob_prefix(predicate, seg + 1, slash ? slash + 1 : path + len);
+}
+
+// whether path is prefix or below it
+static int predicate_under(const char *path, const char *prefix) {
+	size_t len = strlen(prefix);
+	if(!len) return 1;
+	return !strncmp(path, prefix, len) && (!path[len] || path[len] == '/');
+}
+
+static int predicate_excluded(const struct predicate *predicate, const char *path) {
+	for(size_t i = 0; i < predicate->num_exclude; i++)
+		if(predicate_under(path, predicate->exclude[i])) return 1;
+	return 0;
+}
+
+int predicate_match_dir(const struct predicate *predicate, const char *path) {
+	if(predicate_excluded(predicate, path)) return 0;
+	if(predicate->num_include) {
+		size_t i = 0;
+		// the directory is below an include or on the way to one
+		while(i < predicate->num_include && !predicate_under(path, predicate->include[i]) && !predicate_under(predicate->include[i], path))
+			i++;
+		if(i == predicate->num_include) return 0;
+	}
+	return !predicate->has_glob || predicate_match_glob_prefix(predicate, 0, path);
+}
+
+int predicate_match_path(const struct predicate *predicate, const char *path) {
+	if(predicate_excluded(predicate, path)) return 0;
+	if(predicate->num_include) {
+		size_t i = 0;
+		while(i < predicate->num_include && !predicate_under(path, predicate->include[i]))
+			i++;
+		if(i == predicate->num_include) return 0;
+	}
+	if(predicate->has_glob && !predicate_match_glob(predicate, 0, path)) return 0;
+#ifndef WIN32
+	if(predicate->has_regex && regexec(&predicate->regex, path, 0, 0, 0)) return 0;
+#endif
+	return 1;
+}
+
+int predicate_needs_stat(const struct predicate *predicate) {
+	return predicate->min_size || predicate->max_size || predicate->min_mtime_ns || predicate->max_mtime_ns;
+}
+
+int predicate_match_stat(const struct predicate *predicate, uint64_t size, int64_t mtime_ns) {
+	if(size < predicate->min_size) return 0;
+	if(predicate->max_size && size > predicate->max_size) return 0;
+	if(predicate->min_mtime_ns && mtime_ns < predicate->min_mtime_ns) return 0;
+	if(predicate->max_mtime_ns && mtime_ns > predicate->max_mtime_ns) return 0;
+	return 1;
+}
+
+void predicate_free(struct predicate *predicate) {
+	for(size_t i = 0; i < predicate->num_segments; i++)
+		free(predicate->segments[i]);
+	free(predicate->segments);
+#ifndef WIN32
+	if(predicate->has_regex) regfree(&predicate->regex);
+#endif
+	for(size_t i = 0; i < predicate->num_include; i++)
+		free(predicate->include[i]);
+	free(predicate->include);
+	for(size_t i = 0; i < predicate->num_exclude; i++)
+		free(predicate->exclude[i]);
+	free(predicate->exclude);
+	memset(predicate, 0, sizeof(*predicate));
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#ifndef WIN32
+#include <regex.h>
+#endif
+
+/**
+ * @struct predicate_spec
+ * @brief Conditions a file has to meet to be passed to a callback. Unset fields match everything.
+ *
+ * Paths are relative to the walk root, with '/' separators. Zip entries
+ * are matched as "archive path/entry name" and archives are pruned like
+ * directories.
+ */
+struct predicate_spec {
+	const char *glob;              /**< '*', '?' and [...] within a component, "**" for any number of components */
+	const char *regex;             /**< POSIX extended regular expression, not available on WIN32 */
+	uint64_t min_size, max_size;   /**< Inclusive, a max_size of 0 is unbounded */
+	int64_t min_mtime_ns, max_mtime_ns; /**< Inclusive, 0 is unbounded */
+	const char *const *include;    /**< Path prefixes a file has to be under, NULL terminated */
+	const char *const *exclude;    /**< Path prefixes no file may be under, NULL terminated */
+};
+
+/**
+ * @struct predicate
+ * @brief Compiled predicate_spec.
+ */
+struct predicate {
+	char **segments;               /**< Glob split at '/' */
+	size_t num_segments;
+	int has_glob;
+#ifndef WIN32
+	regex_t regex;
+	int has_regex;
+#endif
+	uint64_t min_size, max_size;
+	int64_t min_mtime_ns, max_mtime_ns;
+	char **include, **exclude;     /**< Without trailing '/' */
+	size_t num_include, num_exclude;
+};
+
+/**
+ * @brief Compile a predicate.
+ * @param predicate Pointer to the predicate object.
+ * @param spec Conditions, not referenced after the call.
+ * @return Status code, EINVAL for an invalid regular expression.
+ */
+int predicate_compile(struct predicate *predicate, const struct predicate_spec *spec);
+
+/**
+ * @brief Check whether a directory can contain matching files.
+ * @param predicate Pointer to the predicate object.
+ * @param path Directory path relative to the walk root.
+ * @return Non-zero if the directory has to be walked.
+ */
+int predicate_match_dir(const struct predicate *predicate, const char *path);
+
+/**
+ * @brief Check the path conditions of a file.
+ * @param predicate Pointer to the predicate object.
+ * @param path File path relative to the walk root.
+ * @return Non-zero if the path matches.
+ */
+int predicate_match_path(const struct predicate *predicate, const char *path);
+
+/**
+ * @brief Check whether predicate_match_stat() has conditions to check.
+ * @param predicate Pointer to the predicate object.
+ * @return Non-zero if size or time ranges are set.
+ */
+int predicate_needs_stat(const struct predicate *predicate);
+
+/**
+ * @brief Check the size and time conditions of a file.
+ * @param predicate Pointer to the predicate object.
+ * @param size File size.
+ * @param mtime_ns Modification time in nanoseconds.
+ * @return Non-zero if the metadata matches.
+ */
+int predicate_match_stat(const struct predicate *predicate, uint64_t size, int64_t mtime_ns);
+
+/**
+ * @brief Release a compiled predicate.
+ * @param predicate Pointer to the predicate object.
+ */
+void predicate_free(struct predicate *predicate);
@@ -0,0 +1,144 @@
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "prefetch.h"
+#include "throttle.h"
+#include "util.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+static void *prefetch_thread(void *arg) {
+	struct prefetch *prefetch = arg;
+	pthread_mutex_lock(&prefetch->lock);
+	for(;;) {
+		while(!prefetch->quit && (prefetch->next == prefetch->head + prefetch->count
+			|| (prefetch->inflight && prefetch->inflight + prefetch->per_file > prefetch->budget)))
+			pthread_cond_wait(&prefetch->cond, &prefetch->lock);
+		if(prefetch->quit) break;
+
+		struct prefetch_item *item = &prefetch->items[prefetch->next % prefetch->depth];
+		size_t charge = item->prefetch ? prefetch->per_file : 0;
+		prefetch->inflight += charge;
+		pthread_mutex_unlock(&prefetch->lock);
+
+		int fd = -1, err = 0;
+		size_t bytes = 0;
+		if(item->prefetch) {
+			if(prefetch->throttle) throttle_open(prefetch->throttle);
+			fd = open(item->path, O_RDONLY | O_BINARY);
+			if(fd < 0) {
+				err = errno;
+			} else {
+				struct stat st;
+				bytes = charge;
+				if(!fstat(fd, &st)) bytes = MIN((size_t)st.st_size, charge);
+#ifdef POSIX_FADV_WILLNEED
+				posix_fadvise(fd, 0, bytes, POSIX_FADV_WILLNEED);
+#endif
+			}
+		}
+
+		pthread_mutex_lock(&prefetch->lock);
+		prefetch->inflight -= charge - bytes;
+		item->fd = fd;
+		item->err = err;
+		item->bytes = bytes;
+		item->ready = 1;
+		prefetch->next++;
+		pthread_cond_broadcast(&prefetch->cond);
+	}
+	pthread_mutex_unlock(&prefetch->lock);
+	return 0;
+}
+
+int prefetch_init(struct prefetch *prefetch, size_t depth, size_t per_file, size_t budget, struct throttle *throttle) {
+	memset(prefetch, 0, sizeof(*prefetch));
+	prefetch->throttle = throttle;
+	prefetch->depth = depth ? depth : 1;
+	prefetch->per_file = per_file;
+	prefetch->budget = budget;
+	prefetch->items = calloc(prefetch->depth, sizeof(*prefetch->items));
+	if(!prefetch->items) return ENOMEM;
+	pthread_mutex_init(&prefetch->lock, 0);
+	pthread_cond_init(&prefetch->cond, 0);
+	int r = pthread_create(&prefetch->thread, 0, prefetch_thread, prefetch);
+	if(r) {
+		pthread_cond_destroy(&prefetch->cond);
+		pthread_mutex_destroy(&prefetch->lock);
+		free(prefetch->items);
+		return r;
+	}
+	return 0;
+}
+
+int prefetch_full(struct prefetch *prefetch) {
+	return prefetch->count == prefetch->depth;
+}
+
+int prefetch_empty(struct prefetch *prefetch) {
+	return prefetch->count == 0;
+}
+
+int prefetch_push(struct prefetch *prefetch, const char *path, void *data, int tag, double weight, int open_file) {
+	char *p = strdup(path);
+	if(!p) return ENOMEM;
+	pthread_mutex_lock(&prefetch->lock);
+	struct prefetch_item *item = &prefetch->items[(prefetch->head + prefetch->count) % prefetch->depth];
+	memset(item, 0, sizeof(*item));
+	item->path = p;
+	item->data = data;
+	item->tag = tag;
+	item->weight = weight;
+	item->prefetch = open_file;
+	item->fd = -1;
+	prefetch->count++;
+	pthread_cond_broadcast(&prefetch->cond);
+	pthread_mutex_unlock(&prefetch->lock);
+	return 0;
+}
+
+struct prefetch_item *prefetch_head(struct prefetch *prefetch) {
+	if(!prefetch->count) return 0;
+	struct prefetch_item *item = &prefetch->items[prefetch->head % prefetch->depth];
+	pthread_mutex_lock(&prefetch->lock);
+	while(!item->ready)
+		pthread_cond_wait(&prefetch->cond, &prefetch->lock);
+	pthread_mutex_unlock(&prefetch->lock);
+	return item;
+}
+
+void prefetch_pop(struct prefetch *prefetch) {
+	pthread_mutex_lock(&prefetch->lock);
+	struct prefetch_item *item = &prefetch->items[prefetch->head % prefetch->depth];
+	if(item->fd >= 0) close(item->fd);
+	free(item->path);
+	prefetch->inflight -= item->bytes;
+	prefetch->head++;
+	prefetch->count--;
+	pthread_cond_broadcast(&prefetch->cond);
+	pthread_mutex_unlock(&prefetch->lock);
+}
+
+void prefetch_destroy(struct prefetch *prefetch) {
+	pthread_mutex_lock(&prefetch->lock);
+	prefetch->quit = 1;
+	pthread_cond_broadcast(&prefetch->cond);
+	pthread_mutex_unlock(&prefetch->lock);
+	pthread_join(prefetch->thread, 0);
+	while(prefetch->count) {
+		struct prefetch_item *item = &prefetch->items[prefetch->head % prefetch->depth];
+		if(item->fd >= 0) close(item->fd);
+		free(item->path);
+		prefetch->head++;
+		prefetch->count--;
+	}
+	pthread_cond_destroy(&prefetch->cond);
+	pthread_mutex_destroy(&prefetch->lock);
+	free(prefetch->items);
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stddef.h>
+#include <pthread.h>
+
+struct throttle;
+
+/**
+ * @struct prefetch_item
+ * @brief A queued file. Once ready, fd is open with its read ahead issued, or err is set.
+ */
+struct prefetch_item {
+	char *path;
+	void *data;      /**< Caller data */
+	int tag;         /**< Caller data */
+	double weight;   /**< Caller data */
+	int prefetch;    /**< Open and read ahead, otherwise the item is only kept in order */
+	int fd;          /**< -1 if not opened, take ownership by setting it to -1 */
+	int err;
+	size_t bytes;    /**< Read ahead charged to the budget */
+	int ready;
+};
+
+/**
+ * @struct prefetch
+ * @brief Bounded FIFO of files opened and read ahead by a background thread.
+ *
+ * Items are consumed in the order they were pushed. The background thread
+ * works ahead of the consumer until the queue depth is reached or the read
+ * ahead of unconsumed items exceeds the byte budget.
+ */
+struct prefetch {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct prefetch_item *items;
+	size_t depth;
+	size_t head, count, next; /**< next is the number of items taken by the thread */
+	size_t per_file, budget, inflight;
+	struct throttle *throttle;
+	int quit;
+};
+
+/**
+ * @brief Start a prefetch queue.
+ * @param prefetch Pointer to the prefetch object.
+ * @param depth Maximum number of queued items.
+ * @param per_file Bytes read ahead at the start of each file.
+ * @param budget Maximum bytes read ahead for items that were not consumed yet.
+ * @param throttle Charged for the opens, may be NULL. Read ahead is charged when the data is read.
+ * @return Status code.
+ */
+int prefetch_init(struct prefetch *prefetch, size_t depth, size_t per_file, size_t budget, struct throttle *throttle);
+
+/**
+ * @brief Check whether the queue is full.
+ */
+int prefetch_full(struct prefetch *prefetch);
+
+/**
+ * @brief Check whether the queue is empty.
+ */
+int prefetch_empty(struct prefetch *prefetch);
+
+/**
+ * @brief Queue a file. The queue must not be full.
+ * @param prefetch Pointer to the prefetch object.
+ * @param path Path of the file, copied.
+ * @param data Caller data.
+ * @param tag Caller data.
+ * @param weight Caller data.
+ * @param open_file Open and read ahead the file.
+ * @return Status code.
+ */
+int prefetch_push(struct prefetch *prefetch, const char *path, void *data, int tag, double weight, int open_file);
+
+/**
+ * @brief Wait until the oldest item is ready.
+ * @param prefetch Pointer to the prefetch object.
+ * @return The oldest item, or NULL if the queue is empty.
+ */
+struct prefetch_item *prefetch_head(struct prefetch *prefetch);
+
+/**
+ * @brief Remove the oldest item, closing its fd unless ownership was taken.
+ * @param prefetch Pointer to the prefetch object.
+ */
+void prefetch_pop(struct prefetch *prefetch);
+
+/**
+ * @brief Stop the background thread and release the queue.
+ * @param prefetch Pointer to the prefetch object.
+ */
+void prefetch_destroy(struct prefetch *prefetch);
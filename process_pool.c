@@ -0,0 +1,430 @@
+#ifndef WIN32
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "process_pool.h"
+#include "util.h"
+
+#define PROCESS_POOL_BATCH 16
+
+// a task in a batch, followed by its NUL terminated path and entry name
+struct process_pool_record {
+	uint64_t data;
+	int64_t index;
+	uint64_t size, offset, len;
+	double weight;
+	uint32_t path_len, entry_len; // with the NUL, entry_len is 0 for a file
+};
+
+static int process_pool_read_full(int fd, void *buf, size_t len) {
+	uint8_t *p = buf;
+	while(len) {
+		ssize_t n = read(fd, p, len);
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0) return n ? errno : EPIPE;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+// without SIGPIPE, a dead peer is an EPIPE error
+static int process_pool_write_full(int fd, const void *buf, size_t len) {
+	const uint8_t *p = buf;
+	while(len) {
+		ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+		if(n < 0 && errno == EINTR) continue;
+		if(n < 0) return errno;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+// decode the task at offset, returns the offset of the next one
+static size_t process_pool_decode(uint8_t *batch, size_t offset, struct schedule_task *task) {
+	struct process_pool_record rec;
+	memcpy(&rec, batch + offset, sizeof(rec));
+	memset(task, 0, sizeof(*task));
+	task->path = (char *)batch + offset + sizeof(rec);
+	task->entry = rec.entry_len ? task->path + rec.path_len : 0;
+	task->data = (void *)(uintptr_t)rec.data;
+	task->index = rec.index;
+	task->size = rec.size;
+	task->offset = rec.offset;
+	task->len = rec.len;
+	task->weight = rec.weight;
+	return offset + sizeof(rec) + rec.path_len + rec.entry_len;
+}
+
+static void process_pool_child(struct process_pool *pool, int fd) {
+	void *worker = 0;
+	uint8_t *buf = 0;
+	size_t alloc = 0;
+	struct mem_stream out;
+	mem_stream_init(&out, 0, 0, 0);
+	for(;;) {
+		// the walking process closes the socket when it is done
+		uint32_t len;
+		if(process_pool_read_full(fd, &len, sizeof(len))) break;
+		if(len > alloc) {
+			uint8_t *b = realloc(buf, len);
+			if(!b) break;
+			buf = b;
+			alloc = len;
+		}
+		if(process_pool_read_full(fd, buf, len)) break;
+		int err = 0;
+		for(size_t offset = 0; !err && offset < len; ) {
+			struct schedule_task task;
+			offset = process_pool_decode(buf, offset, &task);
+			if(pool->output) {
+				out.data_len = out.position = 0;
+				task.output = &out.stream;
+			}
+			struct process_pool_reply reply;
+			reply.result = pool->run(&task, &worker, pool->user_data);
+			reply.output_len = pool->output ? out.data_len : 0;
+			err = process_pool_write_full(fd, &reply, sizeof(reply));
+			if(!err && reply.output_len) err = process_pool_write_full(fd, out.data, reply.output_len);
+		}
+		if(err) break;
+	}
+	// the result follows the last answer
+	if(pool->result) {
+		size_t len = 0;
+		const void *result = pool->result(worker, &len, pool->user_data);
+		uint32_t n = result ? len : 0;
+		if(!process_pool_write_full(fd, &n, sizeof(n)) && n) process_pool_write_full(fd, result, n);
+	}
+	if(pool->worker_done) pool->worker_done(worker, pool->user_data);
+	stream_close(&out.stream);
+	free(buf);
+	fflush(0);
+	_exit(0);
+}
+
+static int process_pool_spawn(struct process_pool *pool, unsigned k) {
+	int sv[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) return errno;
+	fflush(0);
+	pid_t pid = fork();
+	if(pid < 0) {
+		int r = errno;
+		close(sv[0]);
+		close(sv[1]);
+		return r;
+	}
+	if(!pid) {
+		// a worker holding the socket of another would keep it from seeing the end of its input
+		close(sv[0]);
+		for(unsigned i = 0; i < pool->num_workers; i++)
+			if(pool->workers[i].fd >= 0) close(pool->workers[i].fd);
+		process_pool_child(pool, sv[1]);
+	}
+	close(sv[1]);
+	pool->workers[k].pid = pid;
+	pool->workers[k].fd = sv[0];
+	pool->workers[k].reply_len = pool->workers[k].output_read = 0;
+	return 0;
+}
+
+static int process_pool_send(struct process_pool *pool, unsigned k) {
+	struct process_pool_worker *wk = &pool->workers[k];
+	uint32_t len = wk->batch_len;
+	int r = process_pool_write_full(wk->fd, &len, sizeof(len));
+	if(!r) r = process_pool_write_full(wk->fd, wk->batch, wk->batch_len);
+	return r;
+}
+
+static void process_pool_fail(struct process_pool *pool, int err) {
+	if(!pool->err) pool->err = err;
+	pool->stopped = 1;
+}
+
+static void process_pool_reap(struct process_pool *pool, unsigned k, int *status) {
+	struct process_pool_worker *wk = &pool->workers[k];
+	close(wk->fd);
+	wk->fd = -1;
+	while(waitpid(wk->pid, status, 0) < 0 && errno == EINTR);
+}
+
+// send the batch of an idle worker, a worker that died while idle is replaced once
+static void process_pool_dispatch(struct process_pool *pool, unsigned k) {
+	if(!process_pool_send(pool, k)) return;
+	int status;
+	process_pool_reap(pool, k, &status);
+	int r = process_pool_spawn(pool, k);
+	if(!r) r = process_pool_send(pool, k);
+	if(r) process_pool_fail(pool, r);
+}
+
+// append the buffers of the answered tasks that are next in order
+static void process_pool_commit(struct process_pool *pool) {
+	for(;;) {
+		size_t slot = pool->next_commit % pool->num_slots;
+		if(!pool->slot_done[slot]) break;
+		struct mem_stream *m = &pool->slots[slot];
+		if(m->data_len && !pool->err && stream_write(pool->output, m->data, m->data_len) != (ssize_t)m->data_len)
+			process_pool_fail(pool, EIO);
+		m->data_len = m->position = 0;
+		pool->slot_done[slot] = 0;
+		pool->next_commit++;
+	}
+}
+
+// the task at the head of a worker's batch was answered, or skipped with its output dropped
+static void process_pool_answered(struct process_pool *pool, unsigned k, int skipped) {
+	struct process_pool_worker *wk = &pool->workers[k];
+	if(pool->output) {
+		size_t slot = wk->seq % pool->num_slots;
+		if(skipped) pool->slots[slot].data_len = pool->slots[slot].position = 0;
+		pool->slot_done[slot] = 1;
+		process_pool_commit(pool);
+	}
+	wk->seq++;
+}
+
+// the task a worker died on is skipped, the rest of its batch goes to its replacement
+static void process_pool_crashed(struct process_pool *pool, unsigned k) {
+	struct process_pool_worker *wk = &pool->workers[k];
+	int status;
+	process_pool_reap(pool, k, &status);
+	pool->crashes++;
+	size_t offset = 0;
+	struct schedule_task task;
+	for(size_t i = 0; i <= wk->done; i++)
+		offset = process_pool_decode(wk->batch, offset, &task);
+	if(pool->crashed) pool->crashed(task.path, task.entry, status, pool->user_data);
+	// the result of the worker is lost, not only the task it died on
+	if(pool->result) process_pool_fail(pool, ECHILD);
+	process_pool_answered(pool, k, 1);
+	memmove(wk->batch, wk->batch + offset, wk->batch_len - offset);
+	wk->batch_len -= offset;
+	wk->num_tasks -= wk->done + 1;
+	wk->done = 0;
+	int r = process_pool_spawn(pool, k);
+	if(r) {
+		process_pool_fail(pool, r);
+		return;
+	}
+	if(wk->num_tasks && !pool->stopped) process_pool_dispatch(pool, k);
+	else wk->num_tasks = 0;
+	if(pool->closing && wk->fd >= 0) shutdown(wk->fd, SHUT_WR);
+}
+
+static void process_pool_reply(struct process_pool *pool, unsigned k) {
+	struct process_pool_worker *wk = &pool->workers[k];
+	uint8_t buf[16384];
+	int header = wk->reply_len < sizeof(wk->reply);
+	ssize_t n;
+	if(header) n = read(wk->fd, (uint8_t *)&wk->reply + wk->reply_len, sizeof(wk->reply) - wk->reply_len);
+	else n = read(wk->fd, buf, MIN(sizeof(buf), wk->reply.output_len - wk->output_read));
+	if(n < 0 && (errno == EINTR || errno == EAGAIN)) return;
+	if(n <= 0) {
+		process_pool_crashed(pool, k);
+		return;
+	}
+	if(header) {
+		wk->reply_len += n;
+	} else {
+		wk->output_read += n;
+		struct mem_stream *m = pool->output ? &pool->slots[wk->seq % pool->num_slots] : 0;
+		if(m && stream_write(&m->stream, buf, n) != n) process_pool_fail(pool, ENOMEM);
+	}
+	if(wk->reply_len < sizeof(wk->reply) || wk->output_read < wk->reply.output_len) return;
+	wk->reply_len = wk->output_read = 0;
+	process_pool_answered(pool, k, 0);
+	wk->done++;
+	if(wk->reply.result) pool->stopped = 1;
+	if(wk->done == wk->num_tasks) wk->num_tasks = 0;
+}
+
+// handle the answers of the busy workers, returns 0 if none is busy
+static int process_pool_wait(struct process_pool *pool) {
+	nfds_t n = 0;
+	for(unsigned i = 0; i < pool->num_workers; i++) {
+		if(!pool->workers[i].num_tasks) continue;
+		pool->pfd[n].fd = pool->workers[i].fd;
+		pool->pfd[n].events = POLLIN;
+		pool->pfd[n].revents = 0;
+		pool->pfd_worker[n++] = i;
+	}
+	if(!n) return 0;
+	if(poll(pool->pfd, n, -1) < 0) {
+		if(errno != EINTR) process_pool_fail(pool, errno);
+		return 1;
+	}
+	for(nfds_t i = 0; i < n; i++)
+		if(pool->pfd[i].revents) process_pool_reply(pool, pool->pfd_worker[i]);
+	return 1;
+}
+
+// hand the pending batch to an idle worker
+static void process_pool_flush(struct process_pool *pool) {
+	for(;;) {
+		// the answers of the batch must fit into the reorder buffer, which they do once the busy workers answered
+		int room = !pool->output || pool->seq - pool->next_commit <= pool->num_slots;
+		for(unsigned i = 0; room && i < pool->num_workers && !pool->stopped; i++) {
+			struct process_pool_worker *wk = &pool->workers[i];
+			if(wk->num_tasks) continue;
+			uint8_t *batch = wk->batch;
+			size_t alloc = wk->batch_alloc;
+			wk->batch = pool->pending;
+			wk->batch_len = pool->pending_len;
+			wk->batch_alloc = pool->pending_alloc;
+			wk->num_tasks = pool->num_pending;
+			wk->done = 0;
+			wk->seq = pool->seq - pool->num_pending;
+			pool->pending = batch;
+			pool->pending_alloc = alloc;
+			pool->pending_len = pool->num_pending = 0;
+			process_pool_dispatch(pool, i);
+			return;
+		}
+		if(pool->stopped) break;
+		process_pool_wait(pool);
+	}
+	pool->pending_len = pool->num_pending = 0;
+}
+
+int process_pool_init(struct process_pool *pool, unsigned processes, size_t batch_size, struct stream *output,
+	int (*run)(struct schedule_task *task, void **worker, void *user_data), void (*worker_done)(void *worker, void *user_data),
+	const void *(*result)(void *worker, size_t *len, void *user_data), void (*merge)(void *result, size_t len, void *user_data),
+	void (*crashed)(const char *path, const char *entry, int status, void *user_data), void *user_data) {
+	memset(pool, 0, sizeof(*pool));
+	pool->batch_size = batch_size ? batch_size : PROCESS_POOL_BATCH;
+	pool->run = run;
+	pool->worker_done = worker_done;
+	pool->result = result;
+	pool->merge = merge;
+	pool->crashed = crashed;
+	pool->user_data = user_data;
+	pool->workers = calloc(processes ? processes : 1, sizeof(*pool->workers));
+	pool->pfd = malloc((processes ? processes : 1) * sizeof(*pool->pfd));
+	pool->pfd_worker = malloc((processes ? processes : 1) * sizeof(*pool->pfd_worker));
+	if(output) {
+		pool->output = output;
+		pool->num_slots = (processes + 1) * pool->batch_size;
+		pool->slots = malloc(pool->num_slots * sizeof(*pool->slots));
+		pool->slot_done = calloc(pool->num_slots, 1);
+	}
+	if(!pool->workers || !pool->pfd || !pool->pfd_worker || (output && (!pool->slots || !pool->slot_done))) {
+		free(pool->workers);
+		free(pool->pfd);
+		free(pool->pfd_worker);
+		free(pool->slots);
+		free(pool->slot_done);
+		return ENOMEM;
+	}
+	for(size_t i = 0; i < pool->num_slots; i++)
+		mem_stream_init(&pool->slots[i], 0, 0, 0);
+	for(unsigned i = 0; i < processes; i++)
+		pool->workers[i].fd = -1;
+	pool->num_workers = processes;
+	for(unsigned i = 0; i < processes; i++) {
+		int r = process_pool_spawn(pool, i);
+		if(r) {
+			int stopped;
+			process_pool_finish(pool, &stopped);
+			return r;
+		}
+	}
+	return 0;
+}
+
+int process_pool_push(struct process_pool *pool, const struct schedule_task *task) {
+	if(pool->stopped) {
+		free(task->path);
+		return 1;
+	}
+	struct process_pool_record rec;
+	memset(&rec, 0, sizeof(rec));
+	rec.data = (uintptr_t)task->data;
+	rec.index = task->index;
+	rec.size = task->size;
+	rec.offset = task->offset;
+	rec.len = task->len;
+	rec.weight = task->weight;
+	rec.path_len = strlen(task->path) + 1;
+	rec.entry_len = task->entry ? strlen(task->entry) + 1 : 0;
+	size_t len = sizeof(rec) + rec.path_len + rec.entry_len;
+	if(pool->pending_len + len > pool->pending_alloc) {
+		size_t alloc = pool->pending_alloc ? pool->pending_alloc : 4096;
+		while(alloc < pool->pending_len + len) alloc *= 2;
+		uint8_t *p = realloc(pool->pending, alloc);
+		if(!p) {
+			free(task->path);
+			process_pool_fail(pool, ENOMEM);
+			return 1;
+		}
+		pool->pending = p;
+		pool->pending_alloc = alloc;
+	}
+	uint8_t *p = pool->pending + pool->pending_len;
+	memcpy(p, &rec, sizeof(rec));
+	memcpy(p + sizeof(rec), task->path, rec.path_len);
+	if(task->entry) memcpy(p + sizeof(rec) + rec.path_len, task->entry, rec.entry_len);
+	free(task->path);
+	pool->pending_len += len;
+	pool->seq++;
+	if(++pool->num_pending >= pool->batch_size) process_pool_flush(pool);
+	return pool->stopped;
+}
+
+// read the result a worker sends before it exits
+static void process_pool_collect(struct process_pool *pool, unsigned k) {
+	uint32_t len;
+	int r = process_pool_read_full(pool->workers[k].fd, &len, sizeof(len));
+	void *result = 0;
+	if(!r && len) {
+		result = malloc(len);
+		r = result ? process_pool_read_full(pool->workers[k].fd, result, len) : ENOMEM;
+	}
+	if(!r && len) pool->merge(result, len, pool->user_data);
+	free(result);
+	// what the worker accumulated is missing from the merged result
+	if(r) process_pool_fail(pool, r);
+}
+
+int process_pool_finish(struct process_pool *pool, int *stopped) {
+	if(pool->num_pending && !pool->stopped) process_pool_flush(pool);
+	while(!pool->stopped && process_pool_wait(pool));
+	if(pool->result) {
+		// a worker that sees the end of its input answers the rest of its batch, also when the pool was stopped
+		pool->closing = 1;
+		for(unsigned i = 0; i < pool->num_workers; i++)
+			if(pool->workers[i].fd >= 0) shutdown(pool->workers[i].fd, SHUT_WR);
+		while(process_pool_wait(pool));
+		for(unsigned i = 0; i < pool->num_workers; i++)
+			if(pool->workers[i].fd >= 0) process_pool_collect(pool, i);
+	}
+	// a worker sees the end of its input and exits, after the task it is running if the pool was stopped
+	for(unsigned i = 0; i < pool->num_workers; i++) {
+		if(pool->workers[i].fd < 0) continue;
+		int status;
+		process_pool_reap(pool, i, &status);
+	}
+	*stopped = pool->stopped;
+	int err = pool->err;
+	for(unsigned i = 0; i < pool->num_workers; i++)
+		free(pool->workers[i].batch);
+	for(size_t i = 0; i < pool->num_slots; i++)
+		stream_close(&pool->slots[i].stream);
+	free(pool->slots);
+	free(pool->slot_done);
+	free(pool->workers);
+	free(pool->pfd);
+	free(pool->pfd_worker);
+	free(pool->pending);
+	memset(pool, 0, sizeof(*pool));
+	return err;
+}
+
+#endif
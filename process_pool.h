@@ -0,0 +1,114 @@
+#pragma once
+
+#ifndef WIN32
+
+#include <stdint.h>
+#include <stddef.h>
+#include <poll.h>
+#include <sys/types.h>
+
+#include "schedule.h"
+
+/**
+ * @struct process_pool
+ * @brief Forked worker processes that run tasks sent to them in batches over Unix sockets.
+ *
+ * The walking process assembles tasks into a batch and writes it to an
+ * idle worker, which runs them one after another and answers each with
+ * the result of run and what the task wrote to its output. Workers are
+ * forked from the walking process, so the data pointer of a task is
+ * passed as is. When a worker dies, the task it was running is skipped, a
+ * new worker is forked and the rest of the batch is sent to it.
+ *
+ * With an ordered output, the answers are kept in a reorder buffer of
+ * (processes + 1) * batch_size slots and appended to the output in the
+ * order their tasks were pushed, as with a schedule. With a result
+ * callback, the walking process shuts down the input of every worker at
+ * the end, and each worker answers the rest of its batch and sends its
+ * result before it exits. A worker that dies then takes the results of
+ * all the tasks it ran with it, so the pool fails with ECHILD.
+ */
+struct process_pool {
+	struct process_pool_worker {
+		pid_t pid;
+		int fd;                  /**< Socket to the worker, -1 if not running */
+		uint8_t *batch;          /**< Encoded tasks in flight */
+		size_t batch_len, batch_alloc;
+		size_t num_tasks, done;  /**< Tasks in the batch, answered ones */
+		uint64_t seq;            /**< Sequence number of the first unanswered task of the batch */
+		struct process_pool_reply {
+			int32_t result;
+			uint32_t output_len; /**< Output bytes that follow */
+		} reply;
+		size_t reply_len, output_read;
+	} *workers;
+	unsigned num_workers;
+	struct pollfd *pfd;
+	unsigned *pfd_worker;
+
+	// batch being assembled
+	uint8_t *pending;
+	size_t pending_len, pending_alloc, num_pending;
+	size_t batch_size;
+
+	uint64_t seq;                /**< Sequence number of the next pushed task */
+
+	int stopped;                 /**< A task stopped the pool, or err is set */
+	int err;
+	int closing;                 /**< The input of the workers was shut down */
+	unsigned crashes;
+
+	struct stream *output;
+	struct mem_stream *slots;
+	uint8_t *slot_done;
+	size_t num_slots;
+	uint64_t next_commit;        /**< Sequence number of the next task to commit */
+
+	int (*run)(struct schedule_task *task, void **worker, void *user_data);
+	void (*worker_done)(void *worker, void *user_data);
+	const void *(*result)(void *worker, size_t *len, void *user_data);
+	void (*merge)(void *result, size_t len, void *user_data);
+	void (*crashed)(const char *path, const char *entry, int status, void *user_data);
+	void *user_data;
+};
+
+/**
+ * @brief Fork the worker processes.
+ *
+ * Buffered stdio output is flushed before every fork so that it is not
+ * written again by the workers.
+ * @param pool Pointer to the process pool object.
+ * @param processes Number of worker processes.
+ * @param batch_size Tasks sent to a worker at a time.
+ * @param output Ordered output, or NULL. Each task writes to a buffer of its own that is sent back with its answer.
+ * @param run Called in a worker for every task, with a per-worker pointer that starts as NULL. A non-zero result stops the pool.
+ * @param worker_done Called in each worker before it exits, may be NULL.
+ * @param result Called in each worker before worker_done, returns len bytes to send back, may be NULL.
+ * @param merge Called in the walking process with the result of each worker that exited, which is freed afterwards.
+ * @param crashed Called in the walking process with the task a worker died on and its wait status, may be NULL.
+ * @param user_data Passed to run, worker_done, result, merge and crashed.
+ * @return Status code.
+ */
+int process_pool_init(struct process_pool *pool, unsigned processes, size_t batch_size, struct stream *output,
+	int (*run)(struct schedule_task *task, void **worker, void *user_data), void (*worker_done)(void *worker, void *user_data),
+	const void *(*result)(void *worker, size_t *len, void *user_data), void (*merge)(void *result, size_t len, void *user_data),
+	void (*crashed)(const char *path, const char *entry, int status, void *user_data), void *user_data);
+
+/**
+ * @brief Queue a task, sending the batch once it is full and waiting while no worker is idle.
+ * @param pool Pointer to the process pool object.
+ * @param task Task to queue, its path is freed.
+ * @return 0, or 1 if the pool was stopped and the task dropped.
+ */
+int process_pool_push(struct process_pool *pool, const struct schedule_task *task);
+
+/**
+ * @brief Run the queued tasks, end the workers and release the pool.
+ * @param pool Pointer to the process pool object.
+ * @param stopped Set to 1 if a task stopped the pool and the rest of the tasks were dropped, otherwise 0.
+ * @return Status code, of forking or talking to the workers, of writing the output or of a worker that died before
+ * it sent its result.
+ */
+int process_pool_finish(struct process_pool *pool, int *stopped);
+
+#endif
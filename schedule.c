@@ -0,0 +1,167 @@
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "schedule.h"
+
+static void schedule_sift_up(struct schedule_task *heap, size_t i) {
+	while(i) {
+		size_t parent = (i - 1) / 2;
+		if(heap[parent].priority >= heap[i].priority) break;
+		struct schedule_task t = heap[parent];
+		heap[parent] = heap[i];
+		heap[i] = t;
+		i = parent;
+	}
+}
+
+static void schedule_sift_down(struct schedule_task *heap, size_t count) {
+	size_t i = 0;
+	for(;;) {
+		size_t max = i, l = 2 * i + 1, r = l + 1;
+		if(l < count && heap[l].priority > heap[max].priority) max = l;
+		if(r < count && heap[r].priority > heap[max].priority) max = r;
+		if(max == i) break;
+		struct schedule_task t = heap[max];
+		heap[max] = heap[i];
+		heap[i] = t;
+		i = max;
+	}
+}
+
+// append the buffers of the finished tasks that are next in order, with the lock held
+static void schedule_commit(struct schedule *schedule) {
+	for(;;) {
+		size_t slot = schedule->next_commit % schedule->num_slots;
+		if(!schedule->slot_done[slot]) break;
+		struct mem_stream *m = &schedule->slots[slot];
+		if(m->data_len && !schedule->err && stream_write(schedule->output, m->data, m->data_len) != (ssize_t)m->data_len) {
+			schedule->err = EIO;
+			schedule->stopped = 1;
+		}
+		m->data_len = m->position = 0;
+		schedule->slot_done[slot] = 0;
+		schedule->next_commit++;
+	}
+}
+
+static void *schedule_thread(void *arg) {
+	struct schedule *schedule = arg;
+	void *worker = 0;
+	pthread_mutex_lock(&schedule->lock);
+	for(;;) {
+		while(!schedule->count && !schedule->closed && !schedule->stopped)
+			pthread_cond_wait(&schedule->cond, &schedule->lock);
+		if(schedule->stopped || !schedule->count) break;
+
+		struct schedule_task task = schedule->heap[0];
+		schedule->heap[0] = schedule->heap[--schedule->count];
+		schedule_sift_down(schedule->heap, schedule->count);
+		pthread_cond_broadcast(&schedule->cond);
+		pthread_mutex_unlock(&schedule->lock);
+
+		// the slot is only touched by this task until it is committed
+		size_t slot = schedule->output ? task.seq % schedule->num_slots : 0;
+		if(schedule->output) task.output = &schedule->slots[slot].stream;
+		int r = schedule->run(&task, &worker, schedule->user_data);
+		free(task.path);
+
+		pthread_mutex_lock(&schedule->lock);
+		if(schedule->output) {
+			schedule->slot_done[slot] = 1;
+			schedule_commit(schedule);
+		}
+		if(r) schedule->stopped = 1;
+		pthread_cond_broadcast(&schedule->cond);
+	}
+	pthread_mutex_unlock(&schedule->lock);
+	if(schedule->worker_done) schedule->worker_done(worker, schedule->user_data);
+	return 0;
+}
+
+int schedule_init(struct schedule *schedule, unsigned threads, size_t capacity, int largest_first, struct stream *output,
+	int (*run)(struct schedule_task *task, void **worker, void *user_data), void (*worker_done)(void *worker, void *user_data), void *user_data) {
+	memset(schedule, 0, sizeof(*schedule));
+	schedule->capacity = capacity ? capacity : 1;
+	schedule->largest_first = largest_first;
+	schedule->run = run;
+	schedule->worker_done = worker_done;
+	schedule->user_data = user_data;
+	schedule->heap = malloc(schedule->capacity * sizeof(*schedule->heap));
+	schedule->threads = malloc((threads ? threads : 1) * sizeof(*schedule->threads));
+	if(output) {
+		schedule->output = output;
+		schedule->num_slots = schedule->capacity + threads;
+		schedule->slots = malloc(schedule->num_slots * sizeof(*schedule->slots));
+		schedule->slot_done = calloc(schedule->num_slots, 1);
+	}
+	if(!schedule->heap || !schedule->threads || (output && (!schedule->slots || !schedule->slot_done))) {
+		free(schedule->heap);
+		free(schedule->threads);
+		free(schedule->slots);
+		free(schedule->slot_done);
+		return ENOMEM;
+	}
+	for(size_t i = 0; i < schedule->num_slots; i++)
+		mem_stream_init(&schedule->slots[i], 0, 0, 0);
+	pthread_mutex_init(&schedule->lock, 0);
+	pthread_cond_init(&schedule->cond, 0);
+	for(unsigned i = 0; i < threads; i++) {
+		int r = pthread_create(&schedule->threads[i], 0, schedule_thread, schedule);
+		if(r) {
+			pthread_mutex_lock(&schedule->lock);
+			schedule->stopped = 1;
+			pthread_mutex_unlock(&schedule->lock);
+			int stopped;
+			schedule_finish(schedule, &stopped);
+			return r;
+		}
+		schedule->num_threads++;
+	}
+	return 0;
+}
+
+int schedule_push(struct schedule *schedule, const struct schedule_task *task) {
+	pthread_mutex_lock(&schedule->lock);
+	while((schedule->count == schedule->capacity || (schedule->output && schedule->seq - schedule->next_commit >= schedule->num_slots))
+		&& !schedule->stopped)
+		pthread_cond_wait(&schedule->cond, &schedule->lock);
+	if(schedule->stopped) {
+		pthread_mutex_unlock(&schedule->lock);
+		free(task->path);
+		return 1;
+	}
+	struct schedule_task *t = &schedule->heap[schedule->count];
+	*t = *task;
+	// the oldest task has the highest priority unless ordered by size
+	t->priority = schedule->largest_first ? task->size : UINT64_MAX - schedule->seq;
+	t->seq = schedule->seq++;
+	t->output = 0;
+	schedule_sift_up(schedule->heap, schedule->count++);
+	pthread_cond_broadcast(&schedule->cond);
+	pthread_mutex_unlock(&schedule->lock);
+	return 0;
+}
+
+int schedule_finish(struct schedule *schedule, int *stopped) {
+	pthread_mutex_lock(&schedule->lock);
+	schedule->closed = 1;
+	pthread_cond_broadcast(&schedule->cond);
+	pthread_mutex_unlock(&schedule->lock);
+	for(unsigned i = 0; i < schedule->num_threads; i++)
+		pthread_join(schedule->threads[i], 0);
+	*stopped = schedule->stopped;
+	int err = schedule->err;
+	for(size_t i = 0; i < schedule->count; i++)
+		free(schedule->heap[i].path);
+	for(size_t i = 0; i < schedule->num_slots; i++)
+		stream_close(&schedule->slots[i].stream);
+	free(schedule->slots);
+	free(schedule->slot_done);
+	pthread_cond_destroy(&schedule->cond);
+	pthread_mutex_destroy(&schedule->lock);
+	free(schedule->heap);
+	free(schedule->threads);
+	memset(schedule, 0, sizeof(*schedule));
+	return err;
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "mem_stream.h"
+
+/**
+ * @struct schedule_task
+ * @brief A file, zip entry or chunk of a file to be processed by a worker.
+ */
+struct schedule_task {
+	char *path;          /**< Owned by the task */
+	const char *entry;   /**< Zip entry name, stored in the allocation of path, NULL for a file */
+	void *data;          /**< Caller data */
+	int64_t index;       /**< Zip entry index, -1 for a file */
+	uint64_t size;       /**< Size the task is ordered by */
+	uint64_t offset, len; /**< Byte range of a chunk, len is 0 for a whole file */
+	uint64_t priority;
+	uint64_t seq;
+	struct stream *output; /**< Buffer of the task in the reorder buffer, NULL without ordered output */
+	double weight;       /**< Caller data */
+};
+
+/**
+ * @struct schedule
+ * @brief Bounded queue of tasks drained by a pool of worker threads.
+ *
+ * Each idle worker takes the largest queued task when largest_first is
+ * set, otherwise the oldest. The queue holds at most capacity tasks, so
+ * that is how far ahead of the workers the largest task is looked for.
+ *
+ * With an ordered output, every task writes to a buffer of its own in a
+ * reorder buffer of capacity + threads slots. Buffers are appended to the
+ * output in the order their tasks were pushed, and a task is only pushed
+ * once its slot was committed, so the buffers are reused.
+ */
+struct schedule {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t *threads;
+	unsigned num_threads;
+	struct schedule_task *heap;  /**< Max-heap on priority */
+	size_t count, capacity;
+	uint64_t seq;
+	int largest_first;
+	int closed, stopped;
+	int err;                     /**< Failed write to the output */
+
+	struct stream *output;
+	struct mem_stream *slots;
+	uint8_t *slot_done;
+	size_t num_slots;
+	uint64_t next_commit;         /**< Sequence number of the next task to commit */
+
+	int (*run)(struct schedule_task *task, void **worker, void *user_data);
+	void (*worker_done)(void *worker, void *user_data);
+	void *user_data;
+};
+
+/**
+ * @brief Start the worker threads.
+ * @param schedule Pointer to the schedule object.
+ * @param threads Number of worker threads.
+ * @param capacity Maximum number of queued tasks.
+ * @param largest_first Run the largest queued task first instead of the oldest.
+ * @param output Ordered output, or NULL.
+ * @param run Called on a worker thread for every task, with a per-worker pointer that starts as NULL. A non-zero result stops the schedule.
+ * @param worker_done Called on each worker thread when it exits, may be NULL.
+ * @param user_data Passed to run and worker_done.
+ * @return Status code.
+ */
+int schedule_init(struct schedule *schedule, unsigned threads, size_t capacity, int largest_first, struct stream *output,
+	int (*run)(struct schedule_task *task, void **worker, void *user_data), void (*worker_done)(void *worker, void *user_data), void *user_data);
+
+/**
+ * @brief Queue a task, waiting while the queue is full. The task's path is owned by the schedule from then on.
+ * @param schedule Pointer to the schedule object.
+ * @param task Task to queue, copied.
+ * @return 0, or 1 if the schedule was stopped and the task dropped.
+ */
+int schedule_push(struct schedule *schedule, const struct schedule_task *task);
+
+/**
+ * @brief Run the queued tasks, stop the worker threads and release the schedule.
+ * @param schedule Pointer to the schedule object.
+ * @param stopped Set to 1 if a task stopped the schedule and the rest of the queue was dropped, otherwise 0.
+ * @return Status code of the writes to the output.
+ */
+int schedule_finish(struct schedule *schedule, int *stopped);
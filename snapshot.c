@@ -0,0 +1,586 @@
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "snapshot.h"
+#include "lazy_stream.h"
+#include "inode_set.h"
+#include "path_info.h"
+#include "util.h"
+
+#define SNAPSHOT_MAGIC "SLSNAP1"
+#define SNAPSHOT_VERSION 1
+
+// bytes per node over all arrays
+#define SNAPSHOT_NODE_BYTES (2 * sizeof(uint64_t) + 4 * sizeof(uint32_t) + sizeof(uint8_t))
+
+// internal file callback result, a file that matched no filter or failed the predicate
+#define SNAPSHOT_NO_MATCH (-100)
+
+struct snapshot_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t num_nodes;
+	uint64_t heap_size;
+};
+
+struct snapshot_build {
+	int flags;
+	uint64_t *size;
+	int64_t *mtime_ns;
+	uint32_t *parent, *end, *name, *index;
+	uint8_t *type;
+	size_t num_nodes, nodes_alloc;
+	char *heap;
+	size_t heap_len, heap_alloc;
+	uint32_t *names;           // interned heap offsets + 1, 0 for an empty slot
+	size_t num_names, names_mask;
+	struct inode_set dirs;
+	char *path;
+	size_t path_alloc;
+};
+
+#define SNAPSHOT_GROW(array, alloc) do { \
+	void *grown = realloc(array, (alloc) * sizeof(*(array))); \
+	if(!grown) return ENOMEM; \
+	array = grown; \
+} while(0)
+
+static size_t snapshot_name_slot(const char *name, size_t mask) {
+	return fnv1a64(FNV1A64_INIT, name, strlen(name)) & mask;
+}
+
+static int snapshot_intern(struct snapshot_build *b, const char *name, uint32_t *offset) {
+	// at most half full
+	if(b->num_names * 2 >= b->names_mask) {
+		size_t mask = b->names_mask ? b->names_mask * 2 + 1 : 1023;
+		uint32_t *names = calloc(mask + 1, sizeof(*names));
+		if(!names) return ENOMEM;
+		for(size_t i = 0; b->names && i <= b->names_mask; i++) {
+			if(!b->names[i]) continue;
+			size_t j = snapshot_name_slot(b->heap + b->names[i] - 1, mask);
+			while(names[j]) j = (j + 1) & mask;
+			names[j] = b->names[i];
+		}
+		free(b->names);
+		b->names = names;
+		b->names_mask = mask;
+	}
+	size_t i = snapshot_name_slot(name, b->names_mask);
+	for(; b->names[i]; i = (i + 1) & b->names_mask) {
+		if(!strcmp(b->heap + b->names[i] - 1, name)) {
+			*offset = b->names[i] - 1;
+			return 0;
+		}
+	}
+	size_t len = strlen(name) + 1;
+	if(b->heap_len + len >= UINT32_MAX) return EFBIG;
+	if(b->heap_len + len > b->heap_alloc) {
+		size_t alloc = b->heap_alloc ? b->heap_alloc : 4096;
+		while(alloc < b->heap_len + len) alloc *= 2;
+		char *heap = realloc(b->heap, alloc);
+		if(!heap) return ENOMEM;
+		b->heap = heap;
+		b->heap_alloc = alloc;
+	}
+	*offset = b->heap_len;
+	memcpy(b->heap + b->heap_len, name, len);
+	b->heap_len += len;
+	b->names[i] = *offset + 1;
+	b->num_names++;
+	return 0;
+}
+
+static int snapshot_add(struct snapshot_build *b, int type, uint32_t parent, const char *name, uint64_t size, int64_t mtime_ns, uint32_t index, uint32_t *node) {
+	if(b->num_nodes >= UINT32_MAX) return EFBIG;
+	if(b->num_nodes >= b->nodes_alloc) {
+		size_t alloc = b->nodes_alloc ? b->nodes_alloc * 2 : 1024;
+		SNAPSHOT_GROW(b->size, alloc);
+		SNAPSHOT_GROW(b->mtime_ns, alloc);
+		SNAPSHOT_GROW(b->parent, alloc);
+		SNAPSHOT_GROW(b->end, alloc);
+		SNAPSHOT_GROW(b->name, alloc);
+		SNAPSHOT_GROW(b->index, alloc);
+		SNAPSHOT_GROW(b->type, alloc);
+		b->nodes_alloc = alloc;
+	}
+	uint32_t n = b->num_nodes;
+	int r = snapshot_intern(b, name, &b->name[n]);
+	if(r) return r;
+	b->size[n] = size;
+	b->mtime_ns[n] = mtime_ns;
+	b->parent[n] = parent;
+	b->end[n] = n + 1;
+	b->index[n] = index;
+	b->type[n] = type;
+	b->num_nodes++;
+	if(node) *node = n;
+	return 0;
+}
+
+static int snapshot_set_path(char **path, size_t *path_alloc, size_t len, const char *name) {
+	size_t name_len = strlen(name), sep = len ? 1 : 0;
+	if(len + sep + name_len + 1 > *path_alloc) {
+		size_t alloc = *path_alloc ? *path_alloc : 256;
+		while(alloc < len + sep + name_len + 1) alloc *= 2;
+		char *p = realloc(*path, alloc);
+		if(!p) return ENOMEM;
+		*path = p;
+		*path_alloc = alloc;
+	}
+	if(sep) (*path)[len] = '/';
+	memcpy(*path + len + sep, name, name_len + 1);
+	return 0;
+}
+
+#ifdef HAVE_LIBZIP
+// entries are recorded in archive order, an archive that cannot be read stays a plain file
+static int snapshot_scan_zip(struct snapshot_build *b, uint32_t node) {
+	int err;
+	zip_t *z = zip_open(b->path, ZIP_RDONLY, &err);
+	if(!z) return 0;
+	zip_int64_t num_entries = zip_get_num_entries(z, 0);
+	int r = 0;
+	for(zip_int64_t j = 0; !r && j < num_entries && j < UINT32_MAX; j++) {
+		zip_stat_t st;
+		if(zip_stat_index(z, j, 0, &st) || !(st.valid & ZIP_STAT_NAME)) continue;
+		int64_t mtime_ns = (st.valid & ZIP_STAT_MTIME) ? (int64_t)st.mtime * 1000000000 : 0;
+		r = snapshot_add(b, SNAPSHOT_ENTRY, node, st.name, (st.valid & ZIP_STAT_SIZE) ? st.size : 0, mtime_ns, (uint32_t)j, 0);
+	}
+	zip_close(z);
+	b->type[node] = SNAPSHOT_ARCHIVE;
+	return r;
+}
+#endif
+
+static int snapshot_name_cmp(const void *a, const void *b) {
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int snapshot_scan_dir(struct snapshot_build *b, uint32_t node, size_t path_len) {
+	DIR *d = opendir(b->path);
+	if(!d) return 0; // unreadable directories are recorded empty
+	char **names = 0;
+	size_t num_names = 0, names_alloc = 0;
+	int r = 0;
+	struct dirent *de;
+	while((de = readdir(d))) {
+		if(de->d_name[0] == '.' && de->d_name[1] == 0) continue;
+		if(de->d_name[0] == '.' && de->d_name[1] == '.' && de->d_name[2] == 0) continue;
+		if(num_names >= names_alloc) {
+			size_t alloc = names_alloc ? names_alloc * 2 : 64;
+			char **n = realloc(names, alloc * sizeof(*n));
+			if(!n) {
+				r = ENOMEM;
+				break;
+			}
+			names = n;
+			names_alloc = alloc;
+		}
+		names[num_names] = strdup(de->d_name);
+		if(!names[num_names]) {
+			r = ENOMEM;
+			break;
+		}
+		num_names++;
+	}
+	closedir(d);
+	if(!r) qsort(names, num_names, sizeof(*names), snapshot_name_cmp);
+
+	for(size_t i = 0; !r && i < num_names; i++) {
+		r = snapshot_set_path(&b->path, &b->path_alloc, path_len, names[i]);
+		struct stat st;
+		if(r || stat(b->path, &st) < 0) continue;
+		uint32_t child = 0;
+		if(S_ISDIR(st.st_mode)) {
+			r = snapshot_add(b, SNAPSHOT_DIR, node, names[i], 0, STAT_MTIME_NS(&st), 0, &child);
+			if(!r && (b->flags & EF_RECURSE_DIRS)) {
+				int seen = inode_set_insert(&b->dirs, st.st_dev, st.st_ino);
+				if(seen < 0) r = -seen;
+				else if(!seen) r = snapshot_scan_dir(b, child, path_len + 1 + strlen(names[i]));
+			}
+		} else {
+			r = snapshot_add(b, SNAPSHOT_FILE, node, names[i], st.st_size, STAT_MTIME_NS(&st), 0, &child);
+#ifdef HAVE_LIBZIP
+			const char *ext = strrchr(names[i], '.');
+			if(!r && ext && !strcasecmp(ext, ".zip") && (b->flags & EF_RECURSE_ARCHIVES))
+				r = snapshot_scan_zip(b, child);
+#endif
+		}
+		if(!r) b->end[child] = b->num_nodes;
+	}
+	for(size_t i = 0; i < num_names; i++)
+		free(names[i]);
+	free(names);
+	return r;
+}
+
+// point the arrays into an image, every offset and subtree is checked so that a damaged file cannot be read out of bounds
+static int snapshot_attach(struct snapshot *snapshot, const uint8_t *data, size_t len) {
+	const struct snapshot_header *h = (const struct snapshot_header *)data;
+	if(len < sizeof(*h) || memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic)) || h->version != SNAPSHOT_VERSION || !h->num_nodes)
+		return EINVAL;
+	uint64_t n = h->num_nodes;
+	if(n * SNAPSHOT_NODE_BYTES > len - sizeof(*h))
+		return EINVAL;
+	uint64_t heap_start = sizeof(*h) + n * SNAPSHOT_NODE_BYTES;
+	if(h->heap_size != len - heap_start || !h->heap_size || data[len - 1])
+		return EINVAL;
+
+	const uint8_t *p = data + sizeof(*h);
+	const uint64_t *size = (const uint64_t *)p;
+	p += n * sizeof(uint64_t);
+	const int64_t *mtime_ns = (const int64_t *)p;
+	p += n * sizeof(int64_t);
+	const uint32_t *parent = (const uint32_t *)p;
+	p += n * sizeof(uint32_t);
+	const uint32_t *end = (const uint32_t *)p;
+	p += n * sizeof(uint32_t);
+	const uint32_t *name = (const uint32_t *)p;
+	p += n * sizeof(uint32_t);
+	const uint32_t *index = (const uint32_t *)p;
+	p += n * sizeof(uint32_t);
+	const uint8_t *type = p;
+
+	if(end[0] != n || (type[0] != SNAPSHOT_DIR && type[0] != SNAPSHOT_FILE))
+		return EINVAL;
+	for(uint64_t i = 0; i < n; i++) {
+		if(name[i] >= h->heap_size || type[i] > SNAPSHOT_ENTRY || end[i] <= i || end[i] > n)
+			return EINVAL;
+		if((type[i] == SNAPSHOT_FILE || type[i] == SNAPSHOT_ENTRY) && end[i] != i + 1)
+			return EINVAL;
+		if(i && (parent[i] >= i || end[i] > end[parent[i]] || (type[i] == SNAPSHOT_ENTRY) != (type[parent[i]] == SNAPSHOT_ARCHIVE)))
+			return EINVAL;
+	}
+
+	snapshot->num_nodes = n;
+	snapshot->size = size;
+	snapshot->mtime_ns = mtime_ns;
+	snapshot->parent = parent;
+	snapshot->end = end;
+	snapshot->name = name;
+	snapshot->index = index;
+	snapshot->type = type;
+	snapshot->heap = (const char *)data + heap_start;
+	snapshot->heap_size = h->heap_size;
+	snapshot->data = data;
+	snapshot->data_len = len;
+	return 0;
+}
+
+static uint8_t *snapshot_put(uint8_t *p, const void *src, size_t len) {
+	memcpy(p, src, len);
+	return p + len;
+}
+
+static int snapshot_pack(struct snapshot *snapshot, const struct snapshot_build *b) {
+	size_t n = b->num_nodes;
+	size_t len = sizeof(struct snapshot_header) + n * SNAPSHOT_NODE_BYTES + b->heap_len;
+	uint8_t *data = malloc(len);
+	if(!data) return ENOMEM;
+
+	struct snapshot_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+	h.version = SNAPSHOT_VERSION;
+	h.num_nodes = n;
+	h.heap_size = b->heap_len;
+	uint8_t *p = snapshot_put(data, &h, sizeof(h));
+	p = snapshot_put(p, b->size, n * sizeof(*b->size));
+	p = snapshot_put(p, b->mtime_ns, n * sizeof(*b->mtime_ns));
+	p = snapshot_put(p, b->parent, n * sizeof(*b->parent));
+	p = snapshot_put(p, b->end, n * sizeof(*b->end));
+	p = snapshot_put(p, b->name, n * sizeof(*b->name));
+	p = snapshot_put(p, b->index, n * sizeof(*b->index));
+	p = snapshot_put(p, b->type, n * sizeof(*b->type));
+	snapshot_put(p, b->heap, b->heap_len);
+
+	int r = snapshot_attach(snapshot, data, len);
+	if(r) {
+		free(data);
+		return r;
+	}
+	snapshot->owned = data;
+	return 0;
+}
+
+int snapshot_scan(struct snapshot *snapshot, const char *path, int flags) {
+	memset(snapshot, 0, sizeof(*snapshot));
+	struct stat st;
+	if(stat(path, &st) < 0) return errno;
+
+	struct snapshot_build b;
+	memset(&b, 0, sizeof(b));
+	b.flags = flags;
+	int dir = S_ISDIR(st.st_mode);
+	int r = snapshot_set_path(&b.path, &b.path_alloc, 0, path);
+	if(!r) r = snapshot_add(&b, dir ? SNAPSHOT_DIR : SNAPSHOT_FILE, 0, path, dir ? 0 : st.st_size, STAT_MTIME_NS(&st), 0, 0);
+	if(!r && dir) {
+		int seen = inode_set_insert(&b.dirs, st.st_dev, st.st_ino);
+		r = seen < 0 ? -seen : snapshot_scan_dir(&b, 0, strlen(path));
+	}
+	if(!r) {
+		b.end[0] = b.num_nodes;
+		r = snapshot_pack(snapshot, &b);
+	}
+
+	free(b.size);
+	free(b.mtime_ns);
+	free(b.parent);
+	free(b.end);
+	free(b.name);
+	free(b.index);
+	free(b.type);
+	free(b.heap);
+	free(b.names);
+	free(b.path);
+	inode_set_free(&b.dirs);
+	return r;
+}
+
+int snapshot_open(struct snapshot *snapshot, const char *filename) {
+	memset(snapshot, 0, sizeof(*snapshot));
+	int r = file_stream_init(&snapshot->file, filename, "rb", 0);
+	if(r) return r;
+	size_t len = 0;
+	const uint8_t *data = stream_get_memory_access(&snapshot->file.stream, &len);
+	if(!data) {
+		// an empty file cannot be mapped and is no snapshot either
+		r = len ? snapshot->file.stream._errno : 0;
+		stream_close(&snapshot->file.stream);
+		memset(snapshot, 0, sizeof(*snapshot));
+		return r ? r : EINVAL;
+	}
+	r = snapshot_attach(snapshot, data, len);
+	if(r) {
+		stream_revoke_memory_access(&snapshot->file.stream);
+		stream_close(&snapshot->file.stream);
+		memset(snapshot, 0, sizeof(*snapshot));
+		return r;
+	}
+	snapshot->file_open = 1;
+	return 0;
+}
+
+int snapshot_save(const struct snapshot *snapshot, const char *filename) {
+	size_t tmp_len = strlen(filename) + 5;
+	char *tmp = malloc(tmp_len);
+	if(!tmp) return ENOMEM;
+	snprintf(tmp, tmp_len, "%s.tmp", filename);
+
+	struct file_stream s;
+	int r = file_stream_init(&s, tmp, "wb", 0);
+	if(r) goto out;
+	if(stream_write(&s.stream, snapshot->data, snapshot->data_len) != (ssize_t)snapshot->data_len)
+		r = EIO;
+	if(stream_close(&s.stream) && !r) r = EIO;
+	if(!r && rename(tmp, filename)) r = errno;
+	if(r) remove(tmp);
+out:
+	free(tmp);
+	return r;
+}
+
+const char *snapshot_name(const struct snapshot *snapshot, uint32_t node) {
+	return snapshot->heap + snapshot->name[node];
+}
+
+struct snapshot_query {
+	const struct snapshot *snapshot;
+	struct file_type_filter *filters;
+	int flags;
+	int stream_flags;
+	const struct predicate *pred;
+	char *path;
+	size_t path_alloc, root_len;
+};
+
+static const char *snapshot_relative(const struct snapshot_query *q) {
+	const char *rel = q->path + q->root_len;
+	while(*rel == '/') rel++;
+	return rel;
+}
+
+static struct file_type_filter *snapshot_match_ext(struct snapshot_query *q, const char *ext) {
+	if(!ext) return 0;
+	for(struct file_type_filter *f = q->filters; f->ext; f++)
+		if(!strcasecmp(ext, f->ext)) return f;
+	return 0;
+}
+
+// the file at q->path
+static int snapshot_query_file(struct snapshot_query *q, uint32_t node) {
+	const struct snapshot *s = q->snapshot;
+	if(q->pred && (!predicate_match_path(q->pred, snapshot_relative(q)) || !predicate_match_stat(q->pred, s->size[node], s->mtime_ns[node])))
+		return SNAPSHOT_NO_MATCH;
+	struct file_type_filter *f = snapshot_match_ext(q, strrchr(snapshot_name(s, node), '.'));
+	if(!f) return SNAPSHOT_NO_MATCH;
+
+	struct path_info p;
+#ifdef HAVE_LIBZIP
+	p.zip_file_name = p.zip_file_base = p.zip_file_dirname = 0;
+#endif
+	p.output = 0;
+	p.acc = 0;
+	p.weight = 1;
+	struct lazy_stream ls;
+	struct stream *stream = 0;
+	if(q->flags & EF_OPEN_STREAM) {
+		lazy_stream_init_file(&ls, q->path, "rb", q->stream_flags);
+		stream = &ls.stream;
+	}
+	FILL_PATH_INFO(q->path);
+	int r = f->file_cb(&p, stream, f->user_data);
+	FREE_PATH_INFO();
+	if(stream) stream_close(stream);
+	return r;
+}
+
+#ifdef HAVE_LIBZIP
+// the entries of the archive at q->path, whose path is path_len long
+static int snapshot_query_zip(struct snapshot_query *q, uint32_t node, size_t path_len) {
+	const struct snapshot *s = q->snapshot;
+	if(q->pred && !predicate_match_dir(q->pred, snapshot_relative(q))) return 0;
+	// q->path is reused for the entry paths matched by the predicate
+	char *archive = strdup(q->path);
+	if(!archive) return ENOMEM;
+	zip_t *z = 0;
+	struct path_info p;
+	p.output = 0;
+	p.acc = 0;
+	p.weight = 1;
+	FILL_ZIP_PATH_INFO(archive);
+
+	int r = 0;
+	for(uint32_t i = node + 1; !r && i < s->end[node]; i = s->end[i]) {
+		const char *name = snapshot_name(s, i);
+		const char *ext = strrchr(name, '.');
+		if(!ext || !ext[1]) continue;
+		if(q->pred) {
+			r = snapshot_set_path(&q->path, &q->path_alloc, path_len, name);
+			if(r) break;
+			if(!predicate_match_path(q->pred, snapshot_relative(q)) || !predicate_match_stat(q->pred, s->size[i], s->mtime_ns[i]))
+				continue;
+		}
+		struct file_type_filter *f = snapshot_match_ext(q, ext);
+		if(!f) continue;
+		struct lazy_stream ls;
+		struct stream *stream = 0;
+		if(q->flags & EF_OPEN_STREAM) {
+			lazy_stream_init_zip_path(&ls, &z, archive, s->index[i], q->stream_flags);
+			stream = &ls.stream;
+		}
+		FILL_PATH_INFO(name);
+		r = f->file_cb(&p, stream, f->user_data);
+		FREE_PATH_INFO();
+		if(stream) stream_close(stream);
+	}
+	if(z) zip_close(z);
+	FREE_ZIP_PATH_INFO();
+	free(archive);
+	// skipping the siblings of an entry skips the rest of the archive
+	return r == EF_SKIP_SIBLINGS || r == EF_SKIP_SUBTREE ? 0 : r;
+}
+#endif
+
+static int snapshot_query_dir(struct snapshot_query *q) {
+	const struct snapshot *s = q->snapshot;
+	// ancestors of the current node and the lengths of their paths
+	uint32_t *stack = malloc(64 * sizeof(*stack));
+	size_t *stack_len = malloc(64 * sizeof(*stack_len));
+	size_t depth = 1, stack_alloc = 64;
+	int r = stack && stack_len ? 0 : ENOMEM;
+	if(!r) {
+		stack[0] = 0;
+		stack_len[0] = q->root_len;
+	}
+	for(uint32_t i = 1; !r && i < s->num_nodes; ) {
+		while(s->end[stack[depth - 1]] <= i) depth--;
+		uint32_t dir = stack[depth - 1];
+		size_t len = stack_len[depth - 1];
+		const char *name = snapshot_name(s, i);
+		r = snapshot_set_path(&q->path, &q->path_alloc, len, name);
+		if(r) break;
+		if(s->type[i] == SNAPSHOT_DIR) {
+			if(!(q->flags & EF_RECURSE_DIRS) || (q->pred && !predicate_match_dir(q->pred, snapshot_relative(q)))) {
+				i = s->end[i];
+				continue;
+			}
+			if(depth == stack_alloc) {
+				size_t alloc = stack_alloc * 2;
+				uint32_t *st = realloc(stack, alloc * sizeof(*st));
+				if(st) stack = st;
+				size_t *sl = realloc(stack_len, alloc * sizeof(*sl));
+				if(sl) stack_len = sl;
+				if(!st || !sl) {
+					r = ENOMEM;
+					break;
+				}
+				stack_alloc = alloc;
+			}
+			stack[depth] = i;
+			stack_len[depth] = len + 1 + strlen(name);
+			depth++;
+			i++;
+			continue;
+		}
+		int fr;
+#ifdef HAVE_LIBZIP
+		// like each_file(), archives are only opened with streams
+		if(s->type[i] == SNAPSHOT_ARCHIVE && (q->flags & EF_RECURSE_ARCHIVES) && (q->flags & EF_OPEN_STREAM))
+			fr = snapshot_query_zip(q, i, len + 1 + strlen(name));
+		else
+			fr = snapshot_query_file(q, i);
+#else
+		fr = snapshot_query_file(q, i);
+#endif
+		i = s->end[i];
+		// errors of single files do not end the walk
+		if(fr == EF_STOP) r = fr;
+		else if(fr == EF_SKIP_SIBLINGS || fr == EF_SKIP_SUBTREE) i = s->end[dir];
+	}
+	free(stack);
+	free(stack_len);
+	return r;
+}
+
+int snapshot_each_file(const struct snapshot *snapshot, struct file_type_filter *filters, int flags, const struct predicate *predicate) {
+	struct snapshot_query q;
+	memset(&q, 0, sizeof(q));
+	q.snapshot = snapshot;
+	q.filters = filters;
+	q.flags = flags;
+#ifdef HAVE_GZIP
+	q.stream_flags = (flags & EF_TRANSPARENT_GZIP) ? STREAM_TRANSPARENT_GZIP : 0;
+#endif
+	q.pred = predicate;
+	const char *root = snapshot_name(snapshot, 0);
+	int r = snapshot_set_path(&q.path, &q.path_alloc, 0, root);
+	if(!r) {
+		if(snapshot->type[0] == SNAPSHOT_DIR) {
+			q.root_len = strlen(root);
+			r = snapshot_query_dir(&q);
+		} else {
+			// a root file is matched by its name
+			const char *base = strrchr(root, '/');
+			q.root_len = base ? (size_t)(base - root) : 0;
+			r = snapshot_query_file(&q, 0);
+			if(r == SNAPSHOT_NO_MATCH) r = 1;
+			else if(r == EF_SKIP_SIBLINGS || r == EF_SKIP_SUBTREE) r = 0;
+		}
+	}
+	free(q.path);
+	return r == EF_STOP ? 0 : r;
+}
+
+void snapshot_free(struct snapshot *snapshot) {
+	if(snapshot->file_open) {
+		stream_revoke_memory_access(&snapshot->file.stream);
+		stream_close(&snapshot->file.stream);
+	}
+	free(snapshot->owned);
+	memset(snapshot, 0, sizeof(*snapshot));
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "stream_base.h"
+#include "file_stream.h"
+#include "predicate.h"
+#include "each_file.h"
+
+// snapshot node types
+#define SNAPSHOT_DIR     0
+#define SNAPSHOT_FILE    1
+#define SNAPSHOT_ARCHIVE 2 /**< Zip archive, its entries are its children */
+#define SNAPSHOT_ENTRY   3 /**< Zip entry, named by its full name in the archive */
+
+/**
+ * @struct snapshot
+ * @brief Compact image of a directory tree, taken once and queried any number of times.
+ *
+ * Nodes are stored in depth-first order as one array per field. A node
+ * holds only its own name, so paths are shared with the ancestors like in a
+ * trie, and equal names are stored once in the heap. The children of node
+ * i are the nodes i + 1 up to end[i], each child followed by its subtree.
+ * Node 0 is the root and its name is the root path.
+ *
+ * The file is a header followed by the arrays and the heap, exactly as
+ * they are in memory, in host byte order. snapshot_open() maps it without
+ * copying.
+ */
+struct snapshot {
+	uint32_t num_nodes;
+	const uint64_t *size;      /**< File or uncompressed entry size, 0 for directories */
+	const int64_t *mtime_ns;
+	const uint32_t *parent;
+	const uint32_t *end;       /**< Index past the subtree of the node */
+	const uint32_t *name;      /**< Heap offset of the NUL terminated name */
+	const uint32_t *index;     /**< Index of an entry in its archive */
+	const uint8_t *type;       /**< SNAPSHOT_* */
+	const char *heap;
+	uint64_t heap_size;
+
+	const uint8_t *data;       /**< Whole image, as written by snapshot_save() */
+	size_t data_len;
+	void *owned;               /**< Image built by snapshot_scan() */
+	struct file_stream file;   /**< Image mapped by snapshot_open() */
+	int file_open;
+};
+
+/**
+ * @brief Take a snapshot of a tree.
+ *
+ * Entries are recorded in name order. A directory that was already
+ * recorded under another path, through a symbolic link or bind mount, is
+ * recorded empty.
+ * @param snapshot Pointer to the snapshot object.
+ * @param path Root directory or file.
+ * @param flags EF_RECURSE_DIRS to record subdirectories, else only the root listing,
+ *              EF_RECURSE_ARCHIVES to record the entries of zip archives.
+ * @return Status code, EFBIG if the tree has more than 2^32 nodes or name bytes.
+ */
+int snapshot_scan(struct snapshot *snapshot, const char *path, int flags);
+
+/**
+ * @brief Map a snapshot written by snapshot_save().
+ * @param snapshot Pointer to the snapshot object.
+ * @param filename Snapshot file name.
+ * @return Status code, EINVAL if the file is not a valid snapshot.
+ */
+int snapshot_open(struct snapshot *snapshot, const char *filename);
+
+/**
+ * @brief Write a snapshot to a file, replacing it atomically.
+ * @param snapshot Pointer to the snapshot object.
+ * @param filename Snapshot file name.
+ * @return Status code.
+ */
+int snapshot_save(const struct snapshot *snapshot, const char *filename);
+
+/**
+ * @brief Get the name of a node.
+ * @param snapshot Pointer to the snapshot object.
+ * @param node Node index.
+ * @return Name, the root path for node 0.
+ */
+const char *snapshot_name(const struct snapshot *snapshot, uint32_t node);
+
+/**
+ * @brief each_file() over a snapshot.
+ *
+ * Files and zip entries are matched against the filters and the predicate
+ * from the snapshot alone, nothing touches the filesystem until a stream is
+ * accessed. The entries of an archive share one archive handle, opened by
+ * the first access to any of their streams. Callback results are handled
+ * as by each_file().
+ * @param snapshot Pointer to the snapshot object.
+ * @param filters File type filters.
+ * @param flags EF_RECURSE_DIRS, EF_RECURSE_ARCHIVES, EF_OPEN_STREAM and EF_TRANSPARENT_GZIP.
+ * @param predicate Conditions on paths relative to the root, sizes and times, may be NULL.
+ * @return Status code, 1 for a root file that matched no filter.
+ */
+int snapshot_each_file(const struct snapshot *snapshot, struct file_type_filter *filters, int flags, const struct predicate *predicate);
+
+/**
+ * @brief Release the snapshot.
+ * @param snapshot Pointer to the snapshot object.
+ */
+void snapshot_free(struct snapshot *snapshot);
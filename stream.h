@@ -2,6 +2,16 @@
 #include "file_stream.h"
 #include "mem_stream.h"
 #include "zip_file_stream.h"
+#include "lazy_stream.h"
+#include "bit_stream.h"
+#include "manifest.h"
+#include "dir_cache.h"
+#include "checkpoint.h"
+#include "predicate.h"
+#include "each_file_stats.h"
+#include "each_file_dedup.h"
 #include "each_file.h"
+#include "each_file_watch.h"
+#include "snapshot.h"
 
 // TODO: proper error handling
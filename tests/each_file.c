@@ -1,6 +1,14 @@
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include "../stream.h"
 
 // Mock callback function to count the number of times it's called
@@ -35,6 +43,27 @@ void test_each_file_simple(void) {
     assert(callback_count == 0);
 }
 
+// a subdirectory that cannot be opened for want of descriptors fails the walk
+void test_each_file_dir_error(void) {
+    int callback_count = 0;
+    struct file_type_filter filters[] = {
+        {".txt", mock_file_callback, &callback_count},
+        {NULL, NULL, NULL} // End of filter list
+    };
+    int fd = open("/dev/null", O_RDONLY);
+    assert(fd >= 0);
+    close(fd);
+    // only the root directory can be opened
+    struct rlimit old, lim;
+    assert(getrlimit(RLIMIT_NOFILE, &old) == 0);
+    lim = old;
+    lim.rlim_cur = fd + 1;
+    assert(setrlimit(RLIMIT_NOFILE, &lim) == 0);
+    int result = each_file("test_directory", filters, EF_RECURSE_DIRS);
+    assert(setrlimit(RLIMIT_NOFILE, &old) == 0);
+    assert(result == EMFILE);
+}
+
 void test_each_file_with_flags(void) {
     struct file_type_filter filters[] = {
         {".txt", mock_file_callback, NULL},
@@ -79,11 +108,1248 @@ void test_each_file_multiple_filters(void) {
     assert(callback_count == 6);
 }
 
+struct inode_order {
+    int count;
+    char dirname[256];
+    ino_t last_ino;
+};
+
+int inode_order_callback(struct path_info *path_info, struct stream *stream, void *user_data) {
+    (void)stream;
+    struct inode_order *o = (struct inode_order *)user_data;
+    struct stat st;
+    assert(stat(path_info->file_name, &st) == 0);
+    if(!strcmp(o->dirname, path_info->file_dirname))
+        assert(st.st_ino > o->last_ino);
+    snprintf(o->dirname, sizeof(o->dirname), "%s", path_info->file_dirname);
+    o->last_ino = st.st_ino;
+    o->count++;
+    return 0;
+}
+
+void test_each_file_sort_inode(void) {
+    struct inode_order order;
+    memset(&order, 0, sizeof(order));
+    struct file_type_filter filters[] = {
+        {".txt", inode_order_callback, &order},
+        {".jpg", inode_order_callback, &order},
+        {NULL, NULL, NULL} // End of filter list
+    };
+
+    int result = each_file("test_directory", filters, EF_RECURSE_DIRS | EF_SORT_INODE);
+    assert(result == 0);
+    assert(order.count == 6);
+
+    // sorting within windows only guarantees order inside each window
+    int callback_count = 0;
+    struct file_type_filter count_filters[] = {
+        {".txt", mock_file_callback, &callback_count},
+        {".jpg", mock_file_callback, &callback_count},
+        {NULL, NULL, NULL} // End of filter list
+    };
+    struct each_file_options opts = { .sort_window = 2 };
+    result = each_file_opts("test_directory", count_filters, EF_RECURSE_DIRS | EF_SORT_EXTENT, &opts);
+    assert(result == 0);
+    assert(callback_count == 6);
+}
+
+int manifest_file_callback(struct path_info *path_info, struct stream *stream, void *user_data) {
+    (void)stream;
+    struct manifest *m = (struct manifest *)user_data;
+    assert(manifest_write_result(m, path_info->file_basename, strlen(path_info->file_basename) + 1) == 0);
+    return 0;
+}
+
+int manifest_fail_callback(struct path_info *path_info, struct stream *stream, void *user_data) {
+    manifest_file_callback(path_info, stream, user_data);
+    return strcmp(path_info->file_basename, "text1.txt") ? 0 : EIO;
+}
+
+int manifest_replay_callback(const char *path, const void *result, size_t result_len, void *user_data) {
+    assert(result_len == strlen(result) + 1);
+    assert(!strcmp(strrchr(path, '/') + 1, result));
+    (*(int *)user_data)++;
+    return 0;
+}
+
+int manifest_deleted_callback(const char *path, const void *result, size_t result_len, void *user_data) {
+    (void)path;
+    (void)result;
+    (void)result_len;
+    (*(int *)user_data)++;
+    return 0;
+}
+
+void test_each_file_manifest(void) {
+    remove("test.manifest");
+
+    struct manifest m;
+    assert(manifest_open(&m, "test.manifest", 0) == 0);
+    struct file_type_filter filters[] = {
+        {".txt", manifest_fail_callback, &m},
+        {NULL, NULL, NULL} // End of filter list
+    };
+    struct each_file_options opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.manifest = &m;
+    assert(each_file_opts("test_directory", filters, EF_RECURSE_DIRS, &opts) == 0);
+    assert(manifest_save(&m) == 0);
+    manifest_close(&m);
+
+    // nothing changed, every result is replayed except that of the file whose callback failed
+    int callback_count = 0, replay_count = 0;
+    filters[0].file_cb = mock_file_callback;
+    filters[0].user_data = &callback_count;
+    assert(manifest_open(&m, "test.manifest", 0) == 0);
+    opts.manifest = &m;
+    opts.manifest_replay_cb = manifest_replay_callback;
+    opts.manifest_user_data = &replay_count;
+    assert(each_file_opts("test_directory", filters, EF_RECURSE_DIRS, &opts) == 0);
+    assert(callback_count == 1);
+    assert(replay_count == 4);
+    manifest_close(&m);
+
+    // files outside the walked subdirectory are reported as deleted
+    int deleted_count = 0;
+    assert(manifest_open(&m, "test.manifest", MANIFEST_HASH) == 0);
+    opts.manifest = &m;
+    opts.manifest_replay_cb = 0;
+    opts.manifest_deleted_cb = manifest_deleted_callback;
+    opts.manifest_user_data = &deleted_count;
+    assert(each_file_opts("test_directory/test_subdir", filters, EF_RECURSE_DIRS, &opts) == 0);
+    assert(callback_count == 1);
+    assert(deleted_count == 3);
+    manifest_close(&m);
+
+    remove("test.manifest");
+}
+
+void test_each_file_dir_cache(void) {
+    remove("test.dircache");
+
+    int callback_count = 0;
+    struct file_type_filter filters[] = {
+        {".txt", mock_file_callback, &callback_count},
+        {".jpg", mock_file_callback, &callback_count},
+        {NULL, NULL, NULL} // End of filter list
+    };
+    struct dir_cache cache;
+    assert(dir_cache_open(&cache, "test.dircache") == 0);
+    struct each_file_options opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.dir_cache = &cache;
+    assert(each_file_opts("test_directory", filters, EF_RECURSE_DIRS, &opts) == 0);
+    assert(callback_count == 6);
+    assert(dir_cache_save(&cache) == 0);
+    dir_cache_close(&cache);
+
+    // listings are now expanded from the cache
+    callback_count = 0;
+    assert(dir_cache_open(&cache, "test.dircache") == 0);
+    assert(cache.num_old_dirs == 2);
+    struct stat st;
+    assert(stat("test_directory/test_subdir", &st) == 0);
+    size_t num_entries = 0;
+    assert(dir_cache_lookup(&cache, "test_directory/test_subdir", &st, &num_entries) != NULL);
+    assert(num_entries == 2);
+    assert(each_file_opts("test_directory", filters, EF_RECURSE_DIRS | EF_SORT_INODE, &opts) == 0);
+    assert(callback_count == 6);
+
+    // a directory that changed is read again
+    st.st_ctime++;
+    assert(dir_cache_lookup(&cache, "test_directory/test_subdir", &st, &num_entries) == NULL);
+    dir_cache_close(&cache);
+
+    remove("test.dircache");
+}
+
+int untouched_stream_callback(struct path_info *path_info, struct stream *stream, void *user_data) {
+    (void)path_info;
+    assert(!lazy_stream_is_open((struct lazy_stream *)stream));
+    (*(int *)user_data)++;
+    return 0;
+}
+
+void test_each_file_lazy_stream(void) {
+    int callback_count = 0;
+    struct file_type_filter filters[] = {
+        {".txt", untouched_stream_callback, &callback_count},
+        {NULL, NULL, NULL} // End of filter list
+    };
+    assert(each_file("test_directory", filters, EF_RECURSE_DIRS | EF_RECURSE_ARCHIVES | EF_OPEN_STREAM) == 0);
+    assert(callback_count == 6);
+}
+
+struct read_order {
+    int count;
+    char paths[1024];
+};
+
+int read_order_callback(struct path_info *path_info, struct stream *stream, void *user_data) {
+    struct read_order *o = (struct read_order *)user_data;
+    char buf[4];
+    assert(stream_read(stream, buf, sizeof(buf)) == sizeof(buf));
+    strncat(o->paths, path_info->file_name, sizeof(o->paths) - strlen(o->paths) - 1);
+    o->count++;
+    return 0;
+}
+
+void test_each_file_prefetch(void) {
+    struct read_order serial, prefetched;
+    memset(&serial, 0, sizeof(serial));
+    memset(&prefetched, 0, sizeof(prefetched));
+    struct file_type_filter filters[] = {
+        {".txt", read_order_callback, &serial},
+        {".jpg", read_order_callback, &serial},
+        {NULL, NULL, NULL} // End of filter list
+    };
+    int flags = EF_RECURSE_DIRS | EF_RECURSE_ARCHIVES | EF_OPEN_STREAM;
+    assert(each_file("test_directory", filters, flags) == 0);
+
+    // a budget below one file still lets one file be read ahead
+    filters[0].user_data = filters[1].user_data = &prefetched;
+    struct each_file_options opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.prefetch_depth = 2;
+    opts.prefetch_budget = 1;
+    assert(each_file_opts("test_directory", filters, flags, &opts) == 0);
+    assert(prefetched.count == 7);
+    assert(!strcmp(serial.paths, prefetched.paths));
+}
+
+void test_each_file_shard(void) {
+    int callback_count = 0;
+    struct file_type_filter filters[] = {
+        {".txt", mock_file_callback, &callback_count},
+        {".jpg", mock_file_callback, &callback_count},
+        {NULL, NULL, NULL} // End of filter list
+    };
+    struct each_file_options opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.shard_count = 3;
+
+    // every file is processed by exactly one shard, with files, subtrees or zip entries as the unit
+    for(int mode = 0; mode < 3; mode++) {
+        opts.shard_depth = mode == 1;
+        opts.shard_zip_entries = mode == 2;
+        callback_count = 0;
+        for(opts.shard_index = 0; opts.shard_index < opts.shard_count; opts.shard_index++)
+            assert(each_file_opts("test_directory", filters, EF_RECURSE_DIRS | EF_RECURSE_ARCHIVES | EF_OPEN_STREAM, &opts) == 0);
+        assert(callback_count == 7);
+    }
+}
+
+void test_each_file_checkpoint(void) {
+    int callback_count = 0;
+    struct file_type_filter filters[] = {
+        {".txt", mock_file_callback, &callback_count},
+        {NULL, NULL, NULL} // End of filter list
+    };
+    int flags = EF_RECURSE_DIRS | EF_RECURSE_ARCHIVES | EF_OPEN_STREAM;
+    struct each_file_options opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.checkpoint = "test.checkpoint";
+    opts.checkpoint_interval = 1;
+
+    // a completed walk removes its checkpoint
+    assert(each_file_opts("test_directory", filters, flags, &opts) == 0);
+    assert(callback_count == 6);
+    assert(access("test.checkpoint", F_OK) != 0);
+
+    // in name order, test.zip comes before test_subdir and text1-3.txt
+    struct checkpoint c = { "test_directory", "test_subdir/text4.txt", -1 };
+    assert(checkpoint_save(&c, "test.checkpoint") == 0);
+    callback_count = 0;
+    assert(each_file_resume("test_directory", filters, flags, &opts) == 0);
+    assert(callback_count == 4);
+
+    // the first zip entry is test.txt
+    c.path = "test.zip";
+    c.entry = 0;
+    assert(checkpoint_save(&c, "test.checkpoint") == 0);
+    callback_count = 0;
+    assert(each_file_resume("test_directory", filters, flags, &opts) == 0);
+    assert(callback_count == 5);
+    assert(access("test.checkpoint", F_OK) != 0);
+}
+
+#ifndef WIN32
+void test_each_file_links(void) {
+    mkdir("test_links", 0755);
+    FILE *f = fopen("test_links/a.txt", "w");
+    assert(f);
+    fclose(f);
+    assert(link("test_links/a.txt", "test_links/b.txt") == 0);
+    assert(symlink(".", "test_links/loop") == 0);
+
+    int callback_count = 0;
+    struct file_type_filter filters[] = {
+        {".txt", mock_file_callback, &callback_count},
+        {NULL, NULL, NULL} // End of filter list
+    };
+    assert(each_file("test_links", filters, EF_RECURSE_DIRS | EF_SKIP_HARDLINKS | EF_SKIP_VISITED_DIRS) == 0);
+    assert(callback_count == 1);
+
+    // the symbolic link is a directory on the same filesystem, so only EF_SKIP_VISITED_DIRS stops the loop
+    callback_count = 0;
+    assert(each_file("test_links", filters, EF_RECURSE_DIRS | EF_ONE_FILESYSTEM | EF_SKIP_VISITED_DIRS) == 0);
+    assert(callback_count == 2);
+
+    unlink("test_links/loop");
+    unlink("test_links/b.txt");
+    unlink("test_links/a.txt");
+    rmdir("test_links");
+}
+
+void write_dedup_file(const char *path, size_t size, size_t changed) {
+    FILE *f = fopen(path, "wb");
+    assert(f);
+    for(size_t i = 0; i < size; i++)
+        fputc(i == changed ? 'y' : 'x', f);
+    fclose(f);
+}
+
+int dedup_set_callback(const struct each_file_dedup_item *items, size_t num_items, void *user_data) {
+    int *sets = (int *)user_data;
+    assert(num_items == 2);
+    assert(items[0].size == items[1].size);
+    for(size_t i = 0; i < num_items; i++) {
+        assert(!items[i].entry);
+        assert(!strstr(items[i].path, "c.txt") && !strstr(items[i].path, "big3.dat"));
+    }
+    (*sets)++;
+    return 0;
+}
+
+#ifdef HAVE_LIBZIP
+static uint32_t test_crc32(const uint8_t *data, size_t len) {
+    uint32_t crc = 0xffffffff;
+    for(size_t i = 0; i < len; i++) {
+        crc ^= data[i];
+        for(int k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+static void put16(uint8_t *p, uint16_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    put16(p, v);
+    put16(p + 2, v >> 16);
+}
+
+// write an archive with a single stored entry
+void write_stored_zip(const char *path, const char *name, const uint8_t *data, uint32_t len) {
+    uint16_t name_len = strlen(name);
+    uint32_t crc = test_crc32(data, len);
+    uint8_t local[30], central[46], end[22];
+    memset(local, 0, sizeof(local));
+    put32(local, 0x04034b50);
+    put16(local + 4, 10);
+    put32(local + 14, crc);
+    put32(local + 18, len);
+    put32(local + 22, len);
+    put16(local + 26, name_len);
+    memset(central, 0, sizeof(central));
+    put32(central, 0x02014b50);
+    put16(central + 4, 10);
+    put16(central + 6, 10);
+    put32(central + 16, crc);
+    put32(central + 20, len);
+    put32(central + 24, len);
+    put16(central + 28, name_len);
+    memset(end, 0, sizeof(end));
+    put32(end, 0x06054b50);
+    put16(end + 8, 1);
+    put16(end + 10, 1);
+    put32(end + 12, sizeof(central) + name_len);
+    put32(end + 16, sizeof(local) + name_len + len);
+    FILE *f = fopen(path, "wb");
+    assert(f);
+    fwrite(local, 1, sizeof(local), f);
+    fwrite(name, 1, name_len, f);
+    fwrite(data, 1, len, f);
+    fwrite(central, 1, sizeof(central), f);
+    fwrite(name, 1, name_len, f);
+    fwrite(end, 1, sizeof(end), f);
+    fclose(f);
+}
+
+int dedup_mixed_callback(const struct each_file_dedup_item *items, size_t num_items, void *user_data) {
+    assert(num_items == 2);
+    assert(!items[0].entry != !items[1].entry);
+    (*(int *)user_data)++;
+    return 0;
+}
+#endif
+
+void test_each_file_dedup(void) {
+    struct file_type_filter filters[] = {
+        {".txt", mock_file_callback, NULL},
+        {".jpg", mock_file_callback, NULL},
+        {".png", mock_file_callback, NULL},
+        {".dat", mock_file_callback, NULL},
+        {NULL, NULL, NULL} // End of filter list
+    };
+    int flags = EF_RECURSE_DIRS | EF_RECURSE_ARCHIVES | EF_OPEN_STREAM;
+    struct each_file_dedup dedup;
+    assert(each_file_dedup_init(&dedup) == 0);
+    struct each_file_options opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.dedup = &dedup;
+
+    // same sizes but no duplicates, nothing larger than the partial hash is read twice
+    int sets = 0;
+    assert(each_file_opts("test_directory", filters, flags, &opts) == 0);
+    assert(dedup.num_candidates == 8);
+    assert(each_file_dedup_report(&dedup, dedup_set_callback, &sets) == 0);
+    assert(sets == 0);
+    assert(dedup.bytes_hashed == 5 * 7 + 2 * 9);
+    each_file_dedup_free(&dedup);
+
+    // big3.dat only differs in the middle, which the partial hash does not cover
+    mkdir("test_dedup", 0755);
+    write_dedup_file("test_dedup/a.txt", 6, 6);
+    write_dedup_file("test_dedup/b.txt", 6, 6);
+    write_dedup_file("test_dedup/c.txt", 6, 0);
+    write_dedup_file("test_dedup/big1.dat", 20000, 20000);
+    write_dedup_file("test_dedup/big2.dat", 20000, 20000);
+    write_dedup_file("test_dedup/big3.dat", 20000, 10000);
+    assert(each_file_dedup_init(&dedup) == 0);
+    assert(each_file_opts("test_dedup", filters, flags, &opts) == 0);
+    assert(each_file_dedup_report(&dedup, dedup_set_callback, &sets) == 0);
+    assert(sets == 2);
+    // the members of each set are also compared with each other
+    assert(dedup.bytes_hashed == 3 * 6 + 3 * 2 * DEDUP_PARTIAL_BYTES + 3 * 20000 + 2 * 6 + 2 * 20000);
+    each_file_dedup_free(&dedup);
+
+    const char *names[] = { "a.txt", "b.txt", "c.txt", "big1.dat", "big2.dat", "big3.dat" };
+    for(size_t i = 0; i < sizeof(names) / sizeof(*names); i++) {
+        char path[64];
+        snprintf(path, sizeof(path), "test_dedup/%s", names[i]);
+        unlink(path);
+    }
+#ifdef HAVE_LIBZIP
+    // a file and a zip entry with the same content larger than the partial hash are hashed over the same bytes
+    uint8_t data[20000];
+    memset(data, 'x', sizeof(data));
+    write_dedup_file("test_dedup/big1.dat", sizeof(data), sizeof(data));
+    write_stored_zip("test_dedup/big.zip", "big4.dat", data, sizeof(data));
+    sets = 0;
+    assert(each_file_dedup_init(&dedup) == 0);
+    assert(each_file_opts("test_dedup", filters, flags, &opts) == 0);
+    assert(dedup.num_candidates == 2);
+    assert(each_file_dedup_report(&dedup, dedup_mixed_callback, &sets) == 0);
+    assert(sets == 1);
+    each_file_dedup_free(&dedup);
+    unlink("test_dedup/big1.dat");
+    unlink("test_dedup/big.zip");
+#endif
+    rmdir("test_dedup");
+}
+#endif
+
+int stop_callback(struct path_info *path_info, struct stream *stream, void *user_data) {
+    (void)stream;
+    (void)path_info;
+    int *count = (int *)user_data;
+    return ++(*count) == 2 ? EF_STOP : EF_CONTINUE;
+}
+
+int skip_siblings_callback(struct path_info *path_info, struct stream *stream, void *user_data) {
+    (void)stream;
+    (void)path_info;
+    int *count = (int *)user_data;
+    (*count)++;
+    return EF_SKIP_SIBLINGS;
+}
+
+int prune_subdir_callback(const char *path, void *user_data) {
+    (void)user_data;
+    return strstr(path, "test_subdir") ? EF_SKIP_SUBTREE : EF_CONTINUE;
+}
+
+void test_each_file_control(void) {
+    int callback_count = 0;
+    struct file_type_filter filters[] = {
+        {".txt", stop_callback, &callback_count},
+        {NULL, NULL, NULL} // End of filter list
+    };
+    struct each_file_options opts;
+    memset(&opts, 0, sizeof(opts));
+    assert(each_file("test_directory", filters, EF_RECURSE_DIRS) == 0);
+    assert(callback_count == 2);
+
+    // the first file of each directory ends it, with and without prefetching
+    for(opts.prefetch_depth = 0; opts.prefetch_depth <= 4; opts.prefetch_depth += 4) {
+        callback_count = 0;
+        filters[0].file_cb = skip_siblings_callback;
+        assert(each_file_opts("test_directory", filters, EF_RECURSE_DIRS | EF_OPEN_STREAM, &opts) == 0);
+        assert(callback_count == 1 || callback_count == 2);
+    }
+
+    callback_count = 0;
+    filters[0].file_cb = mock_file_callback;
+    opts.prefetch_depth = 0;
+    opts.dir_cb = prune_subdir_callback;
+    assert(each_file_opts("test_directory", filters, EF_RECURSE_DIRS, &opts) == 0);
+    assert(callback_count == 3);
+#ifdef HAVE_LIBZIP
+    // an entry stopping the walk still closes its archive
+    // the only .png is in test.zip
+    callback_count = 1;
+    filters[0].ext = ".png";
+    filters[0].file_cb = stop_callback;
+    assert(each_file("test_directory", filters, EF_RECURSE_DIRS | EF_RECURSE_ARCHIVES | EF_OPEN_STREAM) == 0);
+    assert(callback_count == 2);
+#endif
+}
+
+void test_each_file_iter(void) {
+    struct file_type_filter filters[] = {
+        {".txt", NULL, NULL},
+        {".png", NULL, NULL},
+        {NULL, NULL, NULL} // End of filter list
+    };
+    struct each_file_iter iter;
+    int count = 0;
+    size_t bytes = 0;
+    assert(each_file_iter_init(&iter, "test_directory", filters, EF_RECURSE_DIRS | EF_OPEN_STREAM, NULL) == 0);
+    while(!each_file_iter_next(&iter) && iter.info) {
+        assert(iter.filter == &filters[0]);
+        char buf[256];
+        ssize_t n;
+        while((n = stream_read(iter.stream, buf, sizeof(buf))) > 0)
+            bytes += n;
+        count++;
+    }
+    assert(!iter.info);
+    each_file_iter_free(&iter);
+    assert(count == 5);
+    assert(bytes == 5 * 7);
+
+    // the result of an entry controls the walk as a callback result would
+    count = 0;
+    assert(each_file_iter_init(&iter, "test_directory", filters, EF_RECURSE_DIRS, NULL) == 0);
+    while(!each_file_iter_next(&iter) && iter.info) {
+        assert(!iter.stream);
+        iter.result = EF_SKIP_SIBLINGS;
+        count++;
+    }
+    assert(count == 1 || count == 2);
+    assert(each_file_iter_init(&iter, "test_directory", filters, EF_RECURSE_DIRS, NULL) == 0);
+    assert(!each_file_iter_next(&iter) && iter.info);
+    iter.result = EF_STOP;
+    assert(!each_file_iter_next(&iter) && !iter.info);
+
+    // leaving early ends the walk
+    assert(each_file_iter_init(&iter, "test_directory", filters, EF_RECURSE_DIRS | EF_OPEN_STREAM, NULL) == 0);
+    assert(!each_file_iter_next(&iter) && iter.info);
+    each_file_iter_free(&iter);
+    assert(!iter.walk);
+
+    assert(each_file_iter_init(&iter, "does_not_exist", filters, EF_RECURSE_DIRS, NULL) == ENOENT);
+    struct each_file_options opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.threads = 2;
+    assert(each_file_iter_init(&iter, "test_directory", filters, EF_RECURSE_DIRS, &opts) == EINVAL);
+    // a root file that matches nothing is an empty walk
+    assert(each_file_iter_init(&iter, "test_directory/test.jpg", filters, 0, NULL) == 0);
+    assert(!each_file_iter_next(&iter) && !iter.info);
+#ifdef HAVE_LIBZIP
+    // entries of an archive are returned in turn, skipping the siblings of one skips the rest of the archive
+    int entries = 0;
+    count = 0;
+    assert(each_file_iter_init(&iter, "test_directory", filters, EF_RECURSE_DIRS | EF_RECURSE_ARCHIVES | EF_OPEN_STREAM, NULL) == 0);
+    while(!each_file_iter_next(&iter) && iter.info) {
+        if(iter.info->zip_file_name) {
+            assert(!strcmp(iter.info->zip_file_base, "test"));
+            iter.result = EF_SKIP_SIBLINGS;
+            entries++;
+        }
+        count++;
+    }
+    assert(entries == 1);
+    assert(count == 6);
+    // leaving in the middle of an archive closes it
+    assert(each_file_iter_init(&iter, "test_directory/test.zip", filters, EF_RECURSE_ARCHIVES | EF_OPEN_STREAM, NULL) == 0);
+    assert(!each_file_iter_next(&iter) && iter.info);
+    assert(iter.info->zip_file_name);
+    each_file_iter_free(&iter);
+#endif
+}
+
+int count_dir_callback(const char *path, void *user_data) {
+    (void)path;
+    int *count = (int *)user_data;
+    (*count)++;
+    return EF_CONTINUE;
+}
+
+void test_each_file_predicate(void) {
+    int callback_count = 0, dir_count = 0;
+    struct file_type_filter filters[] = {
+        {".txt", mock_file_callback, &callback_count},
+        {NULL, NULL, NULL} // End of filter list
+    };
+    int flags = EF_RECURSE_DIRS | EF_RECURSE_ARCHIVES | EF_OPEN_STREAM;
+    struct each_file_options opts;
+    memset(&opts, 0, sizeof(opts));
+    struct predicate pred;
+    opts.predicate = &pred;
+    opts.dir_cb = count_dir_callback;
+    opts.dir_user_data = &dir_count;
+
+    // a single component glob prunes every subdirectory and archive before it is read
+    struct predicate_spec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.glob = "text[1-2].txt";
+    assert(predicate_compile(&pred, &spec) == 0);
+    assert(each_file_opts("test_directory", filters, flags, &opts) == 0);
+    assert(callback_count == 2);
+    assert(dir_count == 1);
+    predicate_free(&pred);
+
+    const char *exclude[] = { "test_subdir/", NULL };
+    memset(&spec, 0, sizeof(spec));
+    spec.glob = "**/*.txt";
+    spec.exclude = exclude;
+    assert(predicate_compile(&pred, &spec) == 0);
+    callback_count = dir_count = 0;
+    assert(each_file_opts("test_directory", filters, flags, &opts) == 0);
+    assert(callback_count == 4);
+    assert(dir_count == 1);
+    predicate_free(&pred);
+
+    const char *include[] = { "test_subdir", NULL };
+    memset(&spec, 0, sizeof(spec));
+    spec.include = include;
+    spec.regex = "text[45]";
+    spec.min_size = 1;
+    assert(predicate_compile(&pred, &spec) == 0);
+    callback_count = dir_count = 0;
+    assert(each_file_opts("test_directory", filters, flags, &opts) == 0);
+    assert(callback_count == 2);
+    assert(dir_count == 2);
+    predicate_free(&pred);
+}
+
+int read_all_callback(struct path_info *path_info, struct stream *stream, void *user_data) {
+    (void)path_info;
+    char buf[256];
+    while(stream_read(stream, buf, sizeof(buf)) > 0);
+    int *count = (int *)user_data;
+    (*count)++;
+    return 0;
+}
+
+void test_each_file_stats(void) {
+    int callback_count = 0;
+    struct file_type_filter filters[] = {
+        {".txt", read_all_callback, &callback_count},
+        {".jpg", read_all_callback, &callback_count},
+        {NULL, NULL, NULL} // End of filter list
+    };
+    struct each_file_stats stats;
+    assert(each_file_stats_init(&stats, 2) == 0);
+    struct each_file_options opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.stats = &stats;
+    opts.stats_json = "test.stats.json";
+    assert(each_file_opts("test_directory", filters, EF_RECURSE_DIRS | EF_RECURSE_ARCHIVES | EF_OPEN_STREAM, &opts) == 0);
+    assert(callback_count == 7);
+    assert(stats.dirs == 2);
+    assert(stats.files == 7);
+    assert(stats.archives == 1);
+    assert(stats.archive_entries == 1);
+    assert(stats.bytes_read > 0);
+    assert(stats.num_slowest_files == 2);
+    assert(stats.slowest_files[0].ns >= stats.slowest_files[1].ns);
+    assert(stats.num_slowest_dirs == 2);
+    each_file_stats_free(&stats);
+
+    // plain files read with EF_TRANSPARENT_GZIP are not decompressed
+    assert(each_file_stats_init(&stats, 2) == 0);
+    opts.stats_json = 0;
+    assert(each_file_opts("test_directory", filters, EF_RECURSE_DIRS | EF_OPEN_STREAM | EF_TRANSPARENT_GZIP, &opts) == 0);
+    assert(stats.phase_ns[EF_PHASE_READ] > 0);
+    assert(stats.phase_ns[EF_PHASE_DECOMPRESS] == 0);
+    each_file_stats_free(&stats);
+
+    struct file_stream s;
+    assert(file_stream_init(&s, "test.stats.json", "rb", 0) == 0);
+    char c = 0;
+    assert(stream_read(&s.stream, &c, 1) == 1 && c == '{');
+    stream_close(&s.stream);
+    remove("test.stats.json");
+}
+
+int atomic_count_callback(struct path_info *path_info, struct stream *stream, void *user_data) {
+    (void)path_info;
+    (void)stream;
+    __atomic_fetch_add((int *)user_data, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int chunk_callback(struct path_info *path_info, struct stream *stream, uint64_t offset, uint64_t size, void *user_data) {
+    (void)path_info;
+    char buf[16];
+    assert(size <= sizeof(buf));
+    assert(stream_tell(stream) == (long)offset);
+    assert(stream_read(stream, buf, size) == (ssize_t)size);
+    __atomic_fetch_add((int *)user_data, (int)size, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void test_each_file_parallel(void) {
+    int callback_count = 0, chunk_bytes = 0;
+    struct file_type_filter filters[] = {
+        {".txt", atomic_count_callback, &callback_count},
+        {".jpg", atomic_count_callback, &callback_count},
+        {NULL, NULL, NULL} // End of filter list
+    };
+    int flags = EF_RECURSE_DIRS | EF_RECURSE_ARCHIVES | EF_OPEN_STREAM | EF_LARGEST_FIRST;
+    struct each_file_options opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.threads = 4;
+    opts.schedule_window = 2;
+    assert(each_file_opts("test_directory", filters, flags, &opts) == 0);
+    assert(callback_count == 7);
+
+    // every file but the 25 byte zip entry is split, entries are never
+    callback_count = 0;
+    opts.chunk_size = 3;
+    opts.chunk_cb = chunk_callback;
+    opts.chunk_user_data = &chunk_bytes;
+    assert(each_file_opts("test_directory", filters, flags, &opts) == 0);
+    assert(callback_count == 1);
+    assert(chunk_bytes == 5 * 7 + 9);
+
+    struct manifest manifest;
+    memset(&manifest, 0, sizeof(manifest));
+    opts.manifest = &manifest;
+    assert(each_file_opts("test_directory", filters, flags, &opts) == EINVAL);
+}
+
+int ordered_output_callback(struct path_info *path_info, struct stream *stream, void *user_data) {
+    (void)stream;
+    (void)user_data;
+    stream_printf(path_info->output, "%s/%s\n", path_info->zip_file_name ? path_info->zip_file_name : "", path_info->file_name);
+    return 0;
+}
+
+void test_each_file_ordered(void) {
+    struct file_type_filter filters[] = {
+        {".txt", ordered_output_callback, NULL},
+        {".jpg", ordered_output_callback, NULL},
+        {NULL, NULL, NULL} // End of filter list
+    };
+    int flags = EF_RECURSE_DIRS | EF_RECURSE_ARCHIVES | EF_OPEN_STREAM;
+    struct each_file_options opts;
+    memset(&opts, 0, sizeof(opts));
+    struct mem_stream sequential, parallel;
+    mem_stream_init(&sequential, 0, 0, 0);
+    opts.output = &sequential.stream;
+    assert(each_file_opts("test_directory", filters, flags, &opts) == 0);
+    assert(sequential.data_len > 0);
+
+    // the output is byte-identical whatever order the callbacks ran in
+    opts.threads = 4;
+    opts.schedule_window = 1;
+    for(int largest_first = 0; largest_first < 2; largest_first++) {
+        mem_stream_init(&parallel, 0, 0, 0);
+        opts.output = &parallel.stream;
+        assert(each_file_opts("test_directory", filters, flags | (largest_first ? EF_LARGEST_FIRST : 0), &opts) == 0);
+        assert(parallel.data_len == sequential.data_len);
+        assert(!memcmp(parallel.data, sequential.data, sequential.data_len));
+        stream_close(&parallel.stream);
+    }
+#ifndef WIN32
+    // and with worker processes, which send the output of each file back with its result
+    opts.threads = 0;
+    opts.processes = 3;
+    for(opts.process_batch = 1; opts.process_batch <= 2; opts.process_batch++) {
+        mem_stream_init(&parallel, 0, 0, 0);
+        opts.output = &parallel.stream;
+        assert(each_file_opts("test_directory", filters, flags, &opts) == 0);
+        assert(parallel.data_len == sequential.data_len);
+        assert(!memcmp(parallel.data, sequential.data, sequential.data_len));
+        stream_close(&parallel.stream);
+    }
+#endif
+    stream_close(&sequential.stream);
+}
+
+struct batch_counts {
+    int batches, entries, zip_entries;
+};
+
+int batch_callback(struct each_file_entry *entries, size_t num_entries, void *user_data) {
+    struct batch_counts *counts = (struct batch_counts *)user_data;
+    assert(num_entries > 0 && num_entries <= 3);
+    for(size_t i = 0; i < num_entries; i++) {
+        char buf[32];
+        assert(stream_read(entries[i].stream, buf, sizeof(buf)) == (ssize_t)entries[i].st.st_size);
+        if(entries[i].entry) {
+            assert(!strcmp(entries[i].entry, "test.txt"));
+            counts->zip_entries++;
+        }
+    }
+    counts->batches++;
+    counts->entries += num_entries;
+    return 0;
+}
+
+void test_each_file_batch(void) {
+    struct file_type_filter filters[] = {
+        {".txt", mock_file_callback, NULL},
+        {".jpg", mock_file_callback, NULL},
+        {NULL, NULL, NULL} // End of filter list
+    };
+    struct batch_counts counts;
+    memset(&counts, 0, sizeof(counts));
+    struct each_file_options opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.batch_cb = batch_callback;
+    opts.batch_user_data = &counts;
+    opts.batch_size = 3;
+    assert(each_file_opts("test_directory", filters, EF_RECURSE_DIRS | EF_RECURSE_ARCHIVES | EF_OPEN_STREAM, &opts) == 0);
+    assert(counts.entries == 7);
+    assert(counts.zip_entries == 1);
+    assert(counts.batches >= 3);
+}
+
+void test_each_file_snapshot(void) {
+    int callback_count = 0;
+    struct file_type_filter filters[] = {
+        {".txt", read_all_callback, &callback_count},
+        {".jpg", read_all_callback, &callback_count},
+        {NULL, NULL, NULL} // End of filter list
+    };
+    int flags = EF_RECURSE_DIRS | EF_RECURSE_ARCHIVES | EF_OPEN_STREAM;
+    struct snapshot snapshot;
+    assert(snapshot_scan(&snapshot, "test_directory", EF_RECURSE_DIRS | EF_RECURSE_ARCHIVES) == 0);
+    assert(!strcmp(snapshot_name(&snapshot, 0), "test_directory"));
+    assert(snapshot_each_file(&snapshot, filters, flags, NULL) == 0);
+    assert(callback_count == 7);
+    assert(snapshot_save(&snapshot, "test_snapshot.bin") == 0);
+    snapshot_free(&snapshot);
+
+    // the saved snapshot answers the same queries, filtered without touching the tree
+    const char *exclude[] = { "test_subdir/", NULL };
+    struct predicate_spec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.glob = "**/*.txt";
+    spec.exclude = exclude;
+    struct predicate pred;
+    assert(predicate_compile(&pred, &spec) == 0);
+    assert(snapshot_open(&snapshot, "test_snapshot.bin") == 0);
+    callback_count = 0;
+    assert(snapshot_each_file(&snapshot, filters, flags, &pred) == 0);
+    assert(callback_count == 4);
+    callback_count = 0;
+    assert(snapshot_each_file(&snapshot, filters, EF_RECURSE_DIRS | EF_OPEN_STREAM, NULL) == 0);
+    assert(callback_count == 6);
+    snapshot_free(&snapshot);
+    predicate_free(&pred);
+
+    FILE *f = fopen("test_snapshot.bin", "r+b");
+    assert(f);
+    fputc('X', f);
+    fclose(f);
+    assert(snapshot_open(&snapshot, "test_snapshot.bin") == EINVAL);
+    remove("test_snapshot.bin");
+}
+
+struct reduce_acc {
+    uint64_t files, bytes;
+};
+
+void reduce_init(void *acc, void *user_data) {
+    (void)user_data;
+    memset(acc, 0, sizeof(struct reduce_acc));
+}
+
+void reduce_merge(void *into, void *from, void *user_data) {
+    (void)user_data;
+    struct reduce_acc *a = (struct reduce_acc *)into, *b = (struct reduce_acc *)from;
+    a->files += b->files;
+    a->bytes += b->bytes;
+}
+
+int reduce_callback(struct path_info *path_info, struct stream *stream, void *user_data) {
+    (void)user_data;
+    struct reduce_acc *acc = (struct reduce_acc *)path_info->acc;
+    char buf[256];
+    ssize_t n;
+    while((n = stream_read(stream, buf, sizeof(buf))) > 0)
+        acc->bytes += n;
+    acc->files++;
+    return 0;
+}
+
+#ifndef WIN32
+int reduce_crash_callback(struct path_info *path_info, struct stream *stream, void *user_data) {
+    if(!strcmp(path_info->file_basename, "text4.txt"))
+        kill(getpid(), SIGKILL);
+    return reduce_callback(path_info, stream, user_data);
+}
+#endif
+
+void test_each_file_reduce(void) {
+    struct file_type_filter filters[] = {
+        {".txt", reduce_callback, NULL},
+        {".jpg", reduce_callback, NULL},
+        {NULL, NULL, NULL} // End of filter list
+    };
+    int flags = EF_RECURSE_DIRS | EF_RECURSE_ARCHIVES | EF_OPEN_STREAM;
+    struct reduce_acc sequential, parallel;
+    struct each_file_reduce reduce = { sizeof(struct reduce_acc), reduce_init, reduce_merge, NULL, &sequential };
+    struct each_file_options opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.reduce = &reduce;
+    assert(each_file_opts("test_directory", filters, flags, &opts) == 0);
+    assert(sequential.files == 7);
+
+    // every worker accumulates on its own, the merged result is the same
+    reduce.result = &parallel;
+    opts.threads = 4;
+    opts.schedule_window = 1;
+    assert(each_file_opts("test_directory", filters, flags, &opts) == 0);
+    assert(parallel.files == sequential.files);
+    assert(parallel.bytes == sequential.bytes);
+#ifndef WIN32
+    // and so does every worker process, whose accumulator is sent back when it exits
+    memset(&parallel, 0, sizeof(parallel));
+    opts.threads = 0;
+    opts.processes = 3;
+    opts.process_batch = 2;
+    assert(each_file_opts("test_directory", filters, flags, &opts) == 0);
+    assert(parallel.files == sequential.files);
+    assert(parallel.bytes == sequential.bytes);
+
+    // a worker that dies loses what it accumulated, the walk fails instead of returning a partial result
+    filters[0].file_cb = reduce_crash_callback;
+    assert(each_file_opts("test_directory", filters, flags, &opts) == ECHILD);
+    filters[0].file_cb = reduce_callback;
+#endif
+
+    reduce.merge = NULL;
+    assert(each_file_opts("test_directory", filters, flags, &opts) == EINVAL);
+}
+
+void test_each_file_throttle(void) {
+    struct file_type_filter filters[] = {
+        {".txt", reduce_callback, NULL},
+        {".jpg", reduce_callback, NULL},
+        {NULL, NULL, NULL} // End of filter list
+    };
+    struct reduce_acc acc;
+    struct each_file_reduce reduce = { sizeof(struct reduce_acc), reduce_init, reduce_merge, NULL, &acc };
+    struct each_file_options opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.reduce = &reduce;
+    opts.ioprio = EF_IOPRIO_IDLE;
+    opts.max_opens_per_sec = 4;
+    opts.max_bytes_per_sec = 1 << 20;
+
+    // the 7 entries and the archive take at least 4 opens past the first second's worth
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    assert(each_file_opts("test_directory", filters, EF_RECURSE_DIRS | EF_RECURSE_ARCHIVES | EF_OPEN_STREAM, &opts) == 0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    assert(acc.files == 7);
+    assert((end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000 >= 750);
+
+    opts.ioprio = 3;
+    assert(each_file_opts("test_directory", filters, EF_RECURSE_DIRS, &opts) == EINVAL);
+}
+
+struct sample_count {
+    int files;
+    double weight;
+};
+
+int sample_callback(struct path_info *path_info, struct stream *stream, void *user_data) {
+    (void)stream;
+    struct sample_count *c = (struct sample_count *)user_data;
+    c->files++;
+    c->weight += path_info->weight;
+    return 0;
+}
+
+void test_each_file_sample(void) {
+    struct sample_count c = { 0, 0 };
+    struct file_type_filter filters[] = {
+        {".txt", sample_callback, &c},
+        {".jpg", sample_callback, &c},
+        {NULL, NULL, NULL} // End of filter list
+    };
+    struct each_file_sample sample;
+    memset(&sample, 0, sizeof(sample));
+    struct each_file_options opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.sample = &sample;
+
+    // one file of each directory, weighted by the number of files it stands for
+    sample.dir_reservoir = 1;
+    assert(each_file_opts("test_directory", filters, EF_RECURSE_DIRS, &opts) == 0);
+    assert(c.files == 2);
+    assert(c.weight == 6);
+
+    // the only subdirectory is always walked
+    memset(&c, 0, sizeof(c));
+    sample.dir_reservoir = 0;
+    sample.subdir_rate = 0.5;
+    assert(each_file_opts("test_directory", filters, EF_RECURSE_DIRS, &opts) == 0);
+    assert(c.files == 6);
+    assert(c.weight == 6);
+
+    // the same seed takes the same sample
+    memset(&c, 0, sizeof(c));
+    sample.subdir_rate = 0;
+    sample.file_rate = 0.5;
+    sample.seed = 42;
+    assert(each_file_opts("test_directory", filters, EF_RECURSE_DIRS, &opts) == 0);
+    struct sample_count first = c;
+    assert(first.files > 0 && first.files < 6);
+    assert(first.weight == 2 * first.files);
+    memset(&c, 0, sizeof(c));
+    assert(each_file_opts("test_directory", filters, EF_RECURSE_DIRS, &opts) == 0);
+    assert(c.files == first.files);
+
+    sample.file_rate = 1.5;
+    assert(each_file_opts("test_directory", filters, EF_RECURSE_DIRS, &opts) == EINVAL);
+}
+
+#ifndef WIN32
+// callbacks run in worker processes and report through a pipe
+static int process_pipe[2];
+
+int process_callback(struct path_info *path_info, struct stream *stream, void *user_data) {
+    (void)user_data;
+    char buf[256];
+    while(stream_read(stream, buf, sizeof(buf)) > 0);
+    if(!strcmp(path_info->file_basename, "text4.txt"))
+        kill(getpid(), SIGKILL);
+    assert(write(process_pipe[1], "x", 1) == 1);
+    return 0;
+}
+
+void process_crash_callback(const char *path, const char *entry, int status, void *user_data) {
+    assert(!entry);
+    assert(strstr(path, "text4.txt"));
+    assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL);
+    (*(int *)user_data)++;
+}
+
+void test_each_file_processes(void) {
+    struct file_type_filter filters[] = {
+        {".txt", process_callback, NULL},
+        {".jpg", process_callback, NULL},
+        {NULL, NULL, NULL} // End of filter list
+    };
+    int crashes = 0;
+    struct each_file_options opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.processes = 3;
+    opts.process_batch = 2;
+    opts.process_crash_cb = process_crash_callback;
+    opts.process_crash_user_data = &crashes;
+    assert(pipe(process_pipe) == 0);
+    assert(each_file_opts("test_directory", filters, EF_RECURSE_DIRS | EF_RECURSE_ARCHIVES | EF_OPEN_STREAM, &opts) == 0);
+    close(process_pipe[1]);
+
+    // the worker that died on text4.txt was replaced and the rest of its batch still ran
+    char buf[16];
+    ssize_t n, total = 0;
+    while((n = read(process_pipe[0], buf, sizeof(buf))) > 0)
+        total += n;
+    close(process_pipe[0]);
+    assert(total == 6);
+    assert(crashes == 1);
+
+    opts.threads = 2;
+    assert(each_file_opts("test_directory", filters, EF_RECURSE_DIRS, &opts) == EINVAL);
+}
+#endif
+
+void test_each_file_magic(void) {
+    int callback_count = 0;
+    struct file_type_filter filters[] = {
+        {".bin", mock_file_callback, &callback_count},
+        {NULL, NULL, NULL} // End of filter list
+    };
+    struct file_magic magic[] = {
+        { 5, "jpg", NULL, 3, &filters[0] },
+        { 0, NULL, NULL, 0, NULL },
+    };
+    struct each_file_options opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.magic = magic;
+    assert(each_file_opts("test_directory", filters, EF_RECURSE_DIRS, &opts) == 0);
+    assert(callback_count == 1);
+
+    // "test" and "text" both match "te?t"
+    callback_count = 0;
+    struct file_magic masked[] = {
+        { 0, "te\0t", "\xff\xff\x00\xff", 4, &filters[0] },
+        { 0, NULL, NULL, 0, NULL },
+    };
+    opts.magic = masked;
+    assert(each_file_opts("test_directory", filters, EF_RECURSE_DIRS | EF_OPEN_STREAM, &opts) == 0);
+    assert(callback_count == 6);
+    assert(each_file_opts("test_directory/text1.txt", filters, 0, &opts) == 0);
+    assert(callback_count == 7);
+
+    // sniffing is timed apart from reading the directories
+    struct each_file_stats stats;
+    assert(each_file_stats_init(&stats, 2) == 0);
+    opts.stats = &stats;
+    assert(each_file_opts("test_directory", filters, EF_RECURSE_DIRS, &opts) == 0);
+    assert(stats.phase_ns[EF_PHASE_PREPARE] > 0);
+    assert(stats.phase_ns[EF_PHASE_ENUMERATE] > 0);
+    each_file_stats_free(&stats);
+}
+
+#ifdef __linux__
+struct watch_count {
+    struct each_file_watch *watch;
+    int count;
+};
+
+int watch_file_callback(struct path_info *path_info, struct stream *stream, void *user_data) {
+    (void)stream;
+    (void)path_info;
+    struct watch_count *c = (struct watch_count *)user_data;
+    if(++c->count == 2)
+        each_file_watch_stop(c->watch);
+    return 0;
+}
+
+int watch_stop_callback(struct path_info *path_info, struct stream *stream, void *user_data) {
+    (void)stream;
+    assert(!strcmp(path_info->file_basename, "e.txt"));
+    (*(int *)user_data)++;
+    return EF_STOP;
+}
+
+static void write_test_file(const char *path) {
+    FILE *f = fopen(path, "w");
+    assert(f);
+    fputs("test", f);
+    fclose(f);
+}
+
+void test_each_file_watch(void) {
+    mkdir("test_watch", 0755);
+    struct each_file_watch watch;
+    struct watch_count c = { &watch, 0 };
+    struct file_type_filter filters[] = {
+        {".txt", watch_file_callback, &c},
+        {NULL, NULL, NULL} // End of filter list
+    };
+    assert(each_file_watch_init(&watch, "test_watch", filters, 0, NULL) == 0);
+    assert(c.count == 0);
+
+    // a written file and a new directory, whose contents are picked up by walking it
+    write_test_file("test_watch/a.txt");
+    mkdir("test_watch/sub", 0755);
+    write_test_file("test_watch/sub/b.txt");
+    write_test_file("test_watch/sub/c.jpg");
+    assert(each_file_watch_run(&watch, 10) == 0);
+    assert(c.count == 2);
+    each_file_watch_close(&watch);
+
+    // events are matched by their path below the root, and a callback can end the watch
+    unlink("test_watch/sub/b.txt");
+    int stop_count = 0;
+    filters[0].file_cb = watch_stop_callback;
+    filters[0].user_data = &stop_count;
+    struct predicate pred;
+    struct predicate_spec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.glob = "sub/*.txt";
+    assert(predicate_compile(&pred, &spec) == 0);
+    struct each_file_options opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.predicate = &pred;
+    assert(each_file_watch_init(&watch, "test_watch", filters, 0, &opts) == 0);
+    write_test_file("test_watch/d.txt");
+    write_test_file("test_watch/sub/e.txt");
+    assert(each_file_watch_run(&watch, 10) == 0);
+    assert(stop_count == 1);
+    each_file_watch_close(&watch);
+    predicate_free(&pred);
+
+    unlink("test_watch/sub/e.txt");
+    unlink("test_watch/d.txt");
+    unlink("test_watch/sub/c.jpg");
+    rmdir("test_watch/sub");
+    unlink("test_watch/a.txt");
+
+    // a file in a directory that is walked is not dispatched again, even
+    // when a sibling such as "m-x" sorts between them by strcmp
+    mkdir("test_watch/m", 0755);
+    c.count = 0;
+    filters[0].file_cb = watch_file_callback;
+    filters[0].user_data = &c;
+    assert(each_file_watch_init(&watch, "test_watch", filters, 0, NULL) == 0);
+    assert(c.count == 0);
+    write_test_file("test_watch/m/f.txt");
+    assert(rename("test_watch/m", "test_watch/n") == 0);
+    assert(rename("test_watch/n", "test_watch/m") == 0);
+    mkdir("test_watch/m-x", 0755);
+    write_test_file("test_watch/m-x/g.txt");
+    assert(each_file_watch_run(&watch, 10) == 0);
+    assert(c.count == 2);
+    each_file_watch_close(&watch);
+    unlink("test_watch/m-x/g.txt");
+    rmdir("test_watch/m-x");
+    unlink("test_watch/m/f.txt");
+    rmdir("test_watch/m");
+
+    rmdir("test_watch");
+}
+#endif
+
 int main() {
     test_each_file_simple();
     test_each_file_with_flags();
+    test_each_file_dir_error();
     test_each_file_no_matching_files();
     test_each_file_multiple_filters();
+    test_each_file_sort_inode();
+    test_each_file_manifest();
+    test_each_file_dir_cache();
+    test_each_file_magic();
+    test_each_file_lazy_stream();
+    test_each_file_prefetch();
+    test_each_file_shard();
+    test_each_file_checkpoint();
+    test_each_file_control();
+    test_each_file_iter();
+    test_each_file_predicate();
+    test_each_file_stats();
+    test_each_file_parallel();
+    test_each_file_ordered();
+    test_each_file_batch();
+    test_each_file_snapshot();
+    test_each_file_reduce();
+    test_each_file_throttle();
+    test_each_file_sample();
+#ifndef WIN32
+    test_each_file_links();
+    test_each_file_dedup();
+    test_each_file_processes();
+#endif
+#ifdef __linux__
+    test_each_file_watch();
+#endif
 
     printf("All tests passed.\n");
     return 0;
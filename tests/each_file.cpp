@@ -0,0 +1,80 @@
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ranges>
+#include <string>
+#include <system_error>
+#include "../each_file.hpp"
+
+void test_walk_range(void) {
+    int count = 0;
+    size_t bytes = 0;
+    for(streamlib::entry &e : streamlib::walk("test_directory", {".txt", ".jpg"})) {
+        char buf[256];
+        ssize_t n;
+        while((n = e.read(buf, sizeof(buf))) > 0)
+            bytes += n;
+        count++;
+    }
+    assert(count == 6);
+    assert(bytes == 5 * 7 + 9);
+}
+
+void test_walk_views(void) {
+    // leaving the range early stops the walk
+    auto subdir = [](const streamlib::entry &e) { return e.dirname().ends_with("test_subdir"); };
+    int count = 0;
+    for(streamlib::entry &e : streamlib::walk("test_directory", {".txt"}) | std::views::filter(subdir) | std::views::take(1)) {
+        assert(e.basename().starts_with("text"));
+        assert(e.ext() == "txt");
+        count++;
+    }
+    assert(count == 1);
+
+    // the callback result of an entry controls the walk
+    count = 0;
+    for(streamlib::entry &e : streamlib::walk("test_directory", {".txt"}, EF_RECURSE_DIRS)) {
+        assert(!e.stream());
+        e.stop();
+        count++;
+    }
+    assert(count == 1);
+
+    bool thrown = false;
+    try {
+        for(streamlib::entry &e : streamlib::walk("does_not_exist", {".txt"}))
+            (void)e;
+    } catch(const std::system_error &err) {
+        thrown = err.code().value() == ENOENT;
+    }
+    assert(thrown);
+
+    // every failure of the walk is thrown, not only those above 1
+    struct each_file_options opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.threads = 2;
+    thrown = false;
+    try {
+        for(streamlib::entry &e : streamlib::walk("test_directory", {".txt"}, EF_RECURSE_DIRS, &opts))
+            (void)e;
+    } catch(const std::system_error &err) {
+        thrown = err.code().value() == EINVAL;
+    }
+    assert(thrown);
+
+    // a root file that matches nothing is an empty range
+    count = 0;
+    for(streamlib::entry &e : streamlib::walk("test_directory/test.jpg", {".txt"}))
+        (void)e, count++;
+    assert(count == 0);
+}
+
+int main() {
+    static_assert(std::ranges::input_range<streamlib::generator<streamlib::entry>>);
+    static_assert(std::ranges::view<streamlib::generator<streamlib::entry>>);
+    test_walk_range();
+    test_walk_views();
+    printf("All tests passed!\n");
+    return 0;
+}
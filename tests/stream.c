@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include "../stream.h"
@@ -63,6 +64,101 @@ void test_file_stream_write_read() {
 	assert(stream_close((struct stream *)&fstream) == 0);
 }
 
+// Lazy Stream Tests
+void test_lazy_stream() {
+	struct lazy_stream lstream;
+	assert(lazy_stream_init_file(&lstream, "nonexistent.txt", "rb", 0) == 0);
+	assert(!lazy_stream_is_open(&lstream));
+	char buffer[20];
+	assert(stream_read((struct stream *)&lstream, buffer, sizeof(buffer)) == -1);
+	assert(lstream.stream._errno == ENOENT);
+	assert(stream_close((struct stream *)&lstream) == 0);
+
+	// never opened if never accessed
+	assert(lazy_stream_init_file(&lstream, "test.txt", "rb", 0) == 0);
+	assert(stream_close((struct stream *)&lstream) == 0);
+	assert(!lazy_stream_is_open(&lstream));
+
+	const char *data = "Hello, StreamLib!";
+	assert(lazy_stream_init_file(&lstream, "test.txt", "rb", 0) == 0);
+	assert(stream_read((struct stream *)&lstream, buffer, strlen(data)) == (ssize_t)strlen(data));
+	assert(lazy_stream_is_open(&lstream));
+	assert(!memcmp(buffer, data, strlen(data)));
+	assert(stream_close((struct stream *)&lstream) == 0);
+}
+
+// Bit Reader and Writer Tests
+static uint64_t bit_test_next(uint64_t *state) {
+	*state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+	return *state >> 11;
+}
+
+void test_bit_stream() {
+	uint8_t known[] = { 0xa5, 0x0f };
+	struct mem_stream mstream;
+	struct bit_reader reader;
+	mem_stream_init(&mstream, known, sizeof(known), 0);
+	assert(bit_reader_init(&reader, (struct stream *)&mstream, 0) == 0);
+	assert(bit_reader_read(&reader, 4) == 0xa);
+	assert(bit_reader_read(&reader, 8) == 0x50);
+	assert(bit_reader_tell(&reader) == 12);
+	assert(bit_reader_read(&reader, 8) == 0xf0);
+	assert(reader.past_end);
+	bit_reader_destroy(&reader);
+	mem_stream_init(&mstream, known, sizeof(known), 0);
+	assert(bit_reader_init(&reader, (struct stream *)&mstream, BIT_LSB_FIRST | BIT_MAP) == 0);
+	assert(!reader.buf);
+	assert(bit_reader_read(&reader, 4) == 0x5);
+	assert(bit_reader_read(&reader, 8) == 0xfa);
+	assert(!reader.past_end);
+	bit_reader_destroy(&reader);
+
+	// a mapped file is unmapped when the reader is destroyed
+	struct file_stream fstream;
+	assert(file_stream_init(&fstream, "test_bits.bin", "w+b", 0) == 0);
+	assert(stream_write((struct stream *)&fstream, known, sizeof(known)) == sizeof(known));
+	assert(stream_seek((struct stream *)&fstream, 1, SEEK_SET) == 0);
+	assert(bit_reader_init(&reader, (struct stream *)&fstream, BIT_MAP) == 0);
+	assert(!reader.buf && reader.mapped);
+	assert(bit_reader_read(&reader, 8) == 0x0f);
+	assert(!reader.past_end);
+	bit_reader_destroy(&reader);
+	assert(!fstream.stream.mem);
+	assert(stream_close((struct stream *)&fstream) == 0);
+	remove("test_bits.bin");
+
+	// fields of every width, through more than one read buffer
+	for(int flags = 0; flags <= (BIT_LSB_FIRST | BIT_MAP); flags++) {
+		struct bit_writer writer;
+		mem_stream_init(&mstream, 0, 0, 0);
+		assert(bit_writer_init(&writer, (struct stream *)&mstream, flags & BIT_LSB_FIRST) == 0);
+		uint64_t state = 1, total = 0;
+		for(int i = 0; i < 20000; i++) {
+			unsigned n = 1 + bit_test_next(&state) % BIT_MAX_BITS;
+			bit_writer_write(&writer, bit_test_next(&state), n);
+			total += n;
+		}
+		assert(bit_writer_flush(&writer) == 0);
+		bit_writer_destroy(&writer);
+
+		assert(stream_seek((struct stream *)&mstream, 0, SEEK_SET) == 0);
+		assert(bit_reader_init(&reader, (struct stream *)&mstream, flags) == 0);
+		state = 1;
+		for(int i = 0; i < 20000; i++) {
+			unsigned n = 1 + bit_test_next(&state) % BIT_MAX_BITS;
+			uint64_t value = bit_test_next(&state) & (((uint64_t)1 << n) - 1);
+			assert(bit_reader_peek(&reader, n) == value);
+			assert(bit_reader_read(&reader, n) == value);
+		}
+		assert(bit_reader_tell(&reader) == total);
+		bit_reader_align(&reader);
+		assert(bit_reader_tell(&reader) == (total + 7) / 8 * 8);
+		assert(!reader.past_end);
+		bit_reader_destroy(&reader);
+		stream_close((struct stream *)&mstream);
+	}
+}
+
 // Main function to run all tests
 int main() {
 	// Memory Stream Tests
@@ -73,6 +169,12 @@ int main() {
 	test_file_stream_init();
 	test_file_stream_write_read();
 
+	// Lazy Stream Tests
+	test_lazy_stream();
+
+	// Bit Reader and Writer Tests
+	test_bit_stream();
+
 	printf("All tests passed!\n");
 	return 0;
 }
@@ -0,0 +1,49 @@
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "throttle.h"
+#include "util.h"
+
+int throttle_init(struct throttle *throttle, uint64_t bytes_per_sec, uint64_t opens_per_sec) {
+	memset(throttle, 0, sizeof(*throttle));
+	uint64_t now = monotonic_ns();
+	throttle->bytes.rate = bytes_per_sec;
+	throttle->bytes.tokens = bytes_per_sec;
+	throttle->bytes.last_ns = now;
+	throttle->opens.rate = opens_per_sec;
+	throttle->opens.tokens = opens_per_sec;
+	throttle->opens.last_ns = now;
+	return pthread_mutex_init(&throttle->lock, 0);
+}
+
+// take n tokens, returns the nanoseconds until the bucket is out of debt
+static uint64_t throttle_take(struct throttle_bucket *b, uint64_t n) {
+	uint64_t now = monotonic_ns();
+	b->tokens += (double)(now - b->last_ns) * b->rate / 1e9;
+	b->last_ns = now;
+	if(b->tokens > b->rate) b->tokens = b->rate;
+	b->tokens -= n;
+	return b->tokens >= 0 ? 0 : (uint64_t)(-b->tokens * 1e9 / b->rate);
+}
+
+static void throttle_charge(struct throttle *throttle, struct throttle_bucket *b, uint64_t n) {
+	if(!b->rate || !n) return;
+	pthread_mutex_lock(&throttle->lock);
+	uint64_t wait = throttle_take(b, n);
+	pthread_mutex_unlock(&throttle->lock);
+	struct timespec ts = { (time_t)(wait / 1000000000), (long)(wait % 1000000000) };
+	while(wait && nanosleep(&ts, &ts) < 0 && errno == EINTR);
+}
+
+void throttle_bytes(struct throttle *throttle, uint64_t n) {
+	throttle_charge(throttle, &throttle->bytes, n);
+}
+
+void throttle_open(struct throttle *throttle) {
+	throttle_charge(throttle, &throttle->opens, 1);
+}
+
+void throttle_destroy(struct throttle *throttle) {
+	pthread_mutex_destroy(&throttle->lock);
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/**
+ * @struct throttle
+ * @brief Token buckets limiting bytes and opens per second, shared by the threads of a walk.
+ *
+ * Each bucket holds up to one second of its rate. A charge is taken even
+ * when the bucket runs short, and the caller then sleeps until the debt
+ * is paid back, so large reads are limited as well as small ones and
+ * concurrent callers queue up behind each other's debt.
+ */
+struct throttle {
+	pthread_mutex_t lock;
+	struct throttle_bucket {
+		uint64_t rate;       /**< Per second, 0 for no limit */
+		double tokens;
+		uint64_t last_ns;
+	} bytes, opens;
+};
+
+/**
+ * @brief Initialize full buckets.
+ * @param throttle Pointer to the throttle object.
+ * @param bytes_per_sec Bytes per second, 0 for no limit.
+ * @param opens_per_sec Opens per second, 0 for no limit.
+ * @return Status code.
+ */
+int throttle_init(struct throttle *throttle, uint64_t bytes_per_sec, uint64_t opens_per_sec);
+
+/**
+ * @brief Charge bytes that were read, sleeping while over the rate.
+ * @param throttle Pointer to the throttle object.
+ * @param n Number of bytes.
+ */
+void throttle_bytes(struct throttle *throttle, uint64_t n);
+
+/**
+ * @brief Charge an open, sleeping while over the rate.
+ * @param throttle Pointer to the throttle object.
+ */
+void throttle_open(struct throttle *throttle);
+
+/**
+ * @brief Release the throttle.
+ * @param throttle Pointer to the throttle object.
+ */
+void throttle_destroy(struct throttle *throttle);
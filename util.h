@@ -1,4 +1,36 @@
 #pragma once
 
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+#if defined(__APPLE__)
+#define STAT_MTIME_NS(st) ((int64_t)(st)->st_mtimespec.tv_sec * 1000000000 + (st)->st_mtimespec.tv_nsec)
+#define STAT_CTIME_NS(st) ((int64_t)(st)->st_ctimespec.tv_sec * 1000000000 + (st)->st_ctimespec.tv_nsec)
+#elif defined(WIN32)
+#define STAT_MTIME_NS(st) ((int64_t)(st)->st_mtime * 1000000000)
+#define STAT_CTIME_NS(st) ((int64_t)(st)->st_ctime * 1000000000)
+#else
+#define STAT_MTIME_NS(st) ((int64_t)(st)->st_mtim.tv_sec * 1000000000 + (st)->st_mtim.tv_nsec)
+#define STAT_CTIME_NS(st) ((int64_t)(st)->st_ctim.tv_sec * 1000000000 + (st)->st_ctim.tv_nsec)
+#endif
+
+#define FNV1A64_INIT 0xcbf29ce484222325ULL
+
+static inline uint64_t fnv1a64(uint64_t h, const void *data, size_t len) {
+	const uint8_t *p = data;
+	for(size_t i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static inline uint64_t monotonic_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
@@ -179,6 +179,7 @@ int zip_file_stream_init_index(struct zip_file_stream *stream, zip_t *zip, int i
 			stream->z_position = 0;
 			if(inflateInit2(&stream->z_stream, 0x20 | 15) != Z_OK)
 				return -5;
+			stream->stream.flags |= STREAM_IS_GZIPPED;
 			stream->stream.write = mem_stream_write_gz;
 			stream->stream.read = mem_stream_read_gz;
 			stream->stream.seek = mem_stream_seek_gz;